@@ -0,0 +1,318 @@
+#include "access_log.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/**
+ * The maximum length of a formatted line, every byte of the texts may need a six byte escape
+ */
+#define ACCESS_LOG_MAX_LINE_LEN (512 + 6 * (ACCESS_LOG_MAX_TARGET_LEN + 2 * ACCESS_LOG_MAX_TOKEN_LEN))
+
+/**
+ * The room for a formatted timestamp
+ */
+#define ACCESS_LOG_TIMESTAMP_SIZE 40
+
+/**
+ * A record as it is written to a ring
+ */
+struct access_entry {
+  /**
+   * The record
+   */
+  struct access_record record;
+  /**
+   * The method, target and version
+   */
+  char text[ACCESS_LOG_MAX_TARGET_LEN + 2 * ACCESS_LOG_MAX_TOKEN_LEN];
+};
+
+/**
+ * Returns a length truncated to a maximum
+ */
+static uint16_t truncate_length(uint16_t len, size_t max) {
+  return len > max ? (uint16_t)max : len;
+}
+
+/**
+ * Escapes text for a quoted field, control characters and bytes outside ASCII as \xHH in the Common Log Format
+ * and as \u00HH in JSON
+ * Returns the length of the escaped text
+ */
+static size_t escape_access_text(char * dest, const char * src, size_t len, enum access_log_format format) {
+  static const char digits[] = "0123456789abcdef";
+  size_t n = 0;
+  for(size_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char)src[i];
+    if(c == '"' || c == '\\') {
+      dest[n++] = '\\';
+      dest[n++] = (char)c;
+    } else if(c < 0x20 || c >= 0x7f) {
+      dest[n++] = '\\';
+      if(format == ACCESS_LOG_FORMAT_JSON) {
+	memcpy(dest + n, "u00", 3);
+	n += 3;
+      } else {
+	dest[n++] = 'x';
+      }
+      dest[n++] = digits[c >> 4];
+      dest[n++] = digits[c & 0xf];
+    } else {
+      dest[n++] = (char)c;
+    }
+  }
+  return n;
+}
+
+/**
+ * Returns a duration in microseconds
+ */
+static unsigned long long get_microseconds(uint64_t nanoseconds) {
+  return (unsigned long long)(nanoseconds / 1000);
+}
+
+/**
+ * Writes the batch to the output
+ * Lines that cannot be written are lost
+ */
+static void flush_access_batch(struct access_log * a) {
+  size_t written = 0;
+  while(written < a->batch_len) {
+    ssize_t len = write(a->fd, a->batch + written, a->batch_len - written);
+    if(len == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      LOG_ERRNO("could not write access log");
+      break;
+    }
+    written += (size_t)len;
+  }
+  a->batch_len = 0;
+}
+
+/**
+ * Formats a record into a line
+ * Returns the length of the line
+ */
+static size_t format_access_entry(const struct access_log * a, const struct access_entry * entry, const char * timestamp, char * line) {
+  const struct access_record * r = &entry->record;
+  const char * method = entry->text;
+  const char * target = method + r->method_len;
+  const char * version = target + r->target_len;
+  char * p = line;
+  if(a->format == ACCESS_LOG_FORMAT_JSON) {
+    p += sprintf(p, "{\"time\":\"%s\",\"client\":\"%s\",\"method\":\"", timestamp, r->client);
+    p += escape_access_text(p, method, r->method_len, a->format);
+    p += sprintf(p, "\",\"target\":\"");
+    p += escape_access_text(p, target, r->target_len, a->format);
+    p += sprintf(p, "\",\"version\":\"");
+    p += escape_access_text(p, version, r->version_len, a->format);
+    p += sprintf(p, "\",\"status\":%d,\"bytes\":%zu,\"read_us\":%llu,\"queue_us\":%llu,\"parse_us\":%llu,\"handle_us\":%llu,\"write_us\":%llu}\n",
+		 r->status, r->bytes, get_microseconds(r->read_time), get_microseconds(r->queue_time), get_microseconds(r->parse_time),
+		 get_microseconds(r->handle_time), get_microseconds(r->write_time));
+  } else {
+    p += sprintf(p, "%s - - [%s] \"", r->client, timestamp);
+    if(r->method_len == 0) {
+      // the request line could not be parsed
+      *p++ = '-';
+    } else {
+      p += escape_access_text(p, method, r->method_len, a->format);
+      *p++ = ' ';
+      p += escape_access_text(p, target, r->target_len, a->format);
+      *p++ = ' ';
+      p += escape_access_text(p, version, r->version_len, a->format);
+    }
+    p += sprintf(p, "\" %d %zu read_us=%llu queue_us=%llu parse_us=%llu handle_us=%llu write_us=%llu\n",
+		 r->status, r->bytes, get_microseconds(r->read_time), get_microseconds(r->queue_time), get_microseconds(r->parse_time),
+		 get_microseconds(r->handle_time), get_microseconds(r->write_time));
+  }
+  return (size_t)(p - line);
+}
+
+/**
+ * Formats the current time for the lines of a batch, read from the coarse clock once per batch
+ */
+static void format_access_timestamp(const struct access_log * a, char * timestamp) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  struct tm tm;
+  gmtime_r(&now.tv_sec, &tm);
+  if(a->format == ACCESS_LOG_FORMAT_JSON) {
+    size_t len = strftime(timestamp, ACCESS_LOG_TIMESTAMP_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(timestamp + len, ACCESS_LOG_TIMESTAMP_SIZE - len, ".%03ldZ", now.tv_nsec / 1000000);
+  } else {
+    strftime(timestamp, ACCESS_LOG_TIMESTAMP_SIZE, "%d/%b/%Y:%H:%M:%S +0000", &tm);
+  }
+}
+
+/**
+ * Formats the records in all rings into the batch, writing it whenever it is full
+ * Returns the number of records formatted
+ */
+static size_t append_access_rings(struct access_log * a, struct access_entry * entry, char * line) {
+  char timestamp[ACCESS_LOG_TIMESTAMP_SIZE];
+  format_access_timestamp(a, timestamp);
+  size_t count = 0;
+  for(size_t i = 0; i < a->ring_count; ++i) {
+    while(pop_ring_record(a->rings + i, entry, sizeof(struct access_entry)) != -1) {
+      size_t len = format_access_entry(a, entry, timestamp, line);
+      if(a->batch_len + len > ACCESS_LOG_BATCH_SIZE) {
+	flush_access_batch(a);
+      }
+      memcpy(a->batch + a->batch_len, line, len);
+      a->batch_len += len;
+      ++count;
+    }
+  }
+  return count;
+}
+
+/**
+ * Returns whether any ring holds records
+ */
+static bool has_access_records(struct access_log * a) {
+  for(size_t i = 0; i < a->ring_count; ++i) {
+    if(!is_ring_empty(a->rings + i)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Writer thread function
+ */
+static void * write_access_log(void * data) {
+  struct access_log * a = (struct access_log *)data;
+  struct access_entry entry;
+  char line[ACCESS_LOG_MAX_LINE_LEN];
+  while(true) {
+    // requests recorded before the log was disposed are still written
+    bool stopping = !atomic_load(&a->running);
+    if(append_access_rings(a, &entry, line) != 0) {
+      continue;
+    }
+    flush_access_batch(a);
+    uint64_t dropped = atomic_exchange_explicit(&a->dropped, 0, memory_order_relaxed);
+    if(dropped != 0) {
+      LOG_WARNING("dropped %llu access log record(s) from a full ring", (unsigned long long)dropped);
+    }
+    if(stopping) {
+      break;
+    }
+    uint32_t key = prepare_eventcount_wait(&a->recorded);
+    if(!atomic_load(&a->running) || has_access_records(a)) {
+      cancel_eventcount_wait(&a->recorded);
+      continue;
+    }
+    wait_eventcount(&a->recorded, key, NULL);
+  }
+  return NULL;
+}
+
+int init_access_log(struct access_log * a, const char * path, enum access_log_format format, size_t ring_count) {
+  assert(a != NULL);
+  assert(path != NULL);
+  assert(ring_count != 0);
+
+  if(strcmp(path, "-") == 0) {
+    a->fd = dup(STDOUT_FILENO);
+  } else {
+    a->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  }
+  if(a->fd == -1) {
+    LOG_ERRNO("could not open access log");
+    return -1;
+  }
+  a->format = format;
+  a->batch = NULL;
+  a->ring_count = 0;
+  atomic_init(&a->running, false);
+  a->rings = (struct ring *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct ring) * ring_count);
+  if(a->rings == NULL) {
+    LOG_ERRNO("could not allocate access log rings");
+    close(a->fd);
+    return -1;
+  }
+  for(a->ring_count = 0; a->ring_count < ring_count; ++a->ring_count) {
+    if(init_ring(a->rings + a->ring_count, ACCESS_LOG_RING_SIZE)) {
+      LOG_ERRNO("could not allocate access log ring");
+      dispose_access_log(a);
+      return -1;
+    }
+  }
+  atomic_init(&a->dropped, 0);
+  a->batch = (char *)malloc(ACCESS_LOG_BATCH_SIZE);
+  if(a->batch == NULL) {
+    LOG_ERRNO("could not allocate access log batch");
+    dispose_access_log(a);
+    return -1;
+  }
+  a->batch_len = 0;
+  init_eventcount(&a->recorded);
+  atomic_store(&a->running, true);
+  int result;
+  if((result = pthread_create(&a->writer, NULL, write_access_log, a))) {
+    LOG_ERROR_CODE("could not create access log writer", result);
+    atomic_store(&a->running, false);
+    dispose_access_log(a);
+    return -1;
+  }
+  return 0;
+}
+
+void log_access(struct access_log * a, size_t ring, const struct access_record * r,
+		const char * method, const char * target, const char * version) {
+  assert(a != NULL);
+  assert(ring < a->ring_count);
+  assert(r != NULL);
+
+  struct access_entry entry;
+  entry.record = *r;
+  entry.record.method_len = truncate_length(r->method_len, ACCESS_LOG_MAX_TOKEN_LEN);
+  entry.record.target_len = truncate_length(r->target_len, ACCESS_LOG_MAX_TARGET_LEN);
+  entry.record.version_len = truncate_length(r->version_len, ACCESS_LOG_MAX_TOKEN_LEN);
+  char * p = entry.text;
+  memcpy(p, method, entry.record.method_len);
+  p += entry.record.method_len;
+  memcpy(p, target, entry.record.target_len);
+  p += entry.record.target_len;
+  memcpy(p, version, entry.record.version_len);
+  p += entry.record.version_len;
+  // the event loop never waits for the writer
+  if(push_ring_record(a->rings + ring, &entry, (size_t)(p - (char *)&entry))) {
+    atomic_fetch_add_explicit(&a->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  notify_eventcount(&a->recorded, 1);
+}
+
+void dispose_access_log(struct access_log * a) {
+  assert(a != NULL);
+
+  if(atomic_load(&a->running)) {
+    atomic_store(&a->running, false);
+    notify_eventcount(&a->recorded, INT_MAX);
+    pthread_join(a->writer, NULL);
+  }
+  free(a->batch);
+  a->batch = NULL;
+  for(size_t i = 0; i < a->ring_count; ++i) {
+    dispose_ring(a->rings + i);
+  }
+  free(a->rings);
+  a->rings = NULL;
+  a->ring_count = 0;
+  close(a->fd);
+}
@@ -0,0 +1,169 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "eventcount.h"
+#include "ring.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The size of the ring of records of each producer in bytes
+ */
+#define ACCESS_LOG_RING_SIZE 262144
+
+/**
+ * The size of the buffer the writer formats records into before writing them in bytes
+ */
+#define ACCESS_LOG_BATCH_SIZE 65536
+
+/**
+ * The room for the text form of a client address, IPv6 included
+ */
+#define ACCESS_LOG_CLIENT_LEN 48
+
+/**
+ * The maximum number of bytes of a request target kept in a record, longer targets are truncated
+ */
+#define ACCESS_LOG_MAX_TARGET_LEN 2048
+
+/**
+ * The maximum number of bytes of a method or protocol version kept in a record
+ */
+#define ACCESS_LOG_MAX_TOKEN_LEN 32
+
+/**
+ * The formats of the access log
+ */
+enum access_log_format {
+  /**
+   * The Common Log Format, followed by the durations of the phases of the request
+   */
+  ACCESS_LOG_FORMAT_COMMON,
+  /**
+   * One JSON object per line
+   */
+  ACCESS_LOG_FORMAT_JSON
+};
+
+/**
+ * A served request, followed in its ring by the method, target and version
+ * Durations are in nanoseconds
+ */
+struct access_record {
+  /**
+   * The client address
+   */
+  char client[ACCESS_LOG_CLIENT_LEN];
+  /**
+   * The status code of the response
+   */
+  int status;
+  /**
+   * The length of the method
+   */
+  uint16_t method_len;
+  /**
+   * The length of the target
+   */
+  uint16_t target_len;
+  /**
+   * The length of the protocol version
+   */
+  uint16_t version_len;
+  /**
+   * The length of the response
+   */
+  size_t bytes;
+  /**
+   * The time from the first byte received to the complete request
+   */
+  uint64_t read_time;
+  /**
+   * The time the request waited for a worker thread
+   */
+  uint64_t queue_time;
+  /**
+   * The time spent parsing the request on the worker thread
+   */
+  uint64_t parse_time;
+  /**
+   * The time spent handling the request
+   */
+  uint64_t handle_time;
+  /**
+   * The time spent sending the response
+   */
+  uint64_t write_time;
+};
+
+/**
+ * A log of the served requests, written by a dedicated thread apart from the diagnostic logger
+ * Every producer thread records requests into its own ring, a full ring drops records
+ */
+struct access_log {
+  /**
+   * The output file descriptor
+   */
+  int fd;
+  /**
+   * The format
+   */
+  enum access_log_format format;
+  /**
+   * The rings, one per producer
+   */
+  struct ring * rings;
+  /**
+   * The number of rings
+   */
+  size_t ring_count;
+  /**
+   * The number of records dropped because a ring was full
+   */
+  _Atomic uint64_t dropped;
+  /**
+   * The lines formatted and not written yet
+   */
+  char * batch;
+  /**
+   * The length of the lines in the batch
+   */
+  size_t batch_len;
+  /**
+   * The event the writer waits on until requests are recorded
+   */
+  struct eventcount recorded;
+  /**
+   * Whether the writer is running
+   */
+  atomic_bool running;
+  /**
+   * The writer thread
+   */
+  pthread_t writer;
+};
+
+/**
+ * Opens an access log at a path, - for the standard output, with one ring for each of the producers
+ * and starts its writer
+ */
+int init_access_log(struct access_log * a, const char * path, enum access_log_format format, size_t ring_count);
+
+/**
+ * Records a served request in the ring of a producer, without locking, allocating or formatting
+ * The lengths of the method, target and version are those in the record, truncated to the maximum lengths
+ * Must only be called by the producer owning the ring
+ */
+void log_access(struct access_log * a, size_t ring, const struct access_record * r,
+		const char * method, const char * target, const char * version);
+
+/**
+ * Stops the writer once all records have been written and closes the access log
+ */
+void dispose_access_log(struct access_log * a);
+
+#endif
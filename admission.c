@@ -0,0 +1,47 @@
+#include "admission.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Returns the current time in nanoseconds on the monotonic clock
+ */
+static uint64_t get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void init_admission_control(struct admission_control * a, struct task_service * tasks, size_t soft_limit, size_t hard_limit) {
+  assert(a != NULL);
+  assert(tasks != NULL);
+
+  a->tasks = tasks;
+  a->soft_limit = soft_limit;
+  a->hard_limit = hard_limit;
+  a->target = ADMISSION_DEFAULT_TARGET;
+  a->interval = ADMISSION_DEFAULT_INTERVAL;
+  a->interval_end = 0;
+  a->congested = false;
+}
+
+bool check_admission(struct admission_control * a, size_t in_flight) {
+  assert(a != NULL);
+
+  if(a->hard_limit != 0 && in_flight >= a->hard_limit) {
+    return false;
+  }
+  if(a->soft_limit == 0 || in_flight < a->soft_limit) {
+    return true;
+  }
+  uint64_t now = get_time();
+  if(now >= a->interval_end) {
+    // a burst leaves some requests waiting briefly, only a queue that never drains keeps all of them waiting
+    // no request done at all while this many are in flight counts as congested too
+    a->congested = take_min_task_wait(a->tasks) > a->target;
+    a->interval_end = now + a->interval;
+  }
+  return !a->congested;
+}
@@ -0,0 +1,68 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The default time in nanoseconds requests may wait for a worker thread before the queue counts as congested
+ */
+#define ADMISSION_DEFAULT_TARGET 5000000
+
+/**
+ * The default time in nanoseconds over which the shortest wait is compared to the target
+ */
+#define ADMISSION_DEFAULT_INTERVAL 100000000
+
+/**
+ * Decides whether new connections are admitted, from the number of requests in flight
+ * and, in the manner of CoDel, the shortest time requests waited for a worker thread during an interval
+ * Below the soft limit all connections are admitted and at the hard limit none are,
+ * in between they are shed for an interval if no request waited less than the target during the previous one
+ * Only used by the thread running the event loop
+ */
+struct admission_control {
+  /**
+   * The task service the requests wait in
+   */
+  struct task_service * tasks;
+  /**
+   * The number of requests in flight from which connections are shed while the queue is congested, 0 for no limit
+   */
+  size_t soft_limit;
+  /**
+   * The number of requests in flight from which all connections are shed, 0 for no limit
+   */
+  size_t hard_limit;
+  /**
+   * The time in nanoseconds requests may wait before the queue counts as congested
+   */
+  uint64_t target;
+  /**
+   * The time in nanoseconds over which the shortest wait is compared to the target
+   */
+  uint64_t interval;
+  /**
+   * The end of the current interval, in nanoseconds on the monotonic clock
+   */
+  uint64_t interval_end;
+  /**
+   * Whether the queue was congested during the previous interval
+   */
+  bool congested;
+};
+
+/**
+ * Initializes an admission control for the requests waiting in a task service
+ */
+void init_admission_control(struct admission_control * a, struct task_service * tasks, size_t soft_limit, size_t hard_limit);
+
+/**
+ * Returns whether a new connection is admitted while the specified number of requests are in flight
+ */
+bool check_admission(struct admission_control * a, size_t in_flight);
+
+#endif
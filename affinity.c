@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include "affinity.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * The length of the lists read from sysfs and of the CPU lists in the topology report
+ */
+#define AFFINITY_LIST_LEN 4096
+
+/**
+ * Reads a CPU or node list from a sysfs file
+ */
+static int read_list(const char * path, struct cpu_mask * m) {
+  FILE * file = fopen(path, "r");
+  if(file == NULL) {
+    return -1;
+  }
+  char buf[AFFINITY_LIST_LEN];
+  int result = fgets(buf, sizeof(buf), file) == NULL ? -1 : 0;
+  fclose(file);
+  if(result == 0) {
+    buf[strcspn(buf, "\n")] = '\0';
+    result = parse_cpu_list(buf, m);
+  }
+  return result;
+}
+
+/**
+ * Gets the online NUMA nodes, a single node 0 if the topology is unknown
+ */
+static void get_nodes(struct cpu_mask * m) {
+  if(read_list("/sys/devices/system/node/online", m) || get_cpu_mask_count(m) == 0) {
+    clear_cpu_mask(m);
+    add_to_cpu_mask(m, 0);
+  }
+}
+
+void clear_cpu_mask(struct cpu_mask * m) {
+  assert(m != NULL);
+
+  memset(m->bits, 0, sizeof(m->bits));
+}
+
+void add_to_cpu_mask(struct cpu_mask * m, int cpu) {
+  assert(m != NULL);
+  assert(cpu >= 0 && cpu < CPU_MASK_SIZE);
+
+  m->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+}
+
+void remove_from_cpu_mask(struct cpu_mask * m, int cpu) {
+  assert(m != NULL);
+  assert(cpu >= 0 && cpu < CPU_MASK_SIZE);
+
+  m->bits[cpu / 64] &= ~((uint64_t)1 << (cpu % 64));
+}
+
+bool is_in_cpu_mask(const struct cpu_mask * m, int cpu) {
+  assert(m != NULL);
+
+  return cpu >= 0 && cpu < CPU_MASK_SIZE && (m->bits[cpu / 64] & (uint64_t)1 << (cpu % 64)) != 0;
+}
+
+size_t get_cpu_mask_count(const struct cpu_mask * m) {
+  assert(m != NULL);
+
+  size_t count = 0;
+  for(size_t i = 0; i < CPU_MASK_SIZE / 64; ++i) {
+    count += (size_t)__builtin_popcountll(m->bits[i]);
+  }
+  return count;
+}
+
+int get_cpu_in_mask(const struct cpu_mask * m, size_t index) {
+  assert(m != NULL);
+
+  size_t count = get_cpu_mask_count(m);
+  if(count == 0) {
+    return -1;
+  }
+  index %= count;
+  for(int cpu = 0; cpu < CPU_MASK_SIZE; ++cpu) {
+    if(is_in_cpu_mask(m, cpu)) {
+      if(index == 0) {
+	return cpu;
+      }
+      --index;
+    }
+  }
+  return -1;
+}
+
+int parse_cpu_list(const char * list, struct cpu_mask * m) {
+  assert(list != NULL);
+  assert(m != NULL);
+
+  clear_cpu_mask(m);
+  const char * p = list;
+  while(*p != '\0') {
+    char * end;
+    unsigned long first = strtoul(p, &end, 10);
+    if(end == p) {
+      return -1;
+    }
+    unsigned long last = first;
+    if(*end == '-') {
+      p = end + 1;
+      last = strtoul(p, &end, 10);
+      if(end == p) {
+	return -1;
+      }
+    }
+    if(first > last || last >= CPU_MASK_SIZE) {
+      return -1;
+    }
+    for(unsigned long cpu = first; cpu <= last; ++cpu) {
+      add_to_cpu_mask(m, (int)cpu);
+    }
+    if(*end == ',') {
+      ++end;
+    } else if(*end != '\0') {
+      return -1;
+    }
+    p = end;
+  }
+  return 0;
+}
+
+void format_cpu_list(const struct cpu_mask * m, char * buf, size_t len) {
+  assert(m != NULL);
+  assert(buf != NULL && len > 0);
+
+  size_t pos = 0;
+  buf[0] = '\0';
+  for(int cpu = 0; cpu < CPU_MASK_SIZE && pos < len; ++cpu) {
+    if(!is_in_cpu_mask(m, cpu)) {
+      continue;
+    }
+    int last = cpu;
+    while(is_in_cpu_mask(m, last + 1)) {
+      ++last;
+    }
+    int written = last == cpu
+      ? snprintf(buf + pos, len - pos, "%s%d", pos == 0 ? "" : ",", cpu)
+      : snprintf(buf + pos, len - pos, "%s%d-%d", pos == 0 ? "" : ",", cpu, last);
+    pos += (size_t)written;
+    cpu = last;
+  }
+}
+
+int get_allowed_cpus(struct cpu_mask * m) {
+  assert(m != NULL);
+
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(cpu_set_t), &set)) {
+    LOG_ERRNO("could not get process affinity");
+    return -1;
+  }
+  clear_cpu_mask(m);
+  for(int cpu = 0; cpu < CPU_SETSIZE && cpu < CPU_MASK_SIZE; ++cpu) {
+    if(CPU_ISSET(cpu, &set)) {
+      add_to_cpu_mask(m, cpu);
+    }
+  }
+  return 0;
+}
+
+int pin_thread_to_cpu(pthread_t thread, int cpu) {
+  assert(cpu >= 0 && cpu < CPU_SETSIZE);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int result;
+  if((result = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set))) {
+    LOG_ERROR_CODE("could not pin thread", result);
+    return -1;
+  }
+  return 0;
+}
+
+int pin_thread_to_cpus(pthread_t thread, const struct cpu_mask * m) {
+  assert(m != NULL);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int cpu = 0; cpu < CPU_SETSIZE && cpu < CPU_MASK_SIZE; ++cpu) {
+    if(is_in_cpu_mask(m, cpu)) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  int result;
+  if((result = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set))) {
+    LOG_ERROR_CODE("could not pin thread", result);
+    return -1;
+  }
+  return 0;
+}
+
+int get_cpu_node(int cpu) {
+  struct cpu_mask nodes;
+  get_nodes(&nodes);
+  for(int node = 0; node < CPU_MASK_SIZE; ++node) {
+    struct cpu_mask cpus;
+    if(is_in_cpu_mask(&nodes, node) && get_node_cpus(node, &cpus) == 0 && is_in_cpu_mask(&cpus, cpu)) {
+      return node;
+    }
+  }
+  return 0;
+}
+
+int get_node_cpus(int node, struct cpu_mask * m) {
+  assert(m != NULL);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  if(read_list(path, m) == 0) {
+    return 0;
+  }
+  // without NUMA support every CPU is on node 0
+  if(node == 0) {
+    return get_allowed_cpus(m);
+  }
+  return -1;
+}
+
+void report_topology() {
+  struct cpu_mask allowed;
+  if(get_allowed_cpus(&allowed)) {
+    return;
+  }
+  struct cpu_mask nodes;
+  get_nodes(&nodes);
+  char list[AFFINITY_LIST_LEN];
+  format_cpu_list(&allowed, list, sizeof(list));
+  LOG_INFO("detected %zu allowed CPU(s) %s on %zu NUMA node(s)", get_cpu_mask_count(&allowed), list, get_cpu_mask_count(&nodes));
+  for(int node = 0; node < CPU_MASK_SIZE; ++node) {
+    struct cpu_mask cpus;
+    if(is_in_cpu_mask(&nodes, node) && get_node_cpus(node, &cpus) == 0) {
+      format_cpu_list(&cpus, list, sizeof(list));
+      LOG_INFO("NUMA node %d has CPU(s) %s", node, list);
+    }
+  }
+}
+
+void * allocate_node_memory(size_t size, int node) {
+  void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(data == MAP_FAILED) {
+    LOG_ERRNO("could not map memory");
+    return NULL;
+  }
+  if(node >= 0 && node < CPU_MASK_SIZE) {
+    // the pages are placed when first touched, the policy must be set before
+    unsigned long nodes[CPU_MASK_SIZE / (8 * sizeof(unsigned long))] = {0};
+    nodes[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind, data, size, MPOL_PREFERRED, nodes, CPU_MASK_SIZE, 0)) {
+      // only a placement hint, the memory is still usable
+      LOG_ERRNO("could not bind memory to NUMA node");
+    }
+  }
+  return data;
+}
+
+void free_node_memory(void * data, size_t size) {
+  if(data != NULL && munmap(data, size)) {
+    LOG_ERRNO("could not unmap memory");
+  }
+}
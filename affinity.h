@@ -0,0 +1,111 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/**
+ * The size of a cache line, data written by different threads is aligned to it to avoid false sharing
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * The maximum number of CPUs a mask can hold
+ */
+#define CPU_MASK_SIZE 1024
+
+/**
+ * A set of CPUs
+ */
+struct cpu_mask {
+  /**
+   * One bit per CPU
+   */
+  uint64_t bits[CPU_MASK_SIZE / 64];
+};
+
+/**
+ * Empties a CPU mask
+ */
+void clear_cpu_mask(struct cpu_mask * m);
+
+/**
+ * Adds a CPU to a mask
+ */
+void add_to_cpu_mask(struct cpu_mask * m, int cpu);
+
+/**
+ * Removes a CPU from a mask
+ */
+void remove_from_cpu_mask(struct cpu_mask * m, int cpu);
+
+/**
+ * Returns whether a CPU is in a mask
+ */
+bool is_in_cpu_mask(const struct cpu_mask * m, int cpu);
+
+/**
+ * Returns the number of CPUs in a mask
+ */
+size_t get_cpu_mask_count(const struct cpu_mask * m);
+
+/**
+ * Returns the CPU at the specified index in a mask, the index wraps around
+ * Returns -1 if the mask is empty
+ */
+int get_cpu_in_mask(const struct cpu_mask * m, size_t index);
+
+/**
+ * Parses a CPU list such as 0-3,8,10-11 into a mask
+ */
+int parse_cpu_list(const char * list, struct cpu_mask * m);
+
+/**
+ * Formats a mask as a CPU list, truncating it if the buffer is too small
+ */
+void format_cpu_list(const struct cpu_mask * m, char * buf, size_t len);
+
+/**
+ * Gets the CPUs the process is allowed to run on
+ */
+int get_allowed_cpus(struct cpu_mask * m);
+
+/**
+ * Pins a thread to a single CPU
+ */
+int pin_thread_to_cpu(pthread_t thread, int cpu);
+
+/**
+ * Restricts a thread to a set of CPUs
+ */
+int pin_thread_to_cpus(pthread_t thread, const struct cpu_mask * m);
+
+/**
+ * Returns the NUMA node a CPU belongs to, 0 if the topology is unknown
+ */
+int get_cpu_node(int cpu);
+
+/**
+ * Gets the CPUs of a NUMA node
+ */
+int get_node_cpus(int node, struct cpu_mask * m);
+
+/**
+ * Logs the CPUs and NUMA nodes detected
+ */
+void report_topology();
+
+/**
+ * Allocates zeroed, page aligned memory preferably placed on a NUMA node, -1 for no preference
+ */
+void * allocate_node_memory(size_t size, int node);
+
+/**
+ * Frees memory allocated on a NUMA node
+ */
+void free_node_memory(void * data, size_t size);
+
+#endif
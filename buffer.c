@@ -1,11 +1,14 @@
 #include "buffer.h"
 #include "logger.h"
+#include "scan.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #define TEXT_BUFFER_INITIAL_CAP 256
@@ -28,17 +31,64 @@ static int grow_text_buffer(struct text_buffer * b) {
   return 0;
 }
 
+/**
+ * Receives as much data as is available into the space past the read ahead bytes
+ * Returns the number of bytes received or -1 on error
+ */
+static ssize_t fill_text_buffer(struct text_buffer * b, int fd) {
+  assert(b != NULL);
+
+  if(b->len + b->ahead == b->cap) {
+    if(grow_text_buffer(b)) {
+      return -1;
+    }
+  }
+  ssize_t result;
+  do {
+    result = recv(fd, b->data + b->len + b->ahead, b->cap - b->len - b->ahead, 0);
+  } while(result < 0 && errno == EINTR);
+  if(result == 0) {
+    // the peer closed the connection
+    errno = ECONNRESET;
+    return -1;
+  }
+  if(result > 0) {
+    b->ahead += (size_t)result;
+  }
+  return result;
+}
+
+void consume_read_ahead(struct text_buffer * b, size_t len) {
+  assert(b != NULL);
+  assert(len <= b->ahead);
+
+  b->len += len;
+  b->ahead -= len;
+}
+
 void init_text_buffer(struct text_buffer * b) {
   assert(b != NULL);
   
   b->data = NULL;
   b->len = 0;
   b->cap = 0;
+  b->ahead = 0;
 }
 
 void clear_text_buffer(struct text_buffer * b) {
   assert(b != NULL);
+
+  if(b->ahead != 0 && b->len != 0) {
+    memmove(b->data, b->data + b->len, b->ahead);
+  }
+  b->len = 0;
+}
+
+void reset_text_buffer(struct text_buffer * b) {
+  assert(b != NULL);
+
   b->len = 0;
+  b->ahead = 0;
 }
 
 void securely_clear_text_buffer(struct text_buffer * b) {
@@ -46,6 +96,7 @@ void securely_clear_text_buffer(struct text_buffer * b) {
   
   memset(b->data, 0, b->cap);
   b->len = 0;
+  b->ahead = 0;
 }
 
 int remove_char(struct text_buffer * b) {
@@ -54,23 +105,57 @@ int remove_char(struct text_buffer * b) {
     return -1;
   } else {
     --b->len;
+    return 0;
   }
 }
 
 int append_char(struct text_buffer * b, char c) {
   assert(b != NULL);
 
-  if(b->len == b->cap) {
+  if(b->len + b->ahead == b->cap) {
     if(grow_text_buffer(b)) {
       return -1;
     }
   }
-
+  if(b->ahead != 0) {
+    memmove(b->data + b->len + 1, b->data + b->len, b->ahead);
+  }
   b->data[b->len] = c;
   ++b->len;
   return 0;
 }
 
+int append_string(struct text_buffer * b, const char * str, size_t len) {
+  assert(b != NULL);
+  assert(str != NULL || len == 0);
+
+  while(b->len + b->ahead + len > b->cap) {
+    if(grow_text_buffer(b)) {
+      return -1;
+    }
+  }
+  if(b->ahead != 0) {
+    memmove(b->data + b->len + len, b->data + b->len, b->ahead);
+  }
+  memcpy(b->data + b->len, str, len);
+  b->len += len;
+  return 0;
+}
+
+int append_read_ahead(struct text_buffer * b, const char * data, size_t len) {
+  assert(b != NULL);
+  assert(data != NULL || len == 0);
+
+  while(b->len + b->ahead + len > b->cap) {
+    if(grow_text_buffer(b)) {
+      return -1;
+    }
+  }
+  memcpy(b->data + b->len + b->ahead, data, len);
+  b->ahead += len;
+  return 0;
+}
+
 int read_char(struct text_buffer * b, int fd, size_t max) {
   assert(b != NULL);
 
@@ -78,17 +163,12 @@ int read_char(struct text_buffer * b, int fd, size_t max) {
     errno = E2BIG;
     return -1;
   }
-  
-  if(b->len == b->cap) {
-    if(grow_text_buffer(b)) {
+  if(b->ahead == 0) {
+    if(fill_text_buffer(b, fd) < 0) {
       return -1;
     }
   }
-  ssize_t result = read(fd, b->data + b->len, 1);
-  if(result != 1) {
-    return -1;
-  }
-  ++b->len;
+  consume_read_ahead(b, 1);
   return 0;
 }
 
@@ -96,20 +176,16 @@ int read_until_char(struct text_buffer * b, int fd, char delim, size_t max) {
   assert(b != NULL);
 
   while(b->len < max) {
-    if(b->len == b->cap) {
-      if(grow_text_buffer(b)) {
-	return -1;
-      }
+    size_t len = b->ahead < max - b->len ? b->ahead : max - b->len;
+    const char * c = scan_for_char(b->data + b->len, len, delim);
+    if(c != NULL) {
+      consume_read_ahead(b, (size_t)(c - (b->data + b->len)) + 1);
+      return 0;
     }
-    ssize_t result = read(fd, b->data + b->len, 1);
-    if(result != 1) {
+    consume_read_ahead(b, len);
+    if(b->len < max && fill_text_buffer(b, fd) < 0) {
       return -1;
     }
-    if(b->data[b->len] == delim) {
-      ++b->len;
-      return 0;
-    }
-    ++b->len;
   }
   errno = E2BIG;
   return -1;
@@ -124,28 +200,72 @@ int read_until_string(struct text_buffer * b, int fd, const char * delim, size_t
     errno = EINVAL;
     return -1;
   }
-  
+  size_t delim_len = strlen(delim);
+  // the position where the search for the delimiter resumes
+  size_t from = b->len;
   while(true) {
-    if(read_until_char(b, fd, *delim, max)) {
+    size_t end = b->len + b->ahead;
+    const char * d = scan_for_string(b->data + from, end - from, delim, delim_len);
+    if(d != NULL) {
+      size_t len = (size_t)(d - b->data) + delim_len;
+      if(len > max) {
+	break;
+      }
+      consume_read_ahead(b, len - b->len);
+      return 0;
+    }
+    if(end >= max) {
+      break;
+    }
+    // a delimiter may be split between two reads
+    if(end - from >= delim_len) {
+      from = end - delim_len + 1;
+    }
+    if(fill_text_buffer(b, fd) < 0) {
       return -1;
     }
-    const char * d = delim + 1;
-    while(*d != '\0'){
-      if(read_char(b, fd, max)) {
-	return -1;
-      }
-      char c = b->data[b->len - 1]; 
-      if(c != *d){
-	if(c == *delim) {
-	  d = delim;
-	} else {
-	  break;
-	}
+  }
+  errno = E2BIG;
+  return -1;
+}
+
+int receive_into_text_buffer(struct text_buffer * b, int fd, size_t max) {
+  assert(b != NULL);
+
+  while(b->len + b->ahead < max) {
+    size_t space = b->cap - b->len - b->ahead;
+    ssize_t result = fill_text_buffer(b, fd);
+    if(result < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	return 0;
+      } else if(errno == ECONNRESET) {
+	return 1;
       }
-      ++d;
+      return -1;
     }
-    if(*d == '\0') {
-      break;
+    // a short read means the socket has been drained, saving the recv that would fail with EAGAIN
+    if(space != 0 && (size_t)result < space) {
+      return 0;
+    }
+  }
+  errno = E2BIG;
+  return -1;
+}
+
+int send_text_buffer(struct text_buffer * b, int fd, size_t * sent) {
+  assert(b != NULL);
+  assert(sent != NULL);
+
+  while(*sent < b->len) {
+    ssize_t result = send(fd, b->data + *sent, b->len - *sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(result < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	return 1;
+      } else if(errno != EINTR) {
+	return -1;
+      }
+    } else {
+      *sent += (size_t)result;
     }
   }
   return 0;
@@ -19,6 +19,10 @@ struct text_buffer {
    * The capacity of the buffer
    */
   size_t cap;
+  /**
+   * The number of bytes received past the end of the text, kept for the next read
+   */
+  size_t ahead;
 };
 
 /**
@@ -28,9 +32,15 @@ void init_text_buffer(struct text_buffer * b);
 
 /**
  * Clears the buffer
+ * Any data read ahead is moved to the front and kept for the next read
  */
 void clear_text_buffer(struct text_buffer * b);
 
+/**
+ * Clears the buffer, discarding any data read ahead
+ */
+void reset_text_buffer(struct text_buffer * b);
+
 /**
  * Clears the buffer, overwriting any text in it
  */
@@ -41,6 +51,21 @@ void securely_clear_text_buffer(struct text_buffer * buffer);
  */
 int append_char(struct text_buffer * b, char c);
 
+/**
+ * Appends a string of the specified length to the text buffer
+ */
+int append_string(struct text_buffer * b, const char * str, size_t len);
+
+/**
+ * Appends data received by other means than reading from a socket as read ahead data
+ */
+int append_read_ahead(struct text_buffer * b, const char * data, size_t len);
+
+/**
+ * Moves the specified number of read ahead bytes to the text
+ */
+void consume_read_ahead(struct text_buffer * b, size_t len);
+
 /**
  * Reads a single character into the buffer
  */
@@ -55,9 +80,23 @@ int read_until_char(struct text_buffer * b, int fd, char delim, size_t max);
 /**
  * Reads data into the buffer until the specified delimiter is encountered
  * The delimiter is appended to the buffer
+ * Data is received in bulk, any bytes past the delimiter are kept as read ahead
  */
 int read_until_string(struct text_buffer * b, int fd, const char * delim, size_t max);
 
+/**
+ * Receives all data available on a non blocking socket as read ahead data
+ * Returns 0 if the socket would block, 1 if the peer closed the connection and -1 on error
+ * If more than max bytes are buffered, errno is set to E2BIG
+ */
+int receive_into_text_buffer(struct text_buffer * b, int fd, size_t max);
+
+/**
+ * Sends as much of the text in the buffer past the first sent bytes as a socket takes without blocking, advancing sent
+ * Returns 0 once all text is sent, 1 if the socket would block and -1 on error
+ */
+int send_text_buffer(struct text_buffer * b, int fd, size_t * sent);
+
 /**
  * Disposes of the text buffer
  */
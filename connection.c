@@ -1,41 +1,94 @@
 #include "buffer.h"
 #include "connection.h"
 #include "logger.h"
-#include "parser.h"
 
 #include <assert.h>
-#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 /**
- * The connection buffer
+ * The index marking the end of the free list
  */
-static struct connection * connections;
+#define CONNECTION_NO_INDEX UINT32_MAX
 
 /**
- * The max number of connections
+ * Returns the index stored in the free list head
  */
-static size_t max_amount;
+static uint32_t get_head_index(uint64_t head) {
+  return (uint32_t)head;
+}
 
 /**
- * The number of connections in use
+ * Makes a free list head pointing to the specified index, with the tag of the previous head advanced
  */
-static size_t active_amount;
+static uint64_t make_head(uint64_t previous, uint32_t index) {
+  return ((previous >> 32) + 1) << 32 | index;
+}
+
+/**
+ * Adds a connection to the free list
+ */
+static void push_free_connection(struct connection_table * t, struct connection * c) {
+  uint32_t index = (uint32_t)(c - t->connections);
+  uint64_t head = atomic_load_explicit(&t->free_head, memory_order_relaxed);
+  do {
+    atomic_store_explicit(&c->next_free, get_head_index(head), memory_order_relaxed);
+  } while(!atomic_compare_exchange_weak_explicit(&t->free_head, &head, make_head(head, index), memory_order_release, memory_order_relaxed));
+}
 
 /**
- * The mutex protecting the connection data structures
+ * Takes a connection from the free list, returns NULL if there is none
  */
-static pthread_mutex_t mutex;
+static struct connection * pop_free_connection(struct connection_table * t) {
+  uint64_t head = atomic_load_explicit(&t->free_head, memory_order_acquire);
+  uint32_t index;
+  do {
+    index = get_head_index(head);
+    if(index == CONNECTION_NO_INDEX) {
+      return NULL;
+    }
+    // the next index may be stale if the connection was taken meanwhile, the tag makes the exchange fail then
+    uint32_t next = atomic_load_explicit(&t->connections[index].next_free, memory_order_relaxed);
+    if(atomic_compare_exchange_weak_explicit(&t->free_head, &head, make_head(head, next), memory_order_acquire, memory_order_acquire)) {
+      return t->connections + index;
+    }
+  } while(true);
+}
 
 /**
  * Initializes a connection
  */
-static void init_connection(struct connection * c) {
+static void init_connection(struct connection_table * t, struct connection * c) {
+  assert(t != NULL);
   assert(c != NULL);
 
   c->socket = -1;
+  atomic_init(&c->next_free, CONNECTION_NO_INDEX);
   init_text_buffer(&c->buffer);
+  init_text_buffer(&c->output);
+  c->sent = 0;
+  init_parser(&c->parser);
+  init_request(&c->request);
+  c->requests = 0;
+  c->keep_alive = false;
+  c->status = 0;
+  memset(&c->times, 0, sizeof(struct connection_times));
+  c->served_len = 0;
+  c->peer[0] = '\0';
+  init_task(&c->task, NULL, c, NULL);
+  init_timer(&c->timer);
+  c->timer_kind = CONNECTION_TIMER_IDLE;
+  c->next = NULL;
+  c->table = t;
+  c->loop = NULL;
 }
 
 /**
@@ -45,105 +98,162 @@ static void dispose_connection(struct connection * c) {
   assert(c != NULL);
 
   dispose_text_buffer(&c->buffer);
+  dispose_text_buffer(&c->output);
+  dispose_parser(&c->parser);
   if(c->socket != -1) {
     close(c->socket);
   }
 }
 
 /**
- * Initializes the connection buffer
+ * Initializes a connection table
  */
-int init_connections(size_t _max_amount) {
+int init_connection_table(struct connection_table * t, size_t max_amount, int node) {
+  assert(t != NULL);
+
   if(max_amount == 0) {
     LOG_ERROR("max amount of connections can not be 0");
     return -1;
   }
-  max_amount = _max_amount;
-  int result;
-  if((result = pthread_mutex_init(&mutex, NULL))) {
-    LOG_ERROR_CODE("could not create connection mutex", result);
+  if(max_amount >= CONNECTION_NO_INDEX) {
+    LOG_ERROR("max amount of connections is too large");
     return -1;
   }
-
-  connections = (struct connection *) malloc(sizeof(struct connection) * max_amount);
-  if(connections == NULL){
-    LOG_ERRNO("could not allocate connection buffer");
-    pthread_mutex_destroy(&mutex);
+  t->max_amount = max_amount;
+  // page aligned, so the connections are aligned to cache lines too
+  t->connections = (struct connection *) allocate_node_memory(sizeof(struct connection) * max_amount, node);
+  if(t->connections == NULL){
     return -1;
   }
   for(size_t i = 0; i < max_amount; ++i) {
-    init_connection(connections + i);
+    init_connection(t, t->connections + i);
+    atomic_init(&t->connections[i].next_free, i + 1 == max_amount ? CONNECTION_NO_INDEX : (uint32_t)(i + 1));
   }
-  active_amount = 0;
+  atomic_init(&t->free_head, 0);
+  atomic_init(&t->active_amount, 0);
+  t->timed = false;
   return 0;
 }
 
 /**
  * Opens a new connection
  */
-struct connection * open_connection(int socket) {
-  int result;
-  if((result = pthread_mutex_lock(&mutex))) {
-    LOG_ERROR_CODE("could not lock connection mutex", result);
-    return NULL;
-  }
-  if(active_amount == max_amount) {
-    return NULL;
-  }
-  size_t index;
-  for(index = 0; index < max_amount; ++index) {
-    if(connections[index].socket == -1) {
-      break;
-    }
-  }
-  assert(index != max_amount);
-  ++active_amount;
-  connections[index].socket = socket;
-  if((result = pthread_mutex_unlock(&mutex))) {
-    LOG_ERROR_CODE("could not unlock connection mutex", result);
-    connections[index].socket = -1;
+struct connection * open_connection(struct connection_table * t, int socket) {
+  assert(t != NULL);
+
+  struct connection * c = pop_free_connection(t);
+  if(c == NULL) {
     return NULL;
   }
-  return connections + index;
+  atomic_fetch_add_explicit(&t->active_amount, 1, memory_order_relaxed);
+  c->socket = socket;
+  return c;
 }
 
 /**
  * Closes a connection
  */
 void close_connection(struct connection * c) {
+  assert(c != NULL);
+
+  struct connection_table * t = c->table;
+  assert(!is_timer_running(&c->timer));
   if(c->socket != -1) {
     close(c->socket);
   }
-  int result;
-  if((result = pthread_mutex_lock(&mutex))) {
-    LOG_ERROR_CODE("could not lock connection mutex", result);
-  }
-  assert(active_amount != 0);
-  --active_amount;
+  reset_text_buffer(&c->buffer);
+  reset_text_buffer(&c->output);
+  c->sent = 0;
+  reset_parser(&c->parser);
+  c->requests = 0;
+  c->keep_alive = false;
+  reset_connection_times(c);
+  c->peer[0] = '\0';
+  c->loop = NULL;
   c->socket = -1;
-  if((result = pthread_mutex_unlock(&mutex))) {
-    LOG_ERROR_CODE("could not unlock connection mutex", result);
+  size_t active = atomic_fetch_sub_explicit(&t->active_amount, 1, memory_order_relaxed);
+  assert(active != 0);
+  (void)active;
+  push_free_connection(t, c);
+}
+
+/**
+ * Returns the current time if the requests of a connection are timed
+ */
+uint64_t get_connection_time(const struct connection * c) {
+  assert(c != NULL);
+
+  if(!c->table->timed) {
+    return 0;
   }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
 }
 
 /**
- * Disposes of the connection buffer
+ * Marks the first data of the requests of a connection received
  */
-void dispose_connections() {
-  int result;
-  if((result = pthread_mutex_lock(&mutex))) {
-    LOG_ERROR_CODE("could not lock connection mutex", result);
-    return;
+void mark_connection_received(struct connection * c) {
+  assert(c != NULL);
+
+  if(c->times.received == 0) {
+    c->times.received = get_connection_time(c);
   }
-  for(size_t i = 0; i < max_amount; ++i) {
-    dispose_connection(connections + i);
+}
+
+/**
+ * Forgets the times and served requests of a connection
+ */
+void reset_connection_times(struct connection * c) {
+  assert(c != NULL);
+
+  memset(&c->times, 0, sizeof(struct connection_times));
+  c->served_len = 0;
+}
+
+/**
+ * Returns the client address of a connection, looked up once
+ */
+const char * get_connection_peer(struct connection * c) {
+  assert(c != NULL);
+
+  if(c->peer[0] != '\0') {
+    return c->peer;
+  }
+  struct sockaddr_storage address;
+  socklen_t len = sizeof(struct sockaddr_storage);
+  const char * peer = NULL;
+  if(getpeername(c->socket, (struct sockaddr *)&address, &len) == 0) {
+    if(address.ss_family == AF_INET) {
+      peer = inet_ntop(AF_INET, &((struct sockaddr_in *)&address)->sin_addr, c->peer, CONNECTION_PEER_LEN);
+    } else if(address.ss_family == AF_INET6) {
+      peer = inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&address)->sin6_addr, c->peer, CONNECTION_PEER_LEN);
+    }
   }
-  if((result = pthread_mutex_unlock(&mutex))) {
-    LOG_ERROR_CODE("could not unlock connection mutex", result);
-    return;
+  if(peer == NULL) {
+    strcpy(c->peer, "-");
   }
-  if((result = pthread_mutex_destroy(&mutex))) {
-    LOG_ERROR_CODE("could not destroy connection mutex", result);
+  return c->peer;
+}
+
+/**
+ * Returns the number of connection slots in use
+ */
+size_t get_active_connection_count(struct connection_table * t) {
+  assert(t != NULL);
+
+  return atomic_load_explicit(&t->active_amount, memory_order_relaxed);
+}
+
+/**
+ * Disposes of a connection table
+ */
+void dispose_connection_table(struct connection_table * t) {
+  assert(t != NULL);
+
+  for(size_t i = 0; i < t->max_amount; ++i) {
+    dispose_connection(t->connections + i);
   }
-  free(connections);
+  free_node_memory(t->connections, sizeof(struct connection) * t->max_amount);
 }
@@ -1,34 +1,272 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include "affinity.h"
 #include "buffer.h"
+#include "parser.h"
+#include "request.h"
+#include "slice.h"
+#include "task.h"
+#include "timer.h"
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+
+struct connection_table;
+struct event_loop;
+
+/**
+ * The number of connection timers
+ */
+#define CONNECTION_TIMER_COUNT 4
+
+/**
+ * The timers limiting how long a connection may take in each phase of a request
+ */
+enum connection_timer {
+  /**
+   * Waiting for the first byte of the next request on a kept alive connection
+   */
+  CONNECTION_TIMER_IDLE,
+  /**
+   * Receiving the request line and headers
+   */
+  CONNECTION_TIMER_HEADER,
+  /**
+   * Receiving the body
+   */
+  CONNECTION_TIMER_BODY,
+  /**
+   * Sending the response
+   */
+  CONNECTION_TIMER_WRITE
+};
+
+/**
+ * The maximum number of pipelined requests served in one go while requests are timed
+ */
+#define CONNECTION_MAX_SERVED 8
+
+/**
+ * The room for the text form of the client address, IPv6 included
+ */
+#define CONNECTION_PEER_LEN 48
+
+/**
+ * A request served on a connection, kept until the responses are sent so it can be logged
+ */
+struct served_request {
+  /**
+   * The offset of the request in the buffer, the slices are relative to it
+   */
+  size_t offset;
+  /**
+   * The method as sent, empty if the request could not be parsed
+   */
+  struct slice method;
+  /**
+   * The request target as sent
+   */
+  struct slice target;
+  /**
+   * The protocol version as sent
+   */
+  struct slice version;
+  /**
+   * The status code of the response
+   */
+  int status;
+  /**
+   * The length of the response
+   */
+  size_t len;
+  /**
+   * The number of nanoseconds spent parsing the request on the worker thread
+   */
+  uint64_t parse_time;
+  /**
+   * The number of nanoseconds spent handling the parsed request
+   */
+  uint64_t handle_time;
+};
+
+/**
+ * When the phases of serving the requests of a connection ended, in nanoseconds on the monotonic clock
+ * Only measured while requests are timed, 0 otherwise
+ */
+struct connection_times {
+  /**
+   * The first data of the requests was received
+   */
+  uint64_t received;
+  /**
+   * The requests were complete and dispatched to the task service
+   */
+  uint64_t dispatched;
+  /**
+   * A worker thread started serving the requests
+   */
+  uint64_t started;
+  /**
+   * The responses were written to the output buffer
+   */
+  uint64_t released;
+  /**
+   * The responses were sent
+   */
+  uint64_t sent;
+};
 
 /**
  * All state associated with a connection
+ * Connections are aligned to a cache line so neighbouring connections do not share one
  */
 struct connection {
   /**
    * The local socket
    */
-  int socket;
+  _Alignas(CACHE_LINE_SIZE) int socket;
+
+  /**
+   * The index of the next free connection while the connection is in the free list
+   */
+  _Atomic uint32_t next_free;
   
   /**
    * A text buffer
    */
   struct text_buffer buffer;
+
+  /**
+   * The response data waiting to be sent
+   */
+  struct text_buffer output;
+
+  /**
+   * The number of response bytes already sent
+   */
+  size_t sent;
+
+  /**
+   * The parser of the current request
+   */
+  struct parser parser;
+
+  /**
+   * The view of the current request in the buffer
+   */
+  struct request request;
+
+  /**
+   * The number of requests received on the connection
+   */
+  size_t requests;
+
+  /**
+   * Whether the connection is kept open after the current response
+   */
+  bool keep_alive;
+
+  /**
+   * The status code of the last response written
+   */
+  int status;
+
+  /**
+   * When the phases of serving the current requests ended
+   */
+  struct connection_times times;
+
+  /**
+   * The requests served since the connection was last resumed
+   */
+  struct served_request served[CONNECTION_MAX_SERVED];
+
+  /**
+   * The number of served requests
+   */
+  size_t served_len;
+
+  /**
+   * The client address, looked up when it is first needed, empty until then
+   */
+  char peer[CONNECTION_PEER_LEN];
+
+  /**
+   * The task serving the current request, embedded so dispatching it does not allocate
+   */
+  struct task task;
+
+  /**
+   * The timer of the current phase of the request, in the timer wheel of the event loop
+   */
+  struct timer timer;
+
+  /**
+   * Which timer is running, the deadline of a phase is not extended by further progress
+   */
+  enum connection_timer timer_kind;
+
+  /**
+   * The next connection in a list of connections handed between threads
+   */
+  struct connection * next;
+
+  /**
+   * The table the connection belongs to
+   */
+  struct connection_table * table;
+
+  /**
+   * The event loop owning the connection socket
+   */
+  struct event_loop * loop;
 };
 
 /**
- * Initializes the connection buffer
+ * A fixed size table of connections
+ * Free connections are kept in a lock free stack, so opening and closing takes constant time
  */
-int init_connections(size_t max_amount);
+struct connection_table {
+  /**
+   * The connections
+   */
+  struct connection * connections;
+
+  /**
+   * The max number of connections
+   */
+  size_t max_amount;
+
+  /**
+   * The index of the first free connection in the low half
+   * and a tag that changes with every update in the high half, so a stale head is never mistaken for the current one
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t free_head;
+
+  /**
+   * The number of connections in use
+   */
+  _Atomic size_t active_amount;
+
+  /**
+   * Whether the requests served on the connections are timed and kept to be logged
+   */
+  bool timed;
+};
+
+/**
+ * Initializes a connection table, placing it preferably on a NUMA node, -1 for no preference
+ */
+int init_connection_table(struct connection_table * t, size_t max_amount, int node);
 
 /**
  * Opens a new connection
  */
-struct connection * open_connection(int socket);
+struct connection * open_connection(struct connection_table * t, int socket);
 
 /**
  * Closes a connection
@@ -36,8 +274,33 @@ struct connection * open_connection(int socket);
 void close_connection(struct connection * c);
 
 /**
- * Disposes of the connection buffer
+ * Returns the current time on the monotonic clock in nanoseconds if the requests of the connection are timed, 0 otherwise
+ */
+uint64_t get_connection_time(const struct connection * c);
+
+/**
+ * Marks the first data of the requests of the connection received, unless data was received before
+ */
+void mark_connection_received(struct connection * c);
+
+/**
+ * Forgets the times and served requests of the connection, once its responses have been sent
+ */
+void reset_connection_times(struct connection * c);
+
+/**
+ * Returns the client address of the connection in text form, or - if it is unknown
+ */
+const char * get_connection_peer(struct connection * c);
+
+/**
+ * Returns the number of connections in use
+ */
+size_t get_active_connection_count(struct connection_table * t);
+
+/**
+ * Disposes of a connection table
  */
-void dispose_connections();
+void dispose_connection_table(struct connection_table * t);
 
 #endif
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+
+#include "connection.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "protocol.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * The maximum number of events handled per call to epoll_wait
+ */
+#define EPOLL_LOOP_MAX_EVENTS 64
+
+/**
+ * The state of an epoll event loop
+ */
+struct epoll_loop {
+  /**
+   * The epoll instance owning the listener and all connection sockets
+   */
+  int epoll_fd;
+
+  /**
+   * An event file descriptor used to wake up the event loop
+   */
+  int wake_fd;
+
+  /**
+   * Whether connections were left in the backlog for lack of resources
+   * The edge triggered listener reports no new event for them, so accepting is retried every round until they are taken
+   */
+  bool accept_stalled;
+};
+
+/**
+ * The epoll event data marking the listener socket
+ */
+static int listen_marker;
+
+/**
+ * The epoll event data marking the wake up event file descriptor
+ */
+static int wake_marker;
+
+/**
+ * Registers a connection socket with the event loop, for incoming data or for room to send the rest of a response
+ * The registration is one shot: whoever handles the event owns the connection until it is rearmed
+ */
+static int watch_connection(struct epoll_loop * e, struct connection * c, int op, uint32_t events) {
+  assert(e != NULL);
+  assert(c != NULL);
+
+  struct epoll_event event;
+  event.events = events | EPOLLET | EPOLLONESHOT;
+  event.data.ptr = c;
+  if(epoll_ctl(e->epoll_fd, op, c->socket, &event)) {
+    LOG_ERRNO("could not watch connection");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Accepts all pending connections and registers them with the event loop
+ */
+static int accept_connections(struct event_loop * l) {
+  struct epoll_loop * e = (struct epoll_loop *)l->data;
+  while(true) {
+    int result = accept4(l->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(result < 0) {
+      switch(errno) {
+      case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+      case EWOULDBLOCK:
+#endif
+	e->accept_stalled = false;
+	return 0;
+      case EFAULT:
+      case EINVAL:
+      case ENOTSOCK:
+      case EOPNOTSUPP:
+	LOG_ERRNO("error while listening to socket");
+	return -1;
+      case EMFILE:
+      case ENFILE:
+      case ENOBUFS:
+      case ENOMEM:
+      case EPERM:
+	// out of resources, the connection stays in the backlog until some are released
+	if(!e->accept_stalled) {
+	  LOG_ERRNO("could not accept connection");
+	  e->accept_stalled = true;
+	}
+	return 0;
+      default:
+	break;
+      }
+    } else {
+      struct connection * c = admit_connection(l, result);
+      if(c == NULL) {
+	continue;
+      }
+      if(watch_connection(e, c, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP)) {
+	stop_connection_timer(l, c);
+	close_connection(c);
+      }
+    }
+  }
+}
+
+/**
+ * Closes a connection that could not be dispatched
+ */
+static void reject_connection(struct event_loop * l, struct connection * c) {
+  (void)l;
+  close_connection(c);
+}
+
+/**
+ * Dispatches a connection with a complete request to the task service or waits for more data
+ */
+static void continue_request(struct event_loop * l, struct connection * c, enum request_state state) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  switch(state) {
+  case REQUEST_STATE_COMPLETE:
+    stop_connection_timer(l, c);
+    // dispatched with the other connections that became ready in this round
+    if(add_pending_connection(l, c)) {
+      dispatch_pending_connections(l, reject_connection);
+    }
+    break;
+  case REQUEST_STATE_INCOMPLETE:
+    update_request_timer(l, c);
+    if(watch_connection((struct epoll_loop *)l->data, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP)) {
+      stop_connection_timer(l, c);
+      close_connection(c);
+    }
+    break;
+  case REQUEST_STATE_CLOSED:
+    stop_connection_timer(l, c);
+    close_connection(c);
+    break;
+  }
+}
+
+/**
+ * Finishes a connection whose responses have been sent, successfully or not
+ * Connections that are kept alive wait for their next request
+ */
+static void complete_response(struct event_loop * l, struct connection * c) {
+  complete_served_requests(l, c);
+  if(c->keep_alive) {
+    continue_request(l, c, resume_connection(l, c));
+  } else {
+    close_connection(c);
+  }
+}
+
+/**
+ * Sends the rest of a response the client did not take at once, waiting for room under the write timeout
+ */
+static void continue_response(struct event_loop * l, struct connection * c) {
+  int result = send_text_buffer(&c->output, c->socket, &c->sent);
+  if(result == 1) {
+    start_connection_timer(l, c, CONNECTION_TIMER_WRITE);
+    if(watch_connection((struct epoll_loop *)l->data, c, EPOLL_CTL_MOD, EPOLLOUT) == 0) {
+      return;
+    }
+    result = -1;
+  }
+  if(result < 0) {
+    LOG_ERRNO("could not send response");
+    c->keep_alive = false;
+  }
+  c->times.sent = get_connection_time(c);
+  stop_connection_timer(l, c);
+  complete_response(l, c);
+}
+
+/**
+ * Takes back the connections released by the worker threads
+ * Those whose response was only partly sent wait until the socket takes the rest
+ */
+static void resume_connections(struct event_loop * l) {
+  struct connection * c = take_released_connections(l);
+  while(c != NULL) {
+    struct connection * next = c->next;
+    c->next = NULL;
+    if(c->sent < c->output.len) {
+      continue_response(l, c);
+    } else {
+      complete_response(l, c);
+    }
+    c = next;
+  }
+}
+
+/**
+ * Closes the connections that took too long to send a request or to take a response
+ */
+static void expire_connections(struct event_loop * l) {
+  struct connection * c;
+  while((c = pop_expired_connection(l)) != NULL) {
+    if(c->sent < c->output.len) {
+      c->times.sent = get_connection_time(c);
+      complete_served_requests(l, c);
+    }
+    // closing the socket removes it from the epoll instance
+    close_connection(c);
+  }
+}
+
+/**
+ * Creates the epoll instance and registers the listener socket and the wake up event
+ */
+static int init_epoll_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  struct epoll_loop * e = (struct epoll_loop *)malloc(sizeof(struct epoll_loop));
+  if(e == NULL) {
+    LOG_ERRNO("could not allocate epoll event loop");
+    return -1;
+  }
+  e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(e->epoll_fd == -1) {
+    LOG_ERRNO("could not create epoll instance");
+    free(e);
+    return -1;
+  }
+  e->accept_stalled = false;
+  e->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(e->wake_fd == -1) {
+    LOG_ERRNO("could not create wake up event");
+    close(e->epoll_fd);
+    free(e);
+    return -1;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &listen_marker;
+  if(epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, l->listen_socket, &event) == 0) {
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &wake_marker;
+    if(epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->wake_fd, &event) == 0) {
+      l->data = e;
+      return 0;
+    }
+  }
+  LOG_ERRNO("could not register with epoll instance");
+  close(e->wake_fd);
+  close(e->epoll_fd);
+  free(e);
+  return -1;
+}
+
+/**
+ * Runs the event loop
+ */
+static int run_epoll_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  struct epoll_loop * e = (struct epoll_loop *)l->data;
+  struct epoll_event events[EPOLL_LOOP_MAX_EVENTS];
+  while(!l->stopping) {
+    // the timers are checked every tick while any are running, a stalled backlog is retried as often
+    int timeout = l->timers.len == 0 && !e->accept_stalled ? -1 : EVENT_LOOP_TICK;
+    int count = epoll_wait(e->epoll_fd, events, EPOLL_LOOP_MAX_EVENTS, timeout);
+    update_event_loop_clock(l);
+    if(count < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      LOG_ERRNO("error while waiting for events");
+      return -1;
+    }
+    for(int i = 0; i < count; ++i) {
+      void * data = events[i].data.ptr;
+      if(data == &listen_marker) {
+	if(accept_connections(l)) {
+	  return -1;
+	}
+      } else if(data == &wake_marker) {
+	uint64_t value;
+	while(read(e->wake_fd, &value, sizeof(uint64_t)) > 0);
+	resume_connections(l);
+      } else if(((struct connection *)data)->sent < ((struct connection *)data)->output.len) {
+	// only a connection still sending a response waits for room to send
+	continue_response(l, (struct connection *)data);
+      } else {
+	continue_request(l, (struct connection *)data, receive_request((struct connection *)data));
+      }
+    }
+    dispatch_pending_connections(l, reject_connection);
+    expire_connections(l);
+    // closed connections may have released the resources the backlog waits for
+    if(e->accept_stalled && accept_connections(l)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Wakes up the event loop
+ */
+static void wake_epoll_loop(struct event_loop * l) {
+  struct epoll_loop * e = (struct epoll_loop *)l->data;
+  uint64_t value = 1;
+  // nothing sensible can be done if this fails inside a signal handler
+  ssize_t result = write(e->wake_fd, &value, sizeof(uint64_t));
+  (void)result;
+}
+
+/**
+ * Sends as much of the response as the socket takes from the calling worker thread and hands the connection back to the event loop
+ * The event loop sends the rest, so a client that does not read never holds up the worker
+ */
+static void release_epoll_connection(struct event_loop * l, struct connection * c) {
+  assert(c != NULL);
+
+  int result = send_text_buffer(&c->output, c->socket, &c->sent);
+  if(result < 0) {
+    LOG_ERRNO("could not send response");
+    c->keep_alive = false;
+    // nothing more is sent
+    c->sent = c->output.len;
+  }
+  if(result != 1) {
+    c->times.sent = get_connection_time(c);
+  }
+  // the event loop takes all released connections at once, only the first one needs to wake it up
+  if(push_released_connection(l, c)) {
+    wake_epoll_loop(l);
+  }
+}
+
+/**
+ * Closes the epoll instance and the wake up event, closing the connections that were released but not yet resumed
+ */
+static void dispose_epoll_loop(struct event_loop * l) {
+  struct epoll_loop * e = (struct epoll_loop *)l->data;
+  struct connection * c = take_released_connections(l);
+  while(c != NULL) {
+    struct connection * next = c->next;
+    c->next = NULL;
+    close_connection(c);
+    c = next;
+  }
+  close(e->wake_fd);
+  close(e->epoll_fd);
+  free(e);
+  l->data = NULL;
+}
+
+const struct event_loop_type epoll_event_loop = {
+  "epoll",
+  init_epoll_loop,
+  run_epoll_loop,
+  release_epoll_connection,
+  wake_epoll_loop,
+  dispose_epoll_loop
+};
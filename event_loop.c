@@ -0,0 +1,262 @@
+#include "event_loop.h"
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Returns the current tick, from a clock that is cheap to read but only as precise as the scheduler tick
+ */
+static uint64_t get_tick() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return ((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000) / EVENT_LOOP_TICK;
+}
+
+int init_event_loop(struct event_loop * l,
+		    const struct event_loop_type * type,
+		    int listen_socket,
+		    struct connection_table * connections,
+		    size_t (*dispatch)(void *, struct connection **, size_t),
+		    bool (*admit)(void *, size_t),
+		    void (*served)(void *, struct connection *),
+		    void * context,
+		    const unsigned timeouts[CONNECTION_TIMER_COUNT]) {
+  assert(l != NULL);
+  assert(type != NULL);
+  assert(connections != NULL);
+  assert(dispatch != NULL);
+  assert(timeouts != NULL);
+
+  l->type = type;
+  l->listen_socket = listen_socket;
+  l->connections = connections;
+  l->dispatch = dispatch;
+  l->admit = admit;
+  l->served = served;
+  l->context = context;
+  memcpy(l->timeouts, timeouts, sizeof(l->timeouts));
+  l->now = get_tick();
+  init_timer_wheel(&l->timers, l->now);
+  l->pending_len = 0;
+  l->in_flight = 0;
+  l->shed = 0;
+  atomic_init(&l->released, NULL);
+  l->stopping = false;
+  l->data = NULL;
+  return (*type->init)(l);
+}
+
+int run_event_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  return (*l->type->run)(l);
+}
+
+void release_connection(struct connection * c) {
+  assert(c != NULL);
+  assert(c->loop != NULL);
+
+  struct event_loop * l = c->loop;
+  (*l->type->release)(l, c);
+}
+
+void update_event_loop_clock(struct event_loop * l) {
+  assert(l != NULL);
+
+  l->now = get_tick();
+}
+
+bool has_connection_timeouts(const struct event_loop * l) {
+  assert(l != NULL);
+
+  for(size_t i = 0; i < CONNECTION_TIMER_COUNT; ++i) {
+    if(l->timeouts[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Closes a socket turned away with a 503 response
+ * Closing it with the request unread would send a reset, which may make the client discard the response,
+ * so the response is followed by a FIN and what arrived of the request is drained first
+ */
+static void close_refused_socket(int socket) {
+  shutdown(socket, SHUT_WR);
+  char discarded[1024];
+  while(recv(socket, discarded, sizeof(discarded), MSG_DONTWAIT) > 0);
+  close(socket);
+}
+
+struct connection * admit_connection(struct event_loop * l, int socket) {
+  assert(l != NULL);
+
+  struct connection * c = NULL;
+  if(l->admit == NULL || (*l->admit)(l->context, l->in_flight)) {
+    c = open_connection(l->connections, socket);
+  }
+  if(c == NULL) {
+    // answered without reading the request, so shedding costs next to nothing
+    send_overload_response(socket);
+    close_refused_socket(socket);
+    ++l->shed;
+    add_to_metric(METRIC_CONNECTIONS_REFUSED, 1);
+    return NULL;
+  }
+  add_to_metric(METRIC_CONNECTIONS_ACCEPTED, 1);
+  c->loop = l;
+  if(l->connections->timed) {
+    // a closing socket may already be gone by the time its requests are logged
+    get_connection_peer(c);
+  }
+  start_connection_timer(l, c, CONNECTION_TIMER_HEADER);
+  return c;
+}
+
+void complete_served_requests(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  if(l->served != NULL && c->served_len != 0) {
+    (*l->served)(l->context, c);
+  }
+}
+
+bool add_pending_connection(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+  assert(l->pending_len < EVENT_LOOP_MAX_PENDING);
+
+  l->pending[l->pending_len++] = c;
+  return l->pending_len == EVENT_LOOP_MAX_PENDING;
+}
+
+void dispatch_pending_connections(struct event_loop * l, void (*reject)(struct event_loop *, struct connection *)) {
+  assert(l != NULL);
+  assert(reject != NULL);
+
+  if(l->pending_len == 0) {
+    return;
+  }
+  size_t dispatched = (*l->dispatch)(l->context, l->pending, l->pending_len);
+  l->in_flight += dispatched;
+  for(size_t i = dispatched; i < l->pending_len; ++i) {
+    (*reject)(l, l->pending[i]);
+  }
+  l->pending_len = 0;
+}
+
+void start_connection_timer(struct event_loop * l, struct connection * c, enum connection_timer kind) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  if(is_timer_running(&c->timer) && c->timer_kind == kind) {
+    return;
+  }
+  c->timer_kind = kind;
+  unsigned timeout = l->timeouts[kind];
+  if(timeout == 0) {
+    stop_timer(&l->timers, &c->timer);
+    return;
+  }
+  start_timer(&l->timers, &c->timer, l->now + (timeout + EVENT_LOOP_TICK - 1) / EVENT_LOOP_TICK);
+}
+
+void update_request_timer(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  // the data received of the request so far is read ahead of the buffered text
+  if(c->buffer.ahead == 0 && c->requests != 0) {
+    start_connection_timer(l, c, CONNECTION_TIMER_IDLE);
+  } else if(c->parser.state == PARSER_STATE_BODY) {
+    start_connection_timer(l, c, CONNECTION_TIMER_BODY);
+  } else {
+    start_connection_timer(l, c, CONNECTION_TIMER_HEADER);
+  }
+}
+
+void stop_connection_timer(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  stop_timer(&l->timers, &c->timer);
+}
+
+struct connection * pop_expired_connection(struct event_loop * l) {
+  assert(l != NULL);
+
+  struct timer * t = pop_expired_timer(&l->timers, l->now);
+  if(t == NULL) {
+    return NULL;
+  }
+  return (struct connection *)((char *)t - offsetof(struct connection, timer));
+}
+
+bool push_released_connection(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  struct connection * head = atomic_load_explicit(&l->released, memory_order_relaxed);
+  do {
+    c->next = head;
+  } while(!atomic_compare_exchange_weak_explicit(&l->released, &head, c, memory_order_release, memory_order_relaxed));
+  return head == NULL;
+}
+
+struct connection * take_released_connections(struct event_loop * l) {
+  assert(l != NULL);
+
+  struct connection * c = atomic_exchange_explicit(&l->released, NULL, memory_order_acquire);
+  // restore the order in which the connections were released
+  struct connection * ordered = NULL;
+  while(c != NULL) {
+    struct connection * next = c->next;
+    c->next = ordered;
+    ordered = c;
+    c = next;
+    assert(l->in_flight != 0);
+    --l->in_flight;
+  }
+  return ordered;
+}
+
+enum request_state resume_connection(struct event_loop * l, struct connection * c) {
+  assert(l != NULL);
+  assert(c != NULL);
+
+  // any data received past the handled request belongs to the next one
+  clear_text_buffer(&c->buffer);
+  reset_connection_times(c);
+  reset_text_buffer(&c->output);
+  c->sent = 0;
+  c->keep_alive = false;
+  return get_request_state(c);
+}
+
+void stop_event_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  l->stopping = true;
+  (*l->type->wake)(l);
+}
+
+void dispose_event_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  // connections left pending when the loop failed are never dispatched
+  for(size_t i = 0; i < l->pending_len; ++i) {
+    close_connection(l->pending[i]);
+  }
+  l->pending_len = 0;
+  (*l->type->dispose)(l);
+}
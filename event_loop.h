@@ -0,0 +1,272 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "connection.h"
+#include "protocol.h"
+#include "timer.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * The maximum number of connections with a complete request dispatched in one batch
+ */
+#define EVENT_LOOP_MAX_PENDING 64
+
+/**
+ * The length of a timer tick in milliseconds, the precision of the connection timeouts
+ */
+#define EVENT_LOOP_TICK 100
+
+struct event_loop;
+
+/**
+ * An event loop implementation
+ */
+struct event_loop_type {
+  /**
+   * The name of the implementation
+   */
+  const char * name;
+
+  /**
+   * Prepares the event loop, the listener socket, connection table
+   * and dispatch function of the loop have been set
+   */
+  int (*init)(struct event_loop * l);
+
+  /**
+   * Runs the event loop until it is stopped
+   */
+  int (*run)(struct event_loop * l);
+
+  /**
+   * Sends the response of a handled request and takes back the connection,
+   * may be called from any thread
+   * The connection is closed afterwards unless it is kept alive
+   */
+  void (*release)(struct event_loop * l, struct connection * c);
+
+  /**
+   * Wakes up the event loop after it was asked to stop, safe to be called from a signal handler
+   */
+  void (*wake)(struct event_loop * l);
+
+  /**
+   * Disposes of the event loop
+   */
+  void (*dispose)(struct event_loop * l);
+};
+
+/**
+ * An event loop owning a listener socket and the connection sockets accepted from it
+ * Connections with a complete request are dispatched to the task service
+ * and handed back to the event loop once the request has been handled
+ */
+struct event_loop {
+  /**
+   * The implementation
+   */
+  const struct event_loop_type * type;
+
+  /**
+   * The listener socket
+   */
+  int listen_socket;
+
+  /**
+   * The table to open connections in
+   */
+  struct connection_table * connections;
+
+  /**
+   * Called with batches of connections with a complete request
+   * Returns the number of connections dispatched, from the start, the others are closed
+   */
+  size_t (*dispatch)(void * context, struct connection ** connections, size_t count);
+
+  /**
+   * Called with the number of requests in flight before a new connection is opened, NULL to admit all
+   * Returns whether the connection is admitted, clients that are not get a 503 response
+   */
+  bool (*admit)(void * context, size_t in_flight);
+
+  /**
+   * Called on the event loop thread once the responses to the requests served on a connection have been sent, NULL for none
+   */
+  void (*served)(void * context, struct connection * c);
+
+  /**
+   * The context passed to the dispatch, admit and served functions
+   */
+  void * context;
+
+  /**
+   * The number of milliseconds a connection may spend in each phase of a request, 0 for no limit
+   */
+  unsigned timeouts[CONNECTION_TIMER_COUNT];
+
+  /**
+   * The timers of the connections
+   */
+  struct timer_wheel timers;
+
+  /**
+   * The current tick, read from a coarse clock once per iteration of the event loop
+   */
+  uint64_t now;
+
+  /**
+   * The connections with a complete request found since the last batch was dispatched
+   */
+  struct connection * pending[EVENT_LOOP_MAX_PENDING];
+  /**
+   * The number of pending connections
+   */
+  size_t pending_len;
+  /**
+   * The number of connections dispatched and not yet released
+   */
+  size_t in_flight;
+  /**
+   * The number of connections turned away with a 503 response
+   */
+  size_t shed;
+  /**
+   * The connections released by the worker threads, most recent first
+   */
+  _Atomic(struct connection *) released;
+
+  /**
+   * Whether the event loop was asked to stop
+   */
+  volatile sig_atomic_t stopping;
+
+  /**
+   * The state of the implementation
+   */
+  void * data;
+};
+
+/**
+ * Initializes an event loop
+ */
+int init_event_loop(struct event_loop * l,
+		    const struct event_loop_type * type,
+		    int listen_socket,
+		    struct connection_table * connections,
+		    size_t (*dispatch)(void *, struct connection **, size_t),
+		    bool (*admit)(void *, size_t),
+		    void (*served)(void *, struct connection *),
+		    void * context,
+		    const unsigned timeouts[CONNECTION_TIMER_COUNT]);
+
+/**
+ * Runs the event loop until it is stopped
+ */
+int run_event_loop(struct event_loop * l);
+
+/**
+ * Sends the response of a handled request and hands the connection back to its event loop
+ */
+void release_connection(struct connection * c);
+
+/**
+ * Reads the clock the connection timers are based on, once per iteration of the event loop
+ */
+void update_event_loop_clock(struct event_loop * l);
+
+/**
+ * Returns whether any of the connection timeouts is enabled
+ */
+bool has_connection_timeouts(const struct event_loop * l);
+
+/**
+ * Opens a connection for an accepted socket and starts its header timer
+ * If it is not admitted or the connection table is full, the client gets a 503 response,
+ * the socket is closed and NULL is returned
+ */
+struct connection * admit_connection(struct event_loop * l, int socket);
+
+/**
+ * Passes a connection whose responses have been sent, successfully or not, to the served function
+ */
+void complete_served_requests(struct event_loop * l, struct connection * c);
+
+/**
+ * Adds a connection with a complete request to the batch to dispatch
+ * Returns whether the batch is full and has to be dispatched before adding more
+ */
+bool add_pending_connection(struct event_loop * l, struct connection * c);
+
+/**
+ * Dispatches the batch of pending connections, passing those that could not be dispatched to reject
+ */
+void dispatch_pending_connections(struct event_loop * l, void (*reject)(struct event_loop *, struct connection *));
+
+/**
+ * Starts a timer of a connection, unless it is already running
+ */
+void start_connection_timer(struct event_loop * l, struct connection * c, enum connection_timer kind);
+
+/**
+ * Starts the timer of the phase an incomplete request is in: idle before its first byte
+ * on a kept alive connection, then header and body
+ */
+void update_request_timer(struct event_loop * l, struct connection * c);
+
+/**
+ * Stops the timer of a connection, if it is running
+ * Must be called before the connection is closed
+ */
+void stop_connection_timer(struct event_loop * l, struct connection * c);
+
+/**
+ * Removes and returns a connection whose timer has expired, or NULL if there is none
+ */
+struct connection * pop_expired_connection(struct event_loop * l);
+
+/**
+ * Adds a connection to the list of released connections, may be called from any thread
+ * Returns whether the list was empty, in which case the event loop has to be woken up
+ */
+bool push_released_connection(struct event_loop * l, struct connection * c);
+
+/**
+ * Takes all released connections, linked in the order in which they were released
+ * They are no longer counted as in flight
+ */
+struct connection * take_released_connections(struct event_loop * l);
+
+/**
+ * Prepares a kept alive connection for its next request
+ * Returns the state of the next request, which may already be buffered
+ */
+enum request_state resume_connection(struct event_loop * l, struct connection * c);
+
+/**
+ * Stops the event loop, safe to be called from a signal handler
+ */
+void stop_event_loop(struct event_loop * l);
+
+/**
+ * Disposes of the event loop
+ */
+void dispose_event_loop(struct event_loop * l);
+
+/**
+ * The event loop based on epoll
+ */
+extern const struct event_loop_type epoll_event_loop;
+
+#ifdef HAVE_IO_URING
+/**
+ * The event loop based on io_uring
+ */
+extern const struct event_loop_type uring_event_loop;
+#endif
+
+#endif
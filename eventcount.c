@@ -0,0 +1,68 @@
+#include "eventcount.h"
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void init_eventcount(struct eventcount * e) {
+  assert(e != NULL);
+
+  atomic_init(&e->epoch, 0);
+  atomic_init(&e->waiters, 0);
+}
+
+uint32_t prepare_eventcount_wait(struct eventcount * e) {
+  assert(e != NULL);
+
+  // the announcement must be visible before the condition is checked
+  atomic_fetch_add_explicit(&e->waiters, 1, memory_order_seq_cst);
+  return atomic_load_explicit(&e->epoch, memory_order_seq_cst);
+}
+
+void cancel_eventcount_wait(struct eventcount * e) {
+  assert(e != NULL);
+
+  atomic_fetch_sub_explicit(&e->waiters, 1, memory_order_relaxed);
+}
+
+bool wait_eventcount(struct eventcount * e, uint32_t key, const struct timespec * deadline) {
+  assert(e != NULL);
+
+  bool notified = true;
+  // returns immediately if a notification changed the epoch after the key was taken
+  while(atomic_load_explicit(&e->epoch, memory_order_acquire) == key) {
+    // the bitset variant takes an absolute time on the monotonic clock, so spurious wake ups do not extend the wait
+    if(syscall(SYS_futex, &e->epoch, FUTEX_WAIT_BITSET_PRIVATE, key, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == -1
+       && errno != EAGAIN && errno != EINTR) {
+      if(errno == ETIMEDOUT) {
+	notified = atomic_load_explicit(&e->epoch, memory_order_acquire) != key;
+      } else {
+	LOG_ERRNO("could not wait on futex");
+      }
+      break;
+    }
+  }
+  atomic_fetch_sub_explicit(&e->waiters, 1, memory_order_relaxed);
+  return notified;
+}
+
+bool notify_eventcount(struct eventcount * e, int count) {
+  assert(e != NULL);
+  assert(count > 0);
+
+  // orders the change of the condition before the check for waiters
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load_explicit(&e->waiters, memory_order_relaxed) == 0) {
+    return false;
+  }
+  atomic_fetch_add_explicit(&e->epoch, 1, memory_order_release);
+  if(syscall(SYS_futex, &e->epoch, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) == -1) {
+    LOG_ERRNO("could not wake up futex waiters");
+  }
+  return true;
+}
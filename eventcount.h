@@ -0,0 +1,56 @@
+#ifndef EVENTCOUNT_H
+#define EVENTCOUNT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <time.h>
+
+/**
+ * An event count, letting threads sleep until a condition they checked without locking may have changed
+ * A waiter prepares to wait, checks its condition and only then waits,
+ * a notifier makes the condition true and notifies, which costs no system call if nobody waits
+ */
+struct eventcount {
+  /**
+   * Incremented by every notification that may wake up a waiter, the futex word
+   */
+  _Atomic uint32_t epoch;
+
+  /**
+   * The number of threads preparing to wait or waiting
+   */
+  _Atomic uint32_t waiters;
+};
+
+/**
+ * Initializes an event count
+ */
+void init_eventcount(struct eventcount * e);
+
+/**
+ * Announces that the calling thread is about to wait, must be followed by a check of the condition
+ * and either cancel_eventcount_wait or wait_eventcount with the returned key
+ */
+uint32_t prepare_eventcount_wait(struct eventcount * e);
+
+/**
+ * Withdraws the announcement to wait because the condition turned out to be true
+ */
+void cancel_eventcount_wait(struct eventcount * e);
+
+/**
+ * Waits until a notification issued after prepare_eventcount_wait returned the key
+ * or until the deadline on the monotonic clock passes, NULL waiting without a deadline
+ * Returns false if the deadline passed without a notification
+ */
+bool wait_eventcount(struct eventcount * e, uint32_t key, const struct timespec * deadline);
+
+/**
+ * Wakes up at most count waiting threads, if there are any, INT_MAX waking up all of them
+ * Returns whether there were threads to wake up
+ */
+bool notify_eventcount(struct eventcount * e, int count);
+
+#endif
@@ -1,15 +1,23 @@
 #define __POSIX_C_SOURCE 200809L
 
+#include "affinity.h"
+#include "eventcount.h"
 #include "logger.h"
+#include "ring.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
-
+#include <time.h>
+#include <unistd.h>
 
 /**
  * Buffer for errno messages
@@ -17,78 +25,192 @@
 #define ERROR_CODE_BUFFER_SIZE 128
 
 /**
- * A log message
+ * The maximum length of a formatted message, longer messages are truncated
+ */
+#define LOG_MAX_MSG_LEN 1024
+
+/**
+ * The smallest batch, holding at least a few lines of the maximum length
+ */
+#define LOG_MIN_BATCH_SIZE 4096
+
+/**
+ * The room for a timestamp such as 2026-01-01T00:00:00.000Z
+ */
+#define LOG_TIMESTAMP_SIZE 32
+
+/**
+ * The longest conversion specification formatted by the logger thread
+ */
+#define LOG_MAX_SPEC_LEN 32
+
+/**
+ * The arguments copied into a log ring for the logger thread to format
  */
-struct log_msg {
+enum log_arg {
   /**
-   * The message buffer
+   * A conversion without an argument
    */
-  char * buffer;
+  LOG_ARG_NONE,
   /**
-   * The message buffer capacity
+   * An int, or a narrower type promoted to it
    */
-  size_t cap;
+  LOG_ARG_INT,
   /**
-   * The length of the current message
+   * A long
    */
-  size_t len;
+  LOG_ARG_LONG,
+  /**
+   * A long long
+   */
+  LOG_ARG_LLONG,
+  /**
+   * A size_t
+   */
+  LOG_ARG_SIZE,
+  /**
+   * An intmax_t
+   */
+  LOG_ARG_INTMAX,
+  /**
+   * A ptrdiff_t
+   */
+  LOG_ARG_PTRDIFF,
   /**
-   * The file where the message originated
+   * A double, or a float promoted to it
    */
-  const char * file;
+  LOG_ARG_DOUBLE,
   /**
-   * The line where the message originated
+   * A long double
    */
-  int line;
+  LOG_ARG_LDOUBLE,
   /**
-   * The priority
+   * A pointer
    */
-  enum log_priority priority;
+  LOG_ARG_POINTER,
   /**
-   * A pointer to the next message in the queue
+   * A string, copied with its length
    */
-  struct log_msg * next;
+  LOG_ARG_STRING,
+  /**
+   * A conversion that cannot be deferred, such as a width taken from the arguments
+   */
+  LOG_ARG_INVALID
 };
 
 /**
- * A queue of log messages
+ * The number of messages of the maximum length the smallest ring holds
+ */
+#define LOG_MIN_RING_RECORDS 4
+
+/**
+ * The header of a message in a log ring
  */
-struct log_queue {
+struct log_record {
   /**
-   * A pointer to the first message
+   * The site the message was logged from
    */
-  struct log_msg * head;
+  const struct log_site * site;
+  /**
+   * Whether the message is formatted text, or the arguments of the site
+   */
+  bool formatted;
+  /**
+   * The number of messages the site suppressed before this one
+   */
+  uint32_t suppressed;
+};
 
+/**
+ * A message as it is written to a log ring
+ */
+struct log_entry {
+  /**
+   * The header
+   */
+  struct log_record record;
   /**
-   * A pointer to the last message
+   * The formatted text, not null terminated in the ring, or the arguments
    */
-  struct log_msg * tail;
+  char data[LOG_MAX_MSG_LEN];
 };
 
+// a message that can never fit would keep a thread blocking on its full ring waiting forever
+_Static_assert(LOGGER_MIN_RING_SIZE >= LOG_MIN_RING_RECORDS * (sizeof(uint32_t) + sizeof(struct log_entry)),
+	       "the smallest log ring must hold a few messages of the maximum length");
+
 /**
- * The queue of messages waiting to be processed
+ * The ring of messages logged by one thread
+ * Rings are never freed while the logger runs, the ring of a thread that exits is reused by the next new thread
  */
-static struct log_queue waiting;
+struct log_ring {
+  /**
+   * The messages
+   */
+  struct ring ring;
+  /**
+   * Whether a thread is logging into the ring
+   */
+  atomic_bool owned;
+  /**
+   * The number of messages dropped or overwritten since the logger last reported it
+   */
+  _Atomic uint64_t dropped;
+  /**
+   * The next ring in the list of all rings
+   */
+  struct log_ring * next;
+};
+
+/**
+ * All log rings, newest first
+ */
+static _Atomic(struct log_ring *) rings;
+
+/**
+ * The sites that suppressed messages, newest first, sites are never removed
+ */
+static _Atomic(struct log_site *) listed_sites;
+
+/**
+ * The number of messages dropped or overwritten since the logger started, counted as they are reported
+ */
+static _Atomic uint64_t dropped_messages;
+
+/**
+ * The ring of the calling thread
+ */
+static _Thread_local struct log_ring * thread_ring;
+
+/**
+ * The key releasing the ring of a thread when the thread exits
+ */
+static pthread_key_t ring_key;
+
+/**
+ * The size of a log ring in bytes
+ */
+static size_t ring_size;
 
 /**
- * The mutex protecting the waiting queue
+ * What a thread does when its ring is full
  */
-static pthread_mutex_t waiting_mutex;
+static enum log_overflow overflow;
 
 /**
- * The condition variable to signal that messages are waiting to be processed
+ * Where messages are formatted
  */
-static pthread_cond_t waiting_cond;
+static enum log_format formatting;
 
 /**
- * The queue of messages ready to be reused
+ * The event the worker thread waits on until messages are logged
  */
-static struct log_queue ready;
+static struct eventcount logged;
 
 /**
- * The mutex protecting the ready queue
+ * The event threads wait on while their ring is full, until the worker thread makes room
  */
-static pthread_mutex_t ready_mutex;
+static struct eventcount room_made;
 
 /**
  * The worker thread
@@ -98,12 +220,57 @@ static pthread_t worker;
 /**
  * Whether the system is running or not
  */
-static bool running = false;
+static atomic_bool running = false;
+
+/**
+ * The output file descriptor
+ */
+static int output;
+
+/**
+ * The lines formatted by the logger thread and not written yet
+ */
+static char * batch;
+
+/**
+ * The length of the lines in the batch
+ */
+static size_t batch_len;
+
+/**
+ * The size of the batch
+ */
+static size_t batch_size;
+
+/**
+ * The number of milliseconds lines may wait in the batch, 0 to write them as soon as the rings are drained
+ */
+static unsigned flush_interval;
+
+/**
+ * When the batch must be written, on the monotonic clock
+ */
+static struct timespec flush_deadline;
+
+/**
+ * Whether the output is synchronized after every write
+ */
+static enum log_sync sync_policy;
 
 /**
- * The output file
+ * The number of nanoseconds between messages of a site at the rate limit, 0 for no limit
  */
-static FILE * output;
+static uint64_t rate_interval;
+
+/**
+ * How far ahead of the rate limit a site may get in nanoseconds
+ */
+static uint64_t rate_tolerance;
+
+/**
+ * The time the lines of the current batch are stamped with
+ */
+static char timestamp[LOG_TIMESTAMP_SIZE];
 
 /**
  * The minimum priority
@@ -121,267 +288,819 @@ static const char * priority_labels[] = {
 };
 
 /**
- * Creates a log message and returns it (or NULL on error)
+ * Hands the ring of an exiting thread over to the next thread that logs
+ */
+static void release_log_ring(void * data) {
+  struct log_ring * r = (struct log_ring *)data;
+  atomic_store_explicit(&r->owned, false, memory_order_release);
+}
+
+/**
+ * Returns the ring of the calling thread, taking over a released ring or creating a new one on the first message
+ * Returns NULL if no ring could be created
+ */
+static struct log_ring * get_log_ring() {
+  if(thread_ring != NULL) {
+    return thread_ring;
+  }
+  struct log_ring * r;
+  for(r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+    bool owned = false;
+    if(atomic_compare_exchange_strong_explicit(&r->owned, &owned, true, memory_order_acquire, memory_order_relaxed)) {
+      break;
+    }
+  }
+  if(r == NULL) {
+    // nothing can be logged about a failure here
+    r = (struct log_ring *)malloc(sizeof(struct log_ring));
+    if(r == NULL) {
+      return NULL;
+    }
+    if(init_ring(&r->ring, ring_size)) {
+      free(r);
+      return NULL;
+    }
+    atomic_init(&r->owned, true);
+    atomic_init(&r->dropped, 0);
+    r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release, memory_order_relaxed));
+  }
+  thread_ring = r;
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+/**
+ * Writes a message into the ring of the calling thread, applying the overflow policy if it is full
  */
-static struct log_msg * create_log_msg() {
-  struct log_msg * msg = malloc(sizeof(struct log_msg));
-  if(msg == NULL) {
+static void push_log_entry(struct log_ring * r, const struct log_entry * entry, size_t len) {
+  assert(r != NULL);
+  assert(entry != NULL);
+  switch(overflow) {
+  case LOG_OVERFLOW_BLOCK:
+    while(push_ring_record(&r->ring, entry, len)) {
+      uint32_t key = prepare_eventcount_wait(&room_made);
+      // room made or a stop requested after preparing wakes this thread up
+      if(!push_ring_record(&r->ring, entry, len)) {
+	cancel_eventcount_wait(&room_made);
+	break;
+      }
+      if(!atomic_load_explicit(&running, memory_order_relaxed)) {
+	cancel_eventcount_wait(&room_made);
+	return;
+      }
+      // the worker thread makes room
+      notify_eventcount(&logged, 1);
+      wait_eventcount(&room_made, key, NULL);
+    }
+    break;
+  case LOG_OVERFLOW_DROP:
+    if(push_ring_record(&r->ring, entry, len)) {
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return;
+    }
+    break;
+  case LOG_OVERFLOW_OVERWRITE: {
+    int dropped = push_ring_record_overwriting(&r->ring, entry, len);
+    if(dropped != 0) {
+      atomic_fetch_add_explicit(&r->dropped, dropped < 0 ? 1 : (uint64_t)dropped, memory_order_relaxed);
+    }
+    break;
+  }
+  }
+  notify_eventcount(&logged, 1);
+}
+
+/**
+ * Adds a site that started suppressing messages to the list of those the logger thread reports,
+ * waking it up to find out when the site has been quiet for long enough
+ */
+static void list_log_site(struct log_site * site) {
+  if(!atomic_exchange_explicit(&site->listed, true, memory_order_relaxed)) {
+    site->next_listed = atomic_load_explicit(&listed_sites, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&listed_sites, &site->next_listed, site, memory_order_release, memory_order_relaxed));
+  }
+  notify_eventcount(&logged, 1);
+}
+
+/**
+ * Takes a token from the bucket of a site, counting the message as suppressed if there is none
+ * The bucket is kept as the time the site may log again, like the generic cell rate algorithm
+ */
+static bool take_log_token(struct log_site * site) {
+  if(rate_interval == 0) {
+    return true;
+  }
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+  uint64_t now = (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+  uint64_t next_allowed = atomic_load_explicit(&site->next_allowed, memory_order_relaxed);
+  uint64_t start;
+  do {
+    start = next_allowed > now ? next_allowed : now;
+    if(start - now > rate_tolerance) {
+      if(atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed) == 0) {
+	list_log_site(site);
+      }
+      return false;
+    }
+  } while(!atomic_compare_exchange_weak_explicit(&site->next_allowed, &next_allowed, start + rate_interval,
+						 memory_order_relaxed, memory_order_relaxed));
+  return true;
+}
+
+/**
+ * Returns the number of messages a site suppressed since it last logged and resets it
+ */
+static uint32_t take_suppressed_count(struct log_site * site) {
+  if(atomic_load_explicit(&site->suppressed, memory_order_relaxed) == 0) {
+    return 0;
+  }
+  uint64_t suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+  return suppressed > UINT32_MAX ? UINT32_MAX : (uint32_t)suppressed;
+}
+
+/**
+ * Finds the next conversion specification of a format
+ * Returns its start, sets its end and the type of its argument, or returns NULL if there is none
+ */
+static const char * find_log_conversion(const char * format, const char ** end, enum log_arg * type) {
+  const char * start = strchr(format, '%');
+  if(start == NULL) {
     return NULL;
   }
-  msg->buffer = NULL;
-  msg->cap = 0;
-  msg->len = 0;
-  msg->priority = LOG_PRIORITY_DEBUG;
-  msg->line = 0;
-  msg->file = NULL;
-  msg->next = NULL;
-  return msg;
+  const char * p = start + 1;
+  p += strspn(p, "-+ #0'");
+  if(*p == '*') {
+    *end = p + 1;
+    *type = LOG_ARG_INVALID;
+    return start;
+  }
+  p += strspn(p, "0123456789");
+  if(*p == '.') {
+    ++p;
+    if(*p == '*') {
+      *end = p + 1;
+      *type = LOG_ARG_INVALID;
+      return start;
+    }
+    p += strspn(p, "0123456789");
+  }
+  // H stands for hh and q for ll
+  char length = '\0';
+  if(*p == 'h' || *p == 'l') {
+    length = *p++;
+    if(*p == length) {
+      length = length == 'h' ? 'H' : 'q';
+      ++p;
+    }
+  } else if(*p != '\0' && strchr("jztL", *p) != NULL) {
+    length = *p++;
+  }
+  if(*p == '\0') {
+    *end = p;
+    *type = LOG_ARG_INVALID;
+    return start;
+  }
+  *end = p + 1;
+  switch(*p) {
+  case '%':
+    *type = length == '\0' ? LOG_ARG_NONE : LOG_ARG_INVALID;
+    break;
+  case 'd':
+  case 'i':
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    switch(length) {
+    case 'l':
+      *type = LOG_ARG_LONG;
+      break;
+    case 'q':
+      *type = LOG_ARG_LLONG;
+      break;
+    case 'j':
+      *type = LOG_ARG_INTMAX;
+      break;
+    case 'z':
+      *type = LOG_ARG_SIZE;
+      break;
+    case 't':
+      *type = LOG_ARG_PTRDIFF;
+      break;
+    case 'L':
+      *type = LOG_ARG_INVALID;
+      break;
+    default:
+      *type = LOG_ARG_INT;
+    }
+    break;
+  case 'a':
+  case 'A':
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+    if(length == 'L') {
+      *type = LOG_ARG_LDOUBLE;
+    } else {
+      *type = length == '\0' || length == 'l' ? LOG_ARG_DOUBLE : LOG_ARG_INVALID;
+    }
+    break;
+  case 'c':
+    *type = length == '\0' ? LOG_ARG_INT : LOG_ARG_INVALID;
+    break;
+  case 's':
+    *type = length == '\0' ? LOG_ARG_STRING : LOG_ARG_INVALID;
+    break;
+  case 'p':
+    *type = length == '\0' ? LOG_ARG_POINTER : LOG_ARG_INVALID;
+    break;
+  default:
+    *type = LOG_ARG_INVALID;
+  }
+  return start;
 }
 
 /**
- * Grows the buffer of this log message if its capacity is smaller
- * than the specified value
+ * Parses the types of the arguments of a format
+ * Returns the number of arguments, or -1 if they cannot be copied
  */
-static int ensure_log_msg_buffer(struct log_msg * msg, size_t cap) {
-  assert(msg != NULL);
-  if(cap > msg->cap) {
-    char * buffer = malloc(cap);
-    if(buffer == NULL) {
+static int parse_log_arg_types(const char * format, unsigned char * types) {
+  int count = 0;
+  const char * end;
+  enum log_arg type;
+  while((format = find_log_conversion(format, &end, &type)) != NULL) {
+    if(type == LOG_ARG_INVALID) {
       return -1;
+    } else if(type != LOG_ARG_NONE) {
+      if(count == LOG_MAX_ARGS) {
+	return -1;
+      }
+      types[count++] = (unsigned char)type;
     }
-    free(msg->buffer);
-    msg->buffer = buffer;
-    msg->cap = cap;
-    msg->len = 0;
+    format = end;
   }
-  return 0;
+  return count;
 }
 
 /**
- * Destroys the supplied message, including its buffer
+ * Returns the number of arguments of a site and sets their types, or returns -1 if they cannot be copied
+ * The types are parsed on first use and kept in the site, a thread racing the one keeping them uses its own buffer
  */
-static void destroy_log_msg(struct log_msg * msg) {
-  assert(msg != NULL);
-  if(msg->buffer != NULL) {
-    free(msg->buffer);
+static int get_log_arg_types(struct log_site * site, unsigned char * buffer, const unsigned char ** types) {
+  int count = atomic_load_explicit(&site->arg_count, memory_order_acquire);
+  if(count > 0) {
+    *types = site->arg_types;
+    return count - 1;
+  } else if(count == -1) {
+    return -1;
   }
-  free(msg);
+  count = parse_log_arg_types(site->format, buffer);
+  *types = buffer;
+  // -2 marks the types as being kept
+  int expected = 0;
+  if(atomic_compare_exchange_strong_explicit(&site->arg_count, &expected, -2, memory_order_relaxed, memory_order_relaxed)) {
+    memcpy(site->arg_types, buffer, LOG_MAX_ARGS);
+    atomic_store_explicit(&site->arg_count, count == -1 ? -1 : count + 1, memory_order_release);
+  }
+  return count;
 }
 
 /**
- * Inititializes a log queue
+ * Copies an argument after the others, fails if there is no room left
  */
-static void init_log_queue(struct log_queue * q) {
-  assert(q != NULL);
-  q->head = NULL;
-  q->tail = NULL;
+static bool pack_log_arg(char * data, size_t * len, const void * value, size_t size) {
+  if(*len + size > LOG_MAX_MSG_LEN) {
+    return false;
+  }
+  memcpy(data + *len, value, size);
+  *len += size;
+  return true;
 }
 
 /**
- * Pops a message from a log queue
+ * Copies the next argument, fails if the arguments were cut short
  */
-static struct log_msg * pop_from_log_queue(struct log_queue * q) {
-  assert(q != NULL);
-  if(q->head == NULL) {
-    return NULL;
-  } else {
-    struct log_msg * m = q->head;
-    q->head = m->next;
-    if(q->head == NULL) {
-      q->tail = NULL;
+static bool unpack_log_arg(const char * data, size_t len, size_t * pos, void * value, size_t size) {
+  if(*pos + size > len) {
+    return false;
+  }
+  memcpy(value, data + *pos, size);
+  *pos += size;
+  return true;
+}
+
+/**
+ * Copies the arguments of a message, strings are truncated to the room left and arguments beyond it are left out
+ * Returns the length of the arguments
+ */
+static size_t pack_log_args(const unsigned char * types, int count, va_list args, char * data) {
+  size_t len = 0;
+  for(int i = 0; i < count; ++i) {
+    bool packed = false;
+    switch((enum log_arg)types[i]) {
+    case LOG_ARG_INT: {
+      int value = va_arg(args, int);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_LONG: {
+      long value = va_arg(args, long);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_LLONG: {
+      long long value = va_arg(args, long long);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_SIZE: {
+      size_t value = va_arg(args, size_t);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_INTMAX: {
+      intmax_t value = va_arg(args, intmax_t);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_PTRDIFF: {
+      ptrdiff_t value = va_arg(args, ptrdiff_t);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_DOUBLE: {
+      double value = va_arg(args, double);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_LDOUBLE: {
+      long double value = va_arg(args, long double);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_POINTER: {
+      void * value = va_arg(args, void *);
+      packed = pack_log_arg(data, &len, &value, sizeof(value));
+      break;
+    }
+    case LOG_ARG_STRING: {
+      const char * value = va_arg(args, const char *);
+      if(value == NULL) {
+	value = "(null)";
+      }
+      if(len + sizeof(uint16_t) < LOG_MAX_MSG_LEN) {
+	uint16_t value_len = (uint16_t)strnlen(value, LOG_MAX_MSG_LEN - len - sizeof(uint16_t));
+	packed = pack_log_arg(data, &len, &value_len, sizeof(value_len)) && pack_log_arg(data, &len, value, value_len);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    if(!packed) {
+      break;
     }
-    return m;
   }
+  return len;
 }
 
 /**
- * Push a message onto a log queue
+ * Returns the length of a text after appending to it the number of characters written by snprintf, as far as they fit
  */
-static void push_onto_log_queue(struct log_queue * q, struct log_msg * msg) {
-  assert(q != NULL);
+static size_t add_log_text(size_t len, int written) {
+  if(written < 0) {
+    return len;
+  }
+  size_t room = LOG_MAX_MSG_LEN - 1 - len;
+  return len + ((size_t)written < room ? (size_t)written : room);
+}
+
+/**
+ * Formats the arguments copied from a site, formatting stops at the first missing argument
+ * Returns the length of the text
+ */
+static size_t format_log_args(const struct log_site * site, const char * data, size_t data_len, char * text) {
+  const char * format = site->format;
+  size_t len = 0;
+  size_t pos = 0;
+  bool unpacked = true;
+  const char * start;
+  const char * end;
+  enum log_arg type;
+  while(unpacked && (start = find_log_conversion(format, &end, &type)) != NULL) {
+    len = add_log_text(len, snprintf(text + len, LOG_MAX_MSG_LEN - len, "%.*s", (int)(start - format), format));
+    char spec[LOG_MAX_SPEC_LEN];
+    if((size_t)(end - start) >= LOG_MAX_SPEC_LEN) {
+      return len;
+    }
+    memcpy(spec, start, (size_t)(end - start));
+    spec[end - start] = '\0';
+    int written = 0;
+    switch(type) {
+    case LOG_ARG_NONE:
+      written = snprintf(text + len, LOG_MAX_MSG_LEN - len, "%%");
+      break;
+    case LOG_ARG_INT: {
+      int value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_LONG: {
+      long value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_LLONG: {
+      long long value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_SIZE: {
+      size_t value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_INTMAX: {
+      intmax_t value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_PTRDIFF: {
+      ptrdiff_t value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_DOUBLE: {
+      double value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_LDOUBLE: {
+      long double value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_POINTER: {
+      void * value;
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value, sizeof(value)))) {
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    case LOG_ARG_STRING: {
+      uint16_t value_len;
+      char value[LOG_MAX_MSG_LEN];
+      if((unpacked = unpack_log_arg(data, data_len, &pos, &value_len, sizeof(value_len)) &&
+	  unpack_log_arg(data, data_len, &pos, value, value_len))) {
+	value[value_len] = '\0';
+	written = snprintf(text + len, LOG_MAX_MSG_LEN - len, spec, value);
+      }
+      break;
+    }
+    default:
+      unpacked = false;
+    }
+    len = add_log_text(len, written);
+    format = end;
+  }
+  if(unpacked) {
+    len = add_log_text(len, snprintf(text + len, LOG_MAX_MSG_LEN - len, "%s", format));
+  }
+  return len;
+}
+
+/**
+ * Formats the description of an error code
+ * Returns the length of the text
+ */
+static size_t format_error_code(const char * msg, int error_code, char * text) {
   assert(msg != NULL);
-  if(q->tail == NULL) {
-    assert(q->head == NULL);
-    q->head = msg;
-    q->tail = msg;
-  } else {
-    q->tail->next = msg;
-    q->tail = msg;
+  char buffer[ERROR_CODE_BUFFER_SIZE];
+  if(strerror_r(error_code, buffer, ERROR_CODE_BUFFER_SIZE)) {
+    //soemthing went badly wrong
+    return add_log_text(0, snprintf(text, LOG_MAX_MSG_LEN, "%s: error code %d", msg, error_code));
   }
-  msg->next = NULL;
+  return add_log_text(0, snprintf(text, LOG_MAX_MSG_LEN, "%s: '%s'", msg, buffer));
 }
 
 /**
- * Shift all messages from the source to the target queue
+ * Writes the batch to the output, synchronizing the output if required
+ * Lines that cannot be written are lost, there is nowhere left to report that
  */
-static void shift_between_log_queues(struct log_queue * dest, struct log_queue * src) {
-  assert(dest != NULL);
-  assert(src != NULL);
-  if(src->head != NULL){
-    if(dest->tail == NULL) {
-      assert(dest->head == NULL);
-      dest->head = src->head;
-      dest->tail = src->tail;
-    } else {
-      assert(dest->head != NULL);
-      dest->tail->next = src->head;
-      dest->tail = src->tail;
+static int flush_log_batch() {
+  size_t written = 0;
+  int result = 0;
+  while(written < batch_len) {
+    ssize_t len = write(output, batch + written, batch_len - written);
+    if(len == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      result = -1;
+      break;
     }
-    src->head = NULL;
-    src->tail = NULL;
+    written += (size_t)len;
   }
+  batch_len = 0;
+  // pipes and terminals cannot be synchronized
+  if(sync_policy == LOG_SYNC_BATCH && fdatasync(output) && errno != EINVAL) {
+    result = -1;
+  }
+  return result;
 }
 
 /**
- * Whether the queue is empty
+ * Stamps the lines formatted from now on with the current time, read from the coarse clock once per batch
  */
-static bool log_queue_is_empty(const struct log_queue * q) {
-  assert(q != NULL);
-  return q->head == NULL;
+static void update_log_timestamp() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  struct tm tm;
+  gmtime_r(&now.tv_sec, &tm);
+  size_t len = strftime(timestamp, LOG_TIMESTAMP_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(timestamp + len, LOG_TIMESTAMP_SIZE - len, ".%03ldZ", now.tv_nsec / 1000000);
 }
 
 /**
- * Disposes a log queue, destorying all messages still on it
+ * Returns whether a time on the monotonic clock has passed
  */
-static void dispose_log_queue(struct log_queue * q) {
-  assert(q != NULL);
-  struct log_msg * m = q->head;
-  while(m != NULL) {
-    struct log_msg * next = m->next;
-    destroy_log_msg(m);
-    m = next;
+static bool has_passed(const struct timespec * deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/**
+ * Appends a line to the batch, writing the batch first if the line does not fit
+ */
+static void append_log_line(enum log_priority priority, const char * file, int line, const char * msg, size_t msg_len) {
+  for(int attempt = 0; attempt < 2; ++attempt) {
+    size_t room = batch_size - batch_len;
+    int len = snprintf(batch + batch_len, room, "%s %s%s:%d:%.*s\n", timestamp, priority_labels[priority], file, line, (int)msg_len, msg);
+    if(len < 0) {
+      return;
+    } else if((size_t)len < room) {
+      if(batch_len == 0 && flush_interval != 0) {
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &flush_deadline);
+	flush_deadline.tv_sec += flush_interval / 1000;
+	flush_deadline.tv_nsec += (long)(flush_interval % 1000) * 1000000;
+	if(flush_deadline.tv_nsec >= 1000000000) {
+	  flush_deadline.tv_sec += 1;
+	  flush_deadline.tv_nsec -= 1000000000;
+	}
+      }
+      batch_len += (size_t)len;
+      return;
+    } else if(batch_len == 0) {
+      // longer than the batch, the line is truncated
+      batch_len = batch_size - 1;
+      batch[batch_len - 1] = '\n';
+      return;
+    }
+    flush_log_batch();
   }
 }
 
 /**
- * Returns a log message that is ready for use, or NULL if none were availabel
- * and creating one failed
+ * Appends the line reporting the messages a site suppressed to the batch, formatted in the text buffer
  */
-static struct log_msg * get_ready_log_msg() {
-  if(pthread_mutex_lock(&ready_mutex)) {
-    return NULL;
+static void append_suppressed_line(const struct log_site * site, uint64_t suppressed, char * text) {
+  size_t len = add_log_text(0, snprintf(text, LOG_MAX_MSG_LEN, "suppressed %llu message(s) over the rate limit", (unsigned long long)suppressed));
+  append_log_line(site->priority, site->file, site->line, text, len);
+}
+
+/**
+ * Formats a log message into the batch, using the text buffer unless it was formatted by the thread logging it
+ */
+static void append_log_entry(const struct log_entry * entry, size_t len, char * text) {
+  assert(entry != NULL);
+  const struct log_site * site = entry->record.site;
+  const char * msg = entry->data;
+  size_t msg_len = len - offsetof(struct log_entry, data);
+  if(entry->record.suppressed != 0) {
+    append_suppressed_line(site, entry->record.suppressed, text);
   }
-  struct log_msg * msg = pop_from_log_queue(&ready);
-  if(pthread_mutex_unlock(&ready_mutex)){
-    if(msg != NULL) {
-      destroy_log_msg(msg);
+  if(!entry->record.formatted) {
+    int error_code;
+    if(!site->error_code) {
+      msg_len = format_log_args(site, entry->data, msg_len, text);
+    } else if(msg_len == sizeof(int)) {
+      memcpy(&error_code, entry->data, sizeof(int));
+      msg_len = format_error_code(site->format, error_code, text);
+    } else {
+      msg_len = 0;
+    }
+    msg = text;
+  }
+  append_log_line(site->priority, site->file, site->line, msg, msg_len);
+}
+
+/**
+ * Formats the messages in all rings into the batch and reports those that were dropped
+ * Returns the number of messages formatted
+ */
+static size_t append_log_rings(struct log_entry * entry, char * text) {
+  size_t count = 0;
+  update_log_timestamp();
+  for(struct log_ring * r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+    uint64_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    if(dropped != 0) {
+      atomic_fetch_add_explicit(&dropped_messages, dropped, memory_order_relaxed);
+      size_t len = add_log_text(0, snprintf(text, LOG_MAX_MSG_LEN, "dropped %llu message(s) from a full log ring", (unsigned long long)dropped));
+      append_log_line(LOG_PRIORITY_WARNING, __FILE__, __LINE__, text, len);
+    }
+    int len;
+    while((len = pop_ring_record(&r->ring, entry, sizeof(struct log_entry))) != -1) {
+      append_log_entry(entry, (size_t)len, text);
+      ++count;
     }
-    return NULL;
   }
-  if(msg == NULL) {
-    msg = create_log_msg();
+  if(count != 0) {
+    // threads blocking on a full ring try again
+    notify_eventcount(&room_made, INT_MAX);
   }
-  return msg;
+  return count;
 }
 
 /**
- * Recycle log messages
+ * Reports the messages suppressed by sites that stopped logging, which no later message of theirs reports
+ * A site is reported once it may log again, having been quiet for longer than the rate limit allows, or when stopping
+ * Returns the earliest time in nanoseconds on the monotonic clock a site left unreported may log again, 0 if there is none
  */
-static int recycle_log_messages(struct log_queue * q) {
-  assert(q != NULL);
-  if(!log_queue_is_empty(q)){
-    if(pthread_mutex_lock(&ready_mutex)) {
-      return -1;
+static uint64_t append_suppressed_counts(char * text, bool stopping) {
+  // the precise clock is never behind the coarse one the sites are timed with, so a deadline waited for has passed
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  uint64_t now = (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+  uint64_t next = 0;
+  for(struct log_site * site = atomic_load_explicit(&listed_sites, memory_order_acquire); site != NULL; site = site->next_listed) {
+    if(atomic_load_explicit(&site->suppressed, memory_order_relaxed) == 0) {
+      continue;
     }
-    shift_between_log_queues(&ready, q);
-    if(pthread_mutex_unlock(&ready_mutex)) {
-      return -1;
+    uint64_t next_allowed = atomic_load_explicit(&site->next_allowed, memory_order_relaxed);
+    if(!stopping && next_allowed > now) {
+      next = next == 0 || next_allowed < next ? next_allowed : next;
+      continue;
+    }
+    // a message logged meanwhile may have taken the count already
+    uint64_t suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    if(suppressed != 0) {
+      append_suppressed_line(site, suppressed, text);
     }
   }
-  return 0;
+  return next;
 }
 
 /**
- * Prints a log message
+ * Returns whether any ring holds messages
  */
-static int print_log_msg(const struct log_msg * msg) {
-  assert(msg != NULL);
-  if(fprintf(output, "%s%s:%d:%s\n", priority_labels[msg->priority], msg->file, msg->line, msg->buffer) < 0) {
-    return -1;
+static bool has_log_entries() {
+  for(struct log_ring * r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+    if(!is_ring_empty(&r->ring)) {
+      return true;
+    }
   }
-  return 0;
+  return false;
 }
 
 /**
  * Worker thread logging function
  */
 static void * log_messages(void *) {
-  struct log_queue active;
-  init_log_queue(&active);
-  bool loop = true;
-  
-  while(loop) {
-    if(pthread_mutex_lock(&waiting_mutex)) {
-      break;
-    }
-    if(!running){
-      loop = false;
-    }else if(log_queue_is_empty(&waiting)){
-      if(pthread_cond_wait(&waiting_cond, &waiting_mutex)) {
-	pthread_mutex_unlock(&waiting_mutex);
-	break;
-      }
+  struct log_entry entry;
+  char text[LOG_MAX_MSG_LEN];
+  while(true) {
+    // messages logged before the logger was stopped are still printed
+    bool stopping = !atomic_load(&running);
+    bool drained = append_log_rings(&entry, text) == 0;
+    uint64_t next_report = append_suppressed_counts(text, stopping);
+    if(batch_len != 0 && ((drained && (stopping || flush_interval == 0)) || (flush_interval != 0 && has_passed(&flush_deadline)))) {
+      flush_log_batch();
     }
-    if(!log_queue_is_empty(&waiting)){
-      shift_between_log_queues(&active, &waiting);
+    if(!drained) {
+      continue;
     }
-    if(pthread_mutex_unlock(&waiting_mutex)){
+    if(stopping) {
       break;
     }
-    
-    struct log_msg * msg = active.head;
-    while(msg != NULL) {
-      if(print_log_msg(msg)){
-	break;
-      }
-      msg = msg->next;
+    uint32_t key = prepare_eventcount_wait(&logged);
+    if(!atomic_load(&running) || has_log_entries()) {
+      cancel_eventcount_wait(&logged);
+      continue;
     }
-    if(recycle_log_messages(&active)){
-      break;
+    const struct timespec * deadline = batch_len != 0 ? &flush_deadline : NULL;
+    struct timespec report_deadline;
+    if(next_report != 0) {
+      // wakes up to report the sites that stay quiet
+      report_deadline.tv_sec = (time_t)(next_report / 1000000000);
+      report_deadline.tv_nsec = (long)(next_report % 1000000000);
+      if(deadline == NULL || report_deadline.tv_sec < deadline->tv_sec ||
+	 (report_deadline.tv_sec == deadline->tv_sec && report_deadline.tv_nsec < deadline->tv_nsec)) {
+	deadline = &report_deadline;
+      }
     }
+    wait_eventcount(&logged, key, deadline);
   }
-  dispose_log_queue(&active);
   return NULL;
 }
 
+/**
+ * Initializes a logger configuration with the default values
+ */
+void init_logger_config(struct logger_config * config) {
+  assert(config != NULL);
+
+  config->output = stdout;
+  config->min_priority = LOG_PRIORITY_DEBUG;
+  config->ring_size = LOGGER_DEFAULT_RING_SIZE;
+  config->overflow = LOG_OVERFLOW_BLOCK;
+  config->format = LOG_FORMAT_DEFERRED;
+  config->batch_size = LOGGER_DEFAULT_BATCH_SIZE;
+  config->flush_interval = 0;
+  config->sync = LOG_SYNC_NONE;
+  config->rate_limit = 0;
+}
+
 /**
  * Starts a logger
  */
-int init_logger(FILE * _output, enum log_priority _min_priority) {
-  assert(_output != NULL);
-  assert(_min_priority == LOG_PRIORITY_DEBUG ||
-	 _min_priority == LOG_PRIORITY_INFO ||
-	 _min_priority == LOG_PRIORITY_WARNING ||
-	 _min_priority == LOG_PRIORITY_ERROR);
-  if(running) {
+int init_logger(const struct logger_config * config) {
+  assert(config != NULL);
+  assert(config->output != NULL);
+  assert(config->min_priority == LOG_PRIORITY_DEBUG ||
+	 config->min_priority == LOG_PRIORITY_INFO ||
+	 config->min_priority == LOG_PRIORITY_WARNING ||
+	 config->min_priority == LOG_PRIORITY_ERROR);
+  if(atomic_load(&running)) {
     return -1;
   }
-  if(pthread_mutex_init(&waiting_mutex, NULL)) {
+  batch_size = config->batch_size < LOG_MIN_BATCH_SIZE ? LOG_MIN_BATCH_SIZE : config->batch_size;
+  batch = (char *)malloc(batch_size);
+  if(batch == NULL) {
     return -1;
   }
-  if(pthread_mutex_init(&ready_mutex, NULL)) {
-    pthread_mutex_destroy(&waiting_mutex);
+  if(pthread_key_create(&ring_key, release_log_ring)) {
+    free(batch);
     return -1;
   }
-  if(pthread_cond_init(&waiting_cond, NULL)) {
-    pthread_mutex_destroy(&ready_mutex);
-    pthread_mutex_destroy(&waiting_mutex);
-    return -1;
-  }
-  init_log_queue(&waiting);
-  init_log_queue(&ready);
-  output = _output;
-  min_priority = _min_priority;
-  running = true;
+  batch_len = 0;
+  flush_interval = config->flush_interval;
+  sync_policy = config->sync;
+  rate_interval = config->rate_limit == 0 ? 0 : 1000000000 / config->rate_limit;
+  rate_tolerance = config->rate_limit == 0 ? 0 : rate_interval * (config->rate_limit - 1);
+  // lines buffered by stdio before the logger started come first
+  fflush(config->output);
+  output = fileno(config->output);
+  atomic_init(&rings, NULL);
+  atomic_init(&listed_sites, NULL);
+  atomic_init(&dropped_messages, 0);
+  init_eventcount(&logged);
+  init_eventcount(&room_made);
+  ring_size = config->ring_size < LOGGER_MIN_RING_SIZE ? LOGGER_MIN_RING_SIZE : config->ring_size;
+  overflow = config->overflow;
+  formatting = config->format;
+  min_priority = config->min_priority;
+  atomic_store(&running, true);
   if(pthread_create(&worker, NULL, log_messages, NULL)) {
-    pthread_cond_destroy(&waiting_cond);
-    pthread_mutex_destroy(&ready_mutex);
-    pthread_mutex_destroy(&waiting_mutex);
+    atomic_store(&running, false);
+    pthread_key_delete(ring_key);
+    free(batch);
     return -1;
   }
   return 0;
 }
 
+/**
+ * Pins the thread writing the messages to a CPU
+ */
+int pin_logger_to_cpu(int cpu) {
+  if(!atomic_load(&running)) {
+    return -1;
+  }
+  return pin_thread_to_cpu(worker, cpu);
+}
+
 /**
  * Returns the minimum message priority
  */
@@ -390,82 +1109,121 @@ enum log_priority get_min_priority() {
 }
 
 /**
- * Logs a message
+ * Returns the number of bytes of messages waiting in the rings
  */
-void log_msg(const char * file, int line, enum log_priority priority, const char * format, ...) {
-  if(priority >= get_min_priority()) {
-    struct log_msg * msg = get_ready_log_msg();
-    assert(msg != NULL);
-    msg->file = file;
-    msg->line = line;
-    msg->priority = priority;
-
-    va_list args;
-    va_start(args, format);
-    int len = vsnprintf(msg->buffer, msg->cap, format, args);
-    va_end(args);
-    if(len < 0) {
-      destroy_log_msg(msg);
-      return;
-    } else if((size_t)len >= msg->cap) {
-      if(ensure_log_msg_buffer(msg, (size_t)len + 1)) {
-	destroy_log_msg(msg);
-	return;
-      }
-      va_list args2;
-      va_start(args2, format);
-      len = vsnprintf(msg->buffer, msg->cap, format, args2);
-      if(len < 0){
-	destroy_log_msg(msg);
-	return;
-      }
-      va_end(args2);
-      assert((size_t)len < msg->cap);
-      msg->buffer[(size_t)len] = '\0';
-    }
-    if(pthread_mutex_lock(&waiting_mutex)) {
-      destroy_log_msg(msg);
-      return;
-    }
-    push_onto_log_queue(&waiting, msg);
-    if(pthread_mutex_unlock(&waiting_mutex)) {
-      return;
-    }
-    pthread_cond_signal(&waiting_cond);
+size_t get_log_queue_len() {
+  size_t len = 0;
+  for(struct log_ring * r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+    len += get_ring_len(&r->ring);
   }
+  return len;
 }
 
-void log_error_code(const char * file, int line, const char * msg, int error_code) {
-  assert(msg != NULL);
-  char buffer[ERROR_CODE_BUFFER_SIZE];
-  if(strerror_r(error_code, buffer, ERROR_CODE_BUFFER_SIZE)) {
-    //soemthing went badly wrong
-    log_msg(file, line, LOG_PRIORITY_ERROR, "%s: error code %d", msg, error_code);
+/**
+ * Returns the number of messages dropped or overwritten because a ring was full
+ */
+uint64_t get_dropped_log_count() {
+  return atomic_load_explicit(&dropped_messages, memory_order_relaxed);
+}
+
+/**
+ * Logs a message
+ * The arguments, or the text formatted on the stack if formatting is not deferred, are copied into the ring of the calling thread
+ * without locking or allocating
+ */
+void log_msg(struct log_site * site, const char * format, ...) {
+  assert(site != NULL);
+  assert(format == site->format);
+  if(site->priority < get_min_priority() || !atomic_load_explicit(&running, memory_order_relaxed)) {
+    return;
+  }
+  if(!take_log_token(site)) {
+    return;
+  }
+  struct log_ring * r = get_log_ring();
+  if(r == NULL) {
+    return;
+  }
+  struct log_entry entry;
+  entry.record.site = site;
+  entry.record.suppressed = take_suppressed_count(site);
+  unsigned char buffer[LOG_MAX_ARGS];
+  const unsigned char * types;
+  int count = formatting == LOG_FORMAT_DEFERRED ? get_log_arg_types(site, buffer, &types) : -1;
+  size_t len;
+  va_list args;
+  va_start(args, format);
+  if(count != -1) {
+    entry.record.formatted = false;
+    len = pack_log_args(types, count, args, entry.data);
   } else {
-    log_msg(file, line, LOG_PRIORITY_ERROR, "%s: '%s'", msg, buffer);
+    entry.record.formatted = true;
+    len = add_log_text(0, vsnprintf(entry.data, LOG_MAX_MSG_LEN, format, args));
   }
+  va_end(args);
+  push_log_entry(r, &entry, offsetof(struct log_entry, data) + len);
 }
 
 /**
- * Stops a logger
+ * Logs the description of an error code
  */
-void dispose_logger() {
-  if(pthread_mutex_lock(&waiting_mutex)) {
+void log_error_code(struct log_site * site, int error_code) {
+  assert(site != NULL);
+  assert(site->error_code);
+  if(site->priority < get_min_priority() || !atomic_load_explicit(&running, memory_order_relaxed)) {
     return;
   }
-  running = false;
-  if(pthread_mutex_unlock(&waiting_mutex)) {
+  if(!take_log_token(site)) {
     return;
   }
-  if(pthread_cond_signal(&waiting_cond)) {
+  struct log_ring * r = get_log_ring();
+  if(r == NULL) {
     return;
   }
+  struct log_entry entry;
+  entry.record.site = site;
+  entry.record.suppressed = take_suppressed_count(site);
+  size_t len;
+  if(formatting == LOG_FORMAT_DEFERRED) {
+    entry.record.formatted = false;
+    memcpy(entry.data, &error_code, sizeof(int));
+    len = sizeof(int);
+  } else {
+    entry.record.formatted = true;
+    len = format_error_code(site->format, error_code, entry.data);
+  }
+  push_log_entry(r, &entry, offsetof(struct log_entry, data) + len);
+}
+
+/**
+ * Stops a logger
+ */
+void dispose_logger() {
+  if(!atomic_load(&running)) {
+    return;
+  }
+  atomic_store(&running, false);
+  notify_eventcount(&logged, INT_MAX);
+  notify_eventcount(&room_made, INT_MAX);
   if(pthread_join(worker, NULL)) {
     return;
   }
-  pthread_cond_destroy(&waiting_cond);
-  pthread_mutex_destroy(&waiting_mutex);
-  pthread_mutex_destroy(&ready_mutex);
-  dispose_log_queue(&ready);
-  dispose_log_queue(&waiting);
+  // threads exiting from now on no longer release their rings
+  pthread_key_delete(ring_key);
+  // the sites are listed again by the next logger
+  struct log_site * site = atomic_exchange(&listed_sites, NULL);
+  while(site != NULL) {
+    struct log_site * next = site->next_listed;
+    atomic_store_explicit(&site->listed, false, memory_order_relaxed);
+    site = next;
+  }
+  struct log_ring * r = atomic_exchange(&rings, NULL);
+  while(r != NULL) {
+    struct log_ring * next = r->next;
+    dispose_ring(&r->ring);
+    free(r);
+    r = next;
+  }
+  thread_ring = NULL;
+  free(batch);
 }
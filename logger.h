@@ -1,8 +1,36 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * The default size of the ring of messages of each thread in bytes
+ */
+#define LOGGER_DEFAULT_RING_SIZE 65536
+
+/**
+ * The smallest ring of messages in bytes, holding a few messages of the maximum length, smaller rings are enlarged
+ */
+#define LOGGER_MIN_RING_SIZE 8192
+
+/**
+ * The default size of the buffer the logger thread formats messages into before writing them in bytes
+ */
+#define LOGGER_DEFAULT_BATCH_SIZE 65536
+
+/**
+ * The maximum number of arguments of a message whose formatting is deferred
+ */
+#define LOG_MAX_ARGS 16
 
 /**
  * The priority of a log message
@@ -26,10 +54,161 @@ enum log_priority {
   LOG_PRIORITY_ERROR
 };
 
+/**
+ * What a thread does when its ring of messages is full
+ */
+enum log_overflow {
+  /**
+   * Waits until the logger makes room
+   */
+  LOG_OVERFLOW_BLOCK,
+  /**
+   * Drops the new message and counts it
+   */
+  LOG_OVERFLOW_DROP,
+  /**
+   * Overwrites the oldest messages and counts them
+   */
+  LOG_OVERFLOW_OVERWRITE
+};
+
+/**
+ * Where log messages are formatted
+ */
+enum log_format {
+  /**
+   * By the thread logging the message
+   */
+  LOG_FORMAT_EAGER,
+  /**
+   * By the logger thread, the thread logging the message only copies the arguments
+   */
+  LOG_FORMAT_DEFERRED
+};
+
+/**
+ * When the output is synchronized with the storage device
+ */
+enum log_sync {
+  /**
+   * Never, left to the kernel
+   */
+  LOG_SYNC_NONE,
+  /**
+   * With fdatasync after every batch is written
+   */
+  LOG_SYNC_BATCH
+};
+
+/**
+ * The logger configuration
+ */
+struct logger_config {
+  /**
+   * The output file
+   */
+  FILE * output;
+  /**
+   * The minimum priority
+   */
+  enum log_priority min_priority;
+  /**
+   * The size of the ring of messages of each thread in bytes
+   */
+  size_t ring_size;
+  /**
+   * What a thread does when its ring is full
+   */
+  enum log_overflow overflow;
+  /**
+   * Where messages are formatted
+   */
+  enum log_format format;
+  /**
+   * The size of the buffer messages are formatted into in bytes, it is written when full
+   */
+  size_t batch_size;
+  /**
+   * The number of milliseconds formatted messages may wait to be written, 0 to write them as soon as no more are waiting
+   */
+  unsigned flush_interval;
+  /**
+   * When the output is synchronized
+   */
+  enum log_sync sync;
+  /**
+   * The number of messages per second each site may log, with bursts of as many, 0 for no limit
+   */
+  unsigned rate_limit;
+};
+
+/**
+ * A place messages are logged from, a static descriptor declared by the logging macros
+ */
+struct log_site {
+  /**
+   * The file
+   */
+  const char * file;
+  /**
+   * The line
+   */
+  int line;
+  /**
+   * The priority
+   */
+  enum log_priority priority;
+  /**
+   * The format, or the message preceding the description of an error code
+   */
+  const char * format;
+  /**
+   * Whether the site logs an error code
+   */
+  bool error_code;
+  /**
+   * The number of arguments parsed from the format on first use plus one,
+   * 0 until the format is parsed and -1 if its arguments cannot be copied
+   */
+  atomic_int arg_count;
+  /**
+   * The types of the arguments
+   */
+  unsigned char arg_types[LOG_MAX_ARGS];
+  /**
+   * When the site may log again without exceeding the rate limit, in nanoseconds on the monotonic clock
+   */
+  _Atomic uint64_t next_allowed;
+  /**
+   * The number of messages suppressed by the rate limit since the site last logged
+   */
+  _Atomic uint64_t suppressed;
+  /**
+   * Whether the site is in the list of sites that suppressed messages
+   */
+  atomic_bool listed;
+  /**
+   * The next site in the list of sites that suppressed messages
+   */
+  struct log_site * next_listed;
+};
+
+/**
+ * Initializes a logger configuration with the default values
+ */
+void init_logger_config(struct logger_config * config);
+
 /**
  * Starts a logger
+ * Every thread logs into a ring of the configured size, drained by the logger thread
+ * which stamps messages with the time and writes them in batches
+ */
+int init_logger(const struct logger_config * config);
+
+/**
+ * Pins the thread writing the messages to a CPU
  */
-int init_logger(FILE * file, enum log_priority min_priority);
+int pin_logger_to_cpu(int cpu);
 
 /**
  * Returns the minimum message priority
@@ -37,18 +216,45 @@ int init_logger(FILE * file, enum log_priority min_priority);
 enum log_priority get_min_priority();
 
 /**
- * Logs a message
+ * Returns the number of bytes of messages waiting to be written
  */
-void log_msg(const char * file, int line, enum log_priority priority, const char * format, ...);
+size_t get_log_queue_len();
 
-void log_error_code(const char * file, int line, const char * msg, int error_code);
+/**
+ * Returns the number of messages dropped or overwritten because a ring was full
+ */
+uint64_t get_dropped_log_count();
+
+/**
+ * Logs a message from a site, the format is the format of the site
+ * Messages exceeding the rate limit of the site are counted, the next message logged reports them,
+ * or the logger once the site has been quiet for longer than the rate limit allows and when it stops
+ */
+void log_msg(struct log_site * site, const char * format, ...);
+
+/**
+ * Logs the description of an error code from a site
+ */
+void log_error_code(struct log_site * site, int error_code);
 
 /**
  * Stops a logger
  */
 void dispose_logger();
 
-#define LOG_MSG(priority, ...) if(priority >= get_min_priority()) log_msg(__FILE__, __LINE__, priority, __VA_ARGS__)
+/**
+ * Messages below this priority are compiled out, see the --with-log-level configure option
+ */
+#ifndef LOG_COMPILED_MIN_PRIORITY
+#define LOG_COMPILED_MIN_PRIORITY LOG_PRIORITY_DEBUG
+#endif
+
+#define LOG_FIRST(first, ...) first
+
+#define LOG_MSG(level, ...) do {					\
+    static struct log_site site = {.file = __FILE__, .line = __LINE__, .priority = level, .format = LOG_FIRST(__VA_ARGS__, 0)}; \
+    if(level >= LOG_COMPILED_MIN_PRIORITY && level >= get_min_priority()) log_msg(&site, __VA_ARGS__); \
+  } while(0)
 
 #define LOG_DEBUG(...) LOG_MSG(LOG_PRIORITY_DEBUG, __VA_ARGS__)
 
@@ -58,7 +264,10 @@ void dispose_logger();
 
 #define LOG_ERROR(...) LOG_MSG(LOG_PRIORITY_ERROR, __VA_ARGS__)
 
-#define LOG_ERROR_CODE(msg, error_code) log_error_code(__FILE__, __LINE__, msg, error_code)
+#define LOG_ERROR_CODE(msg, code) do {					\
+    static struct log_site site = {.file = __FILE__, .line = __LINE__, .priority = LOG_PRIORITY_ERROR, .format = msg, .error_code = true}; \
+    log_error_code(&site, code);					\
+  } while(0)
 
 #define LOG_ERRNO(msg) LOG_ERROR_CODE(msg, errno)
 
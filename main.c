@@ -1,19 +1,278 @@
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "logger.h"
+#include "metrics.h"
+#include "scan.h"
 #include "server.h"
 
+/**
+ * Prints the command line usage
+ */
+static void print_usage(const char * name) {
+  fprintf(stderr,
+	  "usage: %s [-p port] [-c max connections] [-n min workers] [-w max workers] [-i epoll|uring] [-s shards]\n"
+	  "       [-r max requests per connection] [-t idle timeout in seconds] [-H header timeout in seconds]\n"
+	  "       [-b body timeout in seconds] [-W write timeout in seconds] [-d request timeout in milliseconds]\n"
+	  "       [-q soft limit] [-Q hard limit] [-R retry after in seconds] [-m shared|stealing]\n"
+	  "       [-a shard CPU list] [-A cpu|node|none worker affinity] [-l logger CPU]\n"
+	  "       [-k log ring size in KiB per thread] [-L block|drop|overwrite full log ring]\n"
+	  "       [-f eager|deferred log formatting] [-B log batch size in KiB]\n"
+	  "       [-I log flush interval in milliseconds] [-S none|batch log sync]\n"
+	  "       [-M log messages per second per call site] [-o access log path] [-O clf|json access log format]\n"
+	  "       [-P metrics path]\n",
+	  name);
+}
+
+/**
+ * Parses a positive number from a command line argument
+ */
+static int parse_size(const char * arg, size_t * dest) {
+  char * end;
+  unsigned long value = strtoul(arg, &end, 10);
+  if(*arg == '\0' || *end != '\0' || value == 0) {
+    return -1;
+  }
+  *dest = (size_t)value;
+  return 0;
+}
+
+/**
+ * Parses the command line into a server configuration
+ */
+static int parse_args(int arg_count, char * args[], struct server_config * config) {
+  size_t value;
+  int option;
+  while((option = getopt(arg_count, args, "p:c:n:w:i:s:r:t:H:b:W:d:q:Q:R:m:a:A:l:k:L:f:B:I:S:M:o:O:P:")) != -1) {
+    switch(option) {
+    case 'p':
+      if(parse_size(optarg, &value) || value > 65535) {
+	return -1;
+      }
+      config->port = (uint16_t)value;
+      break;
+    case 'c':
+      if(parse_size(optarg, &config->max_connections)) {
+	return -1;
+      }
+      break;
+    case 'n':
+      if(parse_size(optarg, &config->min_workers)) {
+	return -1;
+      }
+      break;
+    case 'w':
+      if(parse_size(optarg, &config->max_workers)) {
+	return -1;
+      }
+      break;
+    case 'i':
+      if(strcmp(optarg, "epoll") == 0) {
+	config->io = SERVER_IO_EPOLL;
+      } else if(strcmp(optarg, "uring") == 0) {
+	config->io = SERVER_IO_URING;
+      } else {
+	return -1;
+      }
+      break;
+    case 's':
+      if(strcmp(optarg, "0") == 0) {
+	config->shards = 0;
+      } else if(parse_size(optarg, &config->shards)) {
+	return -1;
+      }
+      break;
+    case 'r':
+      if(parse_size(optarg, &config->max_requests)) {
+	return -1;
+      }
+      break;
+    case 't':
+      if(parse_size(optarg, &value) || value > 86400) {
+	return -1;
+      }
+      config->idle_timeout = (unsigned)value;
+      break;
+    case 'H':
+      if(parse_size(optarg, &value) || value > 86400) {
+	return -1;
+      }
+      config->header_timeout = (unsigned)value;
+      break;
+    case 'b':
+      if(parse_size(optarg, &value) || value > 86400) {
+	return -1;
+      }
+      config->body_timeout = (unsigned)value;
+      break;
+    case 'W':
+      if(parse_size(optarg, &value) || value > 86400) {
+	return -1;
+      }
+      config->write_timeout = (unsigned)value;
+      break;
+    case 'd':
+      if(parse_size(optarg, &value) || value > 86400000) {
+	return -1;
+      }
+      config->request_timeout = (unsigned)value;
+      break;
+    case 'q':
+      if(parse_size(optarg, &config->soft_limit)) {
+	return -1;
+      }
+      break;
+    case 'Q':
+      if(parse_size(optarg, &config->hard_limit)) {
+	return -1;
+      }
+      break;
+    case 'R':
+      if(parse_size(optarg, &value) || value > 86400) {
+	return -1;
+      }
+      config->retry_after = (unsigned)value;
+      break;
+    case 'm':
+      if(strcmp(optarg, "shared") == 0) {
+	config->scheduler = TASK_SCHEDULER_SHARED;
+      } else if(strcmp(optarg, "stealing") == 0) {
+	config->scheduler = TASK_SCHEDULER_STEALING;
+      } else {
+	return -1;
+      }
+      break;
+    case 'a':
+      if(parse_cpu_list(optarg, &config->cpus) || get_cpu_mask_count(&config->cpus) == 0) {
+	return -1;
+      }
+      break;
+    case 'A':
+      if(strcmp(optarg, "cpu") == 0) {
+	config->worker_affinity = SERVER_WORKER_AFFINITY_CPU;
+      } else if(strcmp(optarg, "node") == 0) {
+	config->worker_affinity = SERVER_WORKER_AFFINITY_NODE;
+      } else if(strcmp(optarg, "none") == 0) {
+	config->worker_affinity = SERVER_WORKER_AFFINITY_NONE;
+      } else {
+	return -1;
+      }
+      break;
+    case 'l':
+      if(strcmp(optarg, "0") == 0) {
+	config->logger_cpu = 0;
+      } else if(parse_size(optarg, &value) || value >= CPU_MASK_SIZE) {
+	return -1;
+      } else {
+	config->logger_cpu = (int)value;
+      }
+      break;
+    case 'k':
+      if(parse_size(optarg, &value) || value > 1048576 || value * 1024 < LOGGER_MIN_RING_SIZE) {
+	return -1;
+      }
+      config->logger.ring_size = value * 1024;
+      break;
+    case 'L':
+      if(strcmp(optarg, "block") == 0) {
+	config->logger.overflow = LOG_OVERFLOW_BLOCK;
+      } else if(strcmp(optarg, "drop") == 0) {
+	config->logger.overflow = LOG_OVERFLOW_DROP;
+      } else if(strcmp(optarg, "overwrite") == 0) {
+	config->logger.overflow = LOG_OVERFLOW_OVERWRITE;
+      } else {
+	return -1;
+      }
+      break;
+    case 'f':
+      if(strcmp(optarg, "eager") == 0) {
+	config->logger.format = LOG_FORMAT_EAGER;
+      } else if(strcmp(optarg, "deferred") == 0) {
+	config->logger.format = LOG_FORMAT_DEFERRED;
+      } else {
+	return -1;
+      }
+      break;
+    case 'B':
+      if(parse_size(optarg, &value) || value > 1048576) {
+	return -1;
+      }
+      config->logger.batch_size = value * 1024;
+      break;
+    case 'I':
+      if(parse_size(optarg, &value) || value > 86400000) {
+	return -1;
+      }
+      config->logger.flush_interval = (unsigned)value;
+      break;
+    case 'S':
+      if(strcmp(optarg, "none") == 0) {
+	config->logger.sync = LOG_SYNC_NONE;
+      } else if(strcmp(optarg, "batch") == 0) {
+	config->logger.sync = LOG_SYNC_BATCH;
+      } else {
+	return -1;
+      }
+      break;
+    case 'M':
+      if(parse_size(optarg, &value) || value > 1000000) {
+	return -1;
+      }
+      config->logger.rate_limit = (unsigned)value;
+      break;
+    case 'o':
+      config->access_log = optarg;
+      break;
+    case 'O':
+      if(strcmp(optarg, "clf") == 0) {
+	config->access_log_format = ACCESS_LOG_FORMAT_COMMON;
+      } else if(strcmp(optarg, "json") == 0) {
+	config->access_log_format = ACCESS_LOG_FORMAT_JSON;
+      } else {
+	return -1;
+      }
+      break;
+    case 'P':
+      if(optarg[0] != '/') {
+	return -1;
+      }
+      config->metrics_path = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
+  return optind == arg_count ? 0 : -1;
+}
+
 /**
  * Main application entry point
  */
-int main(int arg_count, const char * args[]) {
-  init_logger(stdout, LOG_PRIORITY_DEBUG);
+int main(int arg_count, char * args[]) {
+  struct server_config config;
+  init_server_config(&config);
+  if(parse_args(arg_count, args, &config)) {
+    print_usage(args[0]);
+    return EXIT_FAILURE;
+  }
+
+  init_logger(&config.logger);
+  if(config.logger_cpu != -1) {
+    pin_logger_to_cpu(config.logger_cpu);
+  }
+  init_metrics();
+  init_scanner();
+  LOG_INFO("using %s delimiter scanner", get_scanner_name());
 
-  if(start_server(8090, 10) == 0) {
+  int result = start_server(&config);
+  if(result == 0) {
+    result = run_server();
     stop_server();
   }
   
+  dispose_metrics();
   dispose_logger();
-  return EXIT_SUCCESS;
+  return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
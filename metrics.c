@@ -0,0 +1,428 @@
+#include "affinity.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The description of a counter or histogram
+ */
+struct metric_info {
+  /**
+   * The name, shared by the counters of a family
+   */
+  const char * name;
+  /**
+   * The labels telling apart the counters of a family, or NULL
+   */
+  const char * labels;
+  /**
+   * The help text of the family
+   */
+  const char * help;
+};
+
+/**
+ * A value kept by another module
+ */
+struct metric_reader {
+  /**
+   * The type
+   */
+  enum metric_type type;
+  /**
+   * The name
+   */
+  const char * name;
+  /**
+   * The help text
+   */
+  const char * help;
+  /**
+   * The labels, empty if there are none
+   */
+  char labels[METRICS_LABELS_LEN];
+  /**
+   * Reads the value
+   */
+  uint64_t (*read)(void * context);
+  /**
+   * The context of the reader
+   */
+  void * context;
+};
+
+/**
+ * The counters and histograms recorded by one thread
+ * Only the owning thread writes them, so recording needs no atomic read-modify-write
+ * Shards are never freed while the metrics are in use, the shard of a thread that exits is reused by the next new thread
+ */
+struct metrics_shard {
+  /**
+   * The counters, on cache lines of their own
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+  /**
+   * The sums of the values recorded in the histograms
+   */
+  _Atomic uint64_t sums[METRIC_HISTOGRAM_COUNT];
+  /**
+   * The buckets of the histograms
+   */
+  _Atomic uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+  /**
+   * Whether a thread is recording into the shard
+   */
+  atomic_bool owned;
+  /**
+   * The next shard in the list of all shards
+   */
+  struct metrics_shard * next;
+};
+
+/**
+ * The counters, those of a family next to each other
+ */
+static const struct metric_info counter_info[METRIC_COUNTER_COUNT] = {
+  [METRIC_CONNECTIONS_ACCEPTED] = {"http_connections_accepted_total", NULL, "Connections admitted by the event loops"},
+  [METRIC_CONNECTIONS_REFUSED] = {"http_connections_refused_total", NULL, "Connections shed by the event loops"},
+  [METRIC_PARSE_ERRORS] = {"http_parse_errors_total", NULL, "Requests the parser failed on"},
+  [METRIC_RESPONSES_OK] = {"http_responses_total", "code=\"200\"", "Responses by status code"},
+  [METRIC_RESPONSES_BAD_REQUEST] = {"http_responses_total", "code=\"400\"", NULL},
+  [METRIC_RESPONSES_PAYLOAD_TOO_LARGE] = {"http_responses_total", "code=\"413\"", NULL},
+  [METRIC_RESPONSES_REQUEST_HEADER_FIELDS_TOO_LARGE] = {"http_responses_total", "code=\"431\"", NULL},
+  [METRIC_RESPONSES_INTERNAL_SERVER_ERROR] = {"http_responses_total", "code=\"500\"", NULL},
+  [METRIC_RESPONSES_NOT_IMPLEMENTED] = {"http_responses_total", "code=\"501\"", NULL},
+  [METRIC_RESPONSES_SERVICE_UNAVAILABLE] = {"http_responses_total", "code=\"503\"", NULL}
+};
+
+/**
+ * The histograms, exposed as summaries in seconds
+ */
+static const struct metric_info histogram_info[METRIC_HISTOGRAM_COUNT] = {
+  [METRIC_TASK_WAIT] = {"http_task_wait_seconds", NULL, "Time requests waited for a worker thread"},
+  [METRIC_SERVE_TIME] = {"http_serve_seconds", NULL, "Time worker threads spent serving the requests buffered for a connection"}
+};
+
+/**
+ * The quantiles exposed for every histogram
+ */
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/**
+ * The values kept by other modules
+ */
+static struct metric_reader readers[METRICS_MAX_READERS];
+
+/**
+ * The number of values kept by other modules
+ */
+static size_t reader_count;
+
+/**
+ * All shards, newest first
+ */
+static _Atomic(struct metrics_shard *) shards;
+
+/**
+ * The shard of the calling thread
+ */
+static _Thread_local struct metrics_shard * thread_shard;
+
+/**
+ * The key releasing the shard of a thread when the thread exits
+ */
+static pthread_key_t shard_key;
+
+/**
+ * Whether the metrics are initialized
+ */
+static atomic_bool initialized = false;
+
+/**
+ * Hands the shard of an exiting thread over to the next thread that records
+ */
+static void release_metrics_shard(void * data) {
+  struct metrics_shard * s = (struct metrics_shard *)data;
+  atomic_store_explicit(&s->owned, false, memory_order_release);
+}
+
+/**
+ * Creates a shard owned by the calling thread and adds it to the list
+ */
+static struct metrics_shard * create_metrics_shard() {
+  struct metrics_shard * s = (struct metrics_shard *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct metrics_shard));
+  if(s == NULL) {
+    LOG_ERRNO("could not allocate metrics shard");
+    return NULL;
+  }
+  for(size_t i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+    atomic_init(s->counters + i, 0);
+  }
+  for(size_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+    atomic_init(s->sums + i, 0);
+    for(size_t j = 0; j < METRICS_HISTOGRAM_BUCKETS; ++j) {
+      atomic_init(s->buckets[i] + j, 0);
+    }
+  }
+  atomic_init(&s->owned, true);
+  s->next = atomic_load_explicit(&shards, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak_explicit(&shards, &s->next, s, memory_order_release, memory_order_relaxed));
+  return s;
+}
+
+/**
+ * Returns the shard of the calling thread, taking over a released shard or creating a new one on the first record
+ * Returns NULL if the metrics are not initialized or no shard could be created
+ */
+static struct metrics_shard * get_metrics_shard() {
+  if(thread_shard != NULL) {
+    return thread_shard;
+  }
+  if(!atomic_load_explicit(&initialized, memory_order_relaxed)) {
+    return NULL;
+  }
+  struct metrics_shard * s;
+  for(s = atomic_load_explicit(&shards, memory_order_acquire); s != NULL; s = s->next) {
+    bool owned = false;
+    if(atomic_compare_exchange_strong_explicit(&s->owned, &owned, true, memory_order_acquire, memory_order_relaxed)) {
+      break;
+    }
+  }
+  if(s == NULL && (s = create_metrics_shard()) == NULL) {
+    return NULL;
+  }
+  thread_shard = s;
+  pthread_setspecific(shard_key, s);
+  return s;
+}
+
+/**
+ * Adds an amount to a value of a shard
+ */
+static void increase_metric(_Atomic uint64_t * value, uint64_t amount) {
+  // only the owner writes, so a plain load and store lose no update and need no locked instruction
+  atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+/**
+ * Returns the bucket of a value, the values below 2^bits have one bucket each
+ * and the range of every higher power of two is split into 2^bits buckets
+ */
+static size_t get_histogram_bucket(uint64_t value) {
+  if(value < (1u << METRICS_SUB_BUCKET_BITS)) {
+    return (size_t)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+  return ((size_t)(shift + 1) << METRICS_SUB_BUCKET_BITS) + (size_t)(value >> shift) - (1u << METRICS_SUB_BUCKET_BITS);
+}
+
+/**
+ * Returns the value in the middle of a bucket
+ */
+static uint64_t get_bucket_value(size_t bucket) {
+  size_t range = bucket >> METRICS_SUB_BUCKET_BITS;
+  uint64_t sub_bucket = bucket & ((1u << METRICS_SUB_BUCKET_BITS) - 1);
+  if(range == 0) {
+    return sub_bucket;
+  }
+  uint64_t lowest = ((1u << METRICS_SUB_BUCKET_BITS) + sub_bucket) << (range - 1);
+  return lowest + ((uint64_t)1 << (range - 1)) / 2;
+}
+
+/**
+ * Appends formatted text, as far as there is room for it
+ * Returns the length of the text including what did not fit
+ */
+static size_t append_metrics_text(char * dest, size_t cap, size_t len, const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = len < cap ? vsnprintf(dest + len, cap - len, format, args) : vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  return written < 0 ? len : len + (size_t)written;
+}
+
+/**
+ * Appends the help and type of a family
+ */
+static size_t append_metrics_family(char * dest, size_t cap, size_t len, const char * name, const char * help, const char * type) {
+  len = append_metrics_text(dest, cap, len, "# HELP %s %s\n", name, help);
+  return append_metrics_text(dest, cap, len, "# TYPE %s %s\n", name, type);
+}
+
+/**
+ * Appends a sample with optional labels
+ */
+static size_t append_metrics_sample(char * dest, size_t cap, size_t len, const char * name, const char * labels, uint64_t value) {
+  if(labels == NULL || labels[0] == '\0') {
+    return append_metrics_text(dest, cap, len, "%s %llu\n", name, (unsigned long long)value);
+  }
+  return append_metrics_text(dest, cap, len, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+}
+
+/**
+ * Appends the counters, summed over all shards
+ */
+static size_t append_metrics_counters(char * dest, size_t cap, size_t len) {
+  for(size_t i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+    const struct metric_info * info = counter_info + i;
+    if(info->help != NULL) {
+      len = append_metrics_family(dest, cap, len, info->name, info->help, "counter");
+    }
+    uint64_t value = 0;
+    for(struct metrics_shard * s = atomic_load_explicit(&shards, memory_order_acquire); s != NULL; s = s->next) {
+      value += atomic_load_explicit(s->counters + i, memory_order_relaxed);
+    }
+    len = append_metrics_sample(dest, cap, len, info->name, info->labels, value);
+  }
+  return len;
+}
+
+/**
+ * Appends a histogram, merged over all shards, as a summary of its quantiles
+ */
+static size_t append_metrics_histogram(char * dest, size_t cap, size_t len, enum metric_histogram histogram) {
+  const struct metric_info * info = histogram_info + histogram;
+  uint64_t buckets[METRICS_HISTOGRAM_BUCKETS] = {0};
+  uint64_t sum = 0;
+  for(struct metrics_shard * s = atomic_load_explicit(&shards, memory_order_acquire); s != NULL; s = s->next) {
+    sum += atomic_load_explicit(s->sums + histogram, memory_order_relaxed);
+    for(size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+      buckets[i] += atomic_load_explicit(s->buckets[histogram] + i, memory_order_relaxed);
+    }
+  }
+  uint64_t count = 0;
+  for(size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+    count += buckets[i];
+  }
+  len = append_metrics_family(dest, cap, len, info->name, info->help, "summary");
+  size_t bucket = 0;
+  uint64_t seen = 0;
+  for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+    // the bucket holding the value of this rank, counting from 1
+    double position = quantiles[i] * (double)count;
+    uint64_t rank = (uint64_t)position;
+    if(rank < position || rank == 0) {
+      ++rank;
+    }
+    while(bucket < METRICS_HISTOGRAM_BUCKETS && seen + buckets[bucket] < rank) {
+      seen += buckets[bucket++];
+    }
+    double value = count == 0 || bucket == METRICS_HISTOGRAM_BUCKETS ? 0 : (double)get_bucket_value(bucket) / 1e9;
+    len = append_metrics_text(dest, cap, len, "%s{quantile=\"%g\"} %.9g\n", info->name, quantiles[i], value);
+  }
+  len = append_metrics_text(dest, cap, len, "%s_sum %.9g\n", info->name, (double)sum / 1e9);
+  return append_metrics_text(dest, cap, len, "%s_count %llu\n", info->name, (unsigned long long)count);
+}
+
+/**
+ * Appends the values kept by other modules, those of the same name together
+ */
+static size_t append_metrics_readers(char * dest, size_t cap, size_t len) {
+  for(size_t i = 0; i < reader_count; ++i) {
+    bool listed = false;
+    for(size_t j = 0; j < i && !listed; ++j) {
+      listed = strcmp(readers[j].name, readers[i].name) == 0;
+    }
+    if(listed) {
+      continue;
+    }
+    len = append_metrics_family(dest, cap, len, readers[i].name, readers[i].help,
+				readers[i].type == METRIC_TYPE_COUNTER ? "counter" : "gauge");
+    for(size_t j = i; j < reader_count; ++j) {
+      if(strcmp(readers[j].name, readers[i].name) == 0) {
+	len = append_metrics_sample(dest, cap, len, readers[j].name, readers[j].labels, (*readers[j].read)(readers[j].context));
+      }
+    }
+  }
+  return len;
+}
+
+int init_metrics() {
+  if(atomic_load(&initialized)) {
+    return -1;
+  }
+  int result;
+  if((result = pthread_key_create(&shard_key, release_metrics_shard))) {
+    LOG_ERROR_CODE("could not create metrics shard key", result);
+    return -1;
+  }
+  atomic_init(&shards, NULL);
+  reader_count = 0;
+  atomic_store(&initialized, true);
+  return 0;
+}
+
+int register_metric_reader(enum metric_type type, const char * name, const char * help, const char * labels,
+			   uint64_t (*read)(void * context), void * context) {
+  assert(name != NULL);
+  assert(help != NULL);
+  assert(read != NULL);
+
+  if(reader_count == METRICS_MAX_READERS) {
+    LOG_ERROR("too many metrics to register %s", name);
+    return -1;
+  }
+  struct metric_reader * r = readers + reader_count++;
+  r->type = type;
+  r->name = name;
+  r->help = help;
+  snprintf(r->labels, METRICS_LABELS_LEN, "%s", labels == NULL ? "" : labels);
+  r->read = read;
+  r->context = context;
+  return 0;
+}
+
+void add_to_metric(enum metric_counter counter, uint64_t amount) {
+  assert(counter < METRIC_COUNTER_COUNT);
+
+  struct metrics_shard * s = get_metrics_shard();
+  if(s != NULL) {
+    increase_metric(s->counters + counter, amount);
+  }
+}
+
+void record_metric(enum metric_histogram histogram, uint64_t value) {
+  assert(histogram < METRIC_HISTOGRAM_COUNT);
+
+  struct metrics_shard * s = get_metrics_shard();
+  if(s != NULL) {
+    increase_metric(s->buckets[histogram] + get_histogram_bucket(value), 1);
+    increase_metric(s->sums + histogram, value);
+  }
+}
+
+size_t format_metrics(char * dest, size_t cap) {
+  assert(dest != NULL || cap == 0);
+
+  size_t len = append_metrics_counters(dest, cap, 0);
+  for(size_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+    len = append_metrics_histogram(dest, cap, len, (enum metric_histogram)i);
+  }
+  return append_metrics_readers(dest, cap, len);
+}
+
+void dispose_metrics() {
+  if(!atomic_load(&initialized)) {
+    return;
+  }
+  atomic_store(&initialized, false);
+  // threads exiting from now on no longer release their shards
+  pthread_key_delete(shard_key);
+  struct metrics_shard * s = atomic_exchange(&shards, NULL);
+  while(s != NULL) {
+    struct metrics_shard * next = s->next;
+    free(s);
+    s = next;
+  }
+  thread_shard = NULL;
+  reader_count = 0;
+}
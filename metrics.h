@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The number of bits of a value kept below its most significant bit by a histogram,
+ * every power of two range is split into 2^bits buckets of the same width
+ */
+#define METRICS_SUB_BUCKET_BITS 4
+
+/**
+ * The number of buckets of a histogram, covering all 64 bit values
+ */
+#define METRICS_HISTOGRAM_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS)
+
+/**
+ * The maximum number of values read from other modules when the metrics are exposed
+ */
+#define METRICS_MAX_READERS 256
+
+/**
+ * The room for the labels of a value read from another module
+ */
+#define METRICS_LABELS_LEN 32
+
+/**
+ * The counters recorded on the hot paths
+ */
+enum metric_counter {
+  /**
+   * Connections admitted by an event loop
+   */
+  METRIC_CONNECTIONS_ACCEPTED,
+  /**
+   * Connections shed by an event loop
+   */
+  METRIC_CONNECTIONS_REFUSED,
+  /**
+   * Requests the parser failed on
+   */
+  METRIC_PARSE_ERRORS,
+  /**
+   * Responses by status code
+   */
+  METRIC_RESPONSES_OK,
+  METRIC_RESPONSES_BAD_REQUEST,
+  METRIC_RESPONSES_PAYLOAD_TOO_LARGE,
+  METRIC_RESPONSES_REQUEST_HEADER_FIELDS_TOO_LARGE,
+  METRIC_RESPONSES_INTERNAL_SERVER_ERROR,
+  METRIC_RESPONSES_NOT_IMPLEMENTED,
+  METRIC_RESPONSES_SERVICE_UNAVAILABLE,
+  /**
+   * The number of counters
+   */
+  METRIC_COUNTER_COUNT
+};
+
+/**
+ * The latency histograms recorded on the hot paths, in nanoseconds
+ */
+enum metric_histogram {
+  /**
+   * The time a task waited for a worker thread
+   */
+  METRIC_TASK_WAIT,
+  /**
+   * The time a worker thread spent serving the requests buffered for a connection
+   */
+  METRIC_SERVE_TIME,
+  /**
+   * The number of histograms
+   */
+  METRIC_HISTOGRAM_COUNT
+};
+
+/**
+ * The types of the values read from other modules
+ */
+enum metric_type {
+  /**
+   * A value that only grows
+   */
+  METRIC_TYPE_COUNTER,
+  /**
+   * A value that goes up and down
+   */
+  METRIC_TYPE_GAUGE
+};
+
+/**
+ * Initializes the metrics, before any thread records
+ */
+int init_metrics();
+
+/**
+ * Registers a value kept by another module, read only when the metrics are exposed
+ * Values of the same name must be registered with different labels, such as shard="0"
+ * Must be called before the metrics are exposed
+ */
+int register_metric_reader(enum metric_type type, const char * name, const char * help, const char * labels,
+			   uint64_t (*read)(void * context), void * context);
+
+/**
+ * Adds an amount to a counter in the shard of the calling thread
+ */
+void add_to_metric(enum metric_counter counter, uint64_t amount);
+
+/**
+ * Records a duration in nanoseconds in a histogram in the shard of the calling thread
+ */
+void record_metric(enum metric_histogram histogram, uint64_t value);
+
+/**
+ * Formats all metrics, merging the shards, in the Prometheus text format
+ * Returns the length of the text, which was only written completely if it is less than cap
+ */
+size_t format_metrics(char * dest, size_t cap);
+
+/**
+ * Disposes of the metrics, once the threads recording them have stopped
+ */
+void dispose_metrics();
+
+#endif
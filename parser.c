@@ -1,198 +1,481 @@
 #include "parser.h"
+#include "scan.h"
+#include "slice.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /**
- * Returns the next character
+ * A cursor over data that has been received completely
  */
-static int parse_next(struct parser * p, char * dest) {
+struct cursor {
+  /**
+   * A pointer to the data
+   */
+  const char * data;
+
+  /**
+   * The end of the data
+   */
+  size_t len;
+
+  /**
+   * The current position of the cursor
+   */
+  size_t pos;
+};
+
+/**
+ * Initializes a cursor over a slice of the data
+ */
+static void init_cursor(struct cursor * p, const char * data, struct slice s) {
+  p->data = data;
+  p->pos = s.offset;
+  p->len = s.offset + s.len;
+}
+
+/**
+ * Skips the next character if it is equal to the specified character
+ */
+static int skip_next_char(struct cursor * p, char c) {
   assert(p != NULL);
 
-  if(p->len == p->pos) {
+  if(p->len == p->pos || p->data[p->pos] != c) {
     return -1;
   }
-  *dest = p->data[p->pos];
   ++p->pos;
   return 0;
 }
 
 /**
- * Skips the next character if it is equal to the specified character
+ * Skips until any character of the set
  */
-static int skip_next_char(struct parser * p, char c) {
+static int skip_until_any(struct cursor * p, const char * set) {
   assert(p != NULL);
+  assert(set != NULL);
 
-  if(p->len == p->pos || p->data[p->pos] != c) {
+  const char * c = scan_for_any(p->data + p->pos, p->len - p->pos, set);
+  if(c == NULL) {
+    p->pos = p->len;
     return -1;
   }
-  ++p->pos;
+  p->pos = (size_t)(c - p->data);
   return 0;
 }
 
 /**
- * Skips the next characters if they equal the specified string
+ * Skips until the specified character
  */
-static int skip_next_string(struct parser * p, const char * str) {
+static int skip_until_char(struct cursor * p, char c) {
   assert(p != NULL);
-  assert(str != NULL);
 
-  while(*str != '\0') {
-    if(skip_next_char(p, *str)) {
-      return -1;
-    }
-    ++str;
+  const char * d = scan_for_char(p->data + p->pos, p->len - p->pos, c);
+  if(d == NULL) {
+    p->pos = p->len;
+    return -1;
   }
+  p->pos = (size_t)(d - p->data);
   return 0;
 }
 
 /**
- * Skips until the predicate is true
+ * Characters ending the authority of an URL
  */
-static int skip_until_pred(struct parser * p, bool (*pred)(char)) {
-  assert(p != NULL);
-  assert(pred != NULL);
+#define AUTHORITY_END_CHARS "/?"
 
-  while(true){
-    if(p->pos != p->len) {
+/**
+ * Characters ending the path of an URL
+ */
+#define PATH_END_CHARS "?"
+
+/**
+ * Makes a slice of the parsed data
+ */
+static struct slice make_slice(size_t start, size_t end) {
+  struct slice s;
+  s.offset = start;
+  s.len = end - start;
+  return s;
+}
+
+/**
+ * Parses a port number between 0 and 65535
+ */
+static int parse_port(const char * data, struct slice s, uint16_t * port) {
+  if(s.len == 0 || s.len > 5) {
+    return -1;
+  }
+  unsigned long value = 0;
+  for(size_t i = s.offset; i < s.offset + s.len; ++i) {
+    if(data[i] < '0' || data[i] > '9') {
       return -1;
     }
-    if((*pred)(p->data[p->pos])) {
-      return 0;
-    }
-    ++p->pos;
+    value = value * 10 + (unsigned long)(data[i] - '0');
+  }
+  if(value > 65535) {
+    return -1;
   }
+  *port = (uint16_t)value;
+  return 0;
 }
 
 /**
- * Skips until the specified character
+ * Parses an authority of the form host[:port] into the URL
  */
-static int skip_until_char(struct parser * p, char c) {
-  assert(p != NULL);
-  
-  while(true){
-    if(p->pos != p->len) {
+static int parse_authority(const char * data, struct slice authority, struct url * url) {
+  struct cursor p;
+  init_cursor(&p, data, authority);
+  size_t start = p.pos;
+  if(skip_next_char(&p, '[') == 0) {
+    // IPv6 literal
+    if(skip_until_char(&p, ']')) {
       return -1;
     }
-    if(p->data[p->pos] == c) {
-      return 0;
-    }
-    ++p->pos;
+    ++p.pos;
+  } else {
+    skip_until_any(&p, ":");
+  }
+  url->host = make_slice(start, p.pos);
+  if(url->host.len == 0) {
+    return -1;
   }
+  if(skip_next_char(&p, ':') == 0) {
+    return parse_port(data, make_slice(p.pos, p.len), &url->port);
+  }
+  return p.pos == p.len ? 0 : -1;
 }
 
-static bool is_host_end(char c) {
-  return c == ' ' || c == ':' || c == '/'; 
+/**
+ * Parses a path with an optional query into the URL
+ */
+static void parse_path(struct cursor * p, struct url * url) {
+  size_t start = p->pos;
+  skip_until_any(p, PATH_END_CHARS);
+  url->path = make_slice(start, p->pos);
+  if(skip_next_char(p, '?') == 0) {
+    url->query = make_slice(p->pos, p->len);
+    p->pos = p->len;
+  }
 }
 
-static bool is_port_end(char c) {
-  return c < '0' || c > '9';
+/**
+ * Parses a request target in origin form (/path?query), absolute form (http://host:port/path?query) or asterisk form
+ */
+static int parse_target(const char * data, struct slice target, struct url * url) {
+  struct cursor p;
+  init_cursor(&p, data, target);
+  if(p.pos < p.len && data[p.pos] == '/') {
+    parse_path(&p, url);
+    return 0;
+  }
+  if(is_slice_equal(data, target, "*")) {
+    url->path = target;
+    return 0;
+  }
+  if(target.len < strlen("http://") || strncasecmp(data + target.offset, "http://", strlen("http://"))) {
+    return -1;
+  }
+  p.pos += strlen("http://");
+  size_t start = p.pos;
+  skip_until_any(&p, AUTHORITY_END_CHARS);
+  if(parse_authority(data, make_slice(start, p.pos), url)) {
+    return -1;
+  }
+  parse_path(&p, url);
+  return 0;
 }
 
-void init_parser(struct parser * p) {
-  assert(p != NULL);
-  
-  clear_parser(p);
+/**
+ * Determines the method from its name
+ */
+static enum http_method get_method(const char * data, struct slice name) {
+  if(is_slice_equal(data, name, "GET")) {
+    return HTTP_METHOD_GET;
+  } else if(is_slice_equal(data, name, "HEAD")) {
+    return HTTP_METHOD_HEAD;
+  } else if(is_slice_equal(data, name, "POST")) {
+    return HTTP_METHOD_POST;
+  }
+  return HTTP_METHOD_OTHER;
 }
 
-void clear_parser(struct parser *  p) {
-  assert(p != NULL);
-
-  p->data = NULL;
-  p->len = 0;
+/**
+ * Marks the request as malformed
+ */
+static int fail(struct parser * p, int error) {
+  p->state = PARSER_STATE_ERROR;
+  p->error = error;
+  errno = error;
+  return -1;
 }
 
-void load_into_parser(struct parser * p, const char * data, size_t len) {
-  assert(p != NULL);
+/**
+ * Finds the end of the element being parsed, which must be the specified character
+ * Returns 1 if the end has not been received yet
+ */
+static int find_end(struct parser * p, const char * data, size_t len, const char * set, char end, size_t * at) {
+  const char * d = scan_for_any(data + p->pos, len - p->pos, set);
+  if(d == NULL) {
+    p->pos = len;
+    return 1;
+  }
+  *at = (size_t)(d - data);
+  if(*d != end) {
+    return fail(p, EINVAL);
+  }
+  p->pos = *at + 1;
+  return 0;
+}
 
-  assert(data != NULL);
-  p->data = data;
-  p->len = len;
+/**
+ * Makes a slice of the element being parsed, without surrounding white space
+ */
+static struct slice make_trimmed_slice(const char * data, size_t start, size_t end) {
+  while(start < end && (data[start] == ' ' || data[start] == '\t')) {
+    ++start;
+  }
+  while(end > start && (data[end - 1] == ' ' || data[end - 1] == '\t')) {
+    --end;
+  }
+  return make_slice(start, end);
 }
 
-int parse_request(struct parser * p, enum http_method * method, struct url_buffer * url) {
-  assert(p != NULL);
-  assert(method != NULL);
-  assert(url != NULL);
-  
-  if(skip_next_string(p, "GET")) {
-    return -1;
+/**
+ * Checks the version of the completely parsed request line and parses the target
+ */
+static int finish_request_line(struct parser * p, const char * data, struct request * r) {
+  struct slice v = r->version;
+  if(v.len != strlen("HTTP/1.1") || strncmp(data + v.offset, "HTTP/1.", strlen("HTTP/1."))) {
+    return fail(p, EINVAL);
   }
-  *method = HTTP_METHOD_GET;
-  
-  if(skip_next_char(p, ' ')) {
-    return -1;
+  char minor = data[v.offset + v.len - 1];
+  if(minor != '0' && minor != '1') {
+    return fail(p, EINVAL);
   }
-  if(skip_next_string(p, "http://")) {
-    return -1;
+  r->minor_version = minor - '0';
+  if(parse_target(data, r->target, &r->url)) {
+    return fail(p, EINVAL);
   }
-  size_t start = p->pos;
-  if(skip_until_pred(p, is_host_end)) {
-    return 0;
+  return 0;
+}
+
+/**
+ * Parses the length of the body
+ */
+static int parse_content_length(const char * data, struct slice s, size_t * len) {
+  if(s.len == 0) {
+    return -1;
   }
-  size_t size = p->pos - start;
-  if(url->host_cap <= size) {
-    char * nhost = (char *)realloc(url->host, size + 1);
-    if(nhost == NULL) {
+  size_t value = 0;
+  for(size_t i = s.offset; i < s.offset + s.len; ++i) {
+    if(data[i] < '0' || data[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (size_t)(data[i] - '0');
+    if(value > PARSER_MAX_BODY_LEN) {
+      errno = E2BIG;
       return -1;
     }
-    url->host = nhost;
-    url->host_cap = size + 1;
   }
-  memcpy(url->host, p->data + start, size);
-  url->host[size] = '\0';
+  *len = value;
+  return 0;
+}
 
-  char c = p->data[p->pos];
-  if(c == ':') {
+/**
+ * Interprets the headers of a completely parsed head
+ */
+static int finish_head(struct parser * p, const char * data, struct request * r) {
+  bool has_length = false;
+  for(size_t i = 0; i < r->header_count; ++i) {
+    const struct header * h = r->headers + i;
+    if(is_slice_equal_ignoring_case(data, h->name, "Content-Length")) {
+      size_t len;
+      errno = EINVAL;
+      if(parse_content_length(data, h->value, &len)) {
+	return fail(p, errno);
+      }
+      // repeated lengths must agree
+      if(has_length && len != r->content_length) {
+	return fail(p, EINVAL);
+      }
+      r->content_length = len;
+      has_length = true;
+    } else if(is_slice_equal_ignoring_case(data, h->name, "Transfer-Encoding")) {
+      return fail(p, ENOTSUP);
+    }
+  }
+  // the host of an absolute target takes precedence over the Host header
+  if(r->url.host.len == 0) {
+    const struct header * host = find_header(r, data, "Host");
+    if(host == NULL) {
+      // HTTP/1.1 requires the Host header
+      return r->minor_version == 0 ? 0 : fail(p, EINVAL);
+    }
+    if(host->value.len != 0 && parse_authority(data, host->value, &r->url)) {
+      return fail(p, EINVAL);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Parses the next element of the request
+ * Returns 1 if the element has not been received completely
+ */
+static int parse_element(struct parser * p, const char * data, size_t len, struct request * r) {
+  size_t at;
+  int result;
+  switch(p->state) {
+  case PARSER_STATE_METHOD:
+    if((result = find_end(p, data, len, " \r\n", ' ', &at))) {
+      return result;
+    }
+    if(at == p->mark) {
+      return fail(p, EINVAL);
+    }
+    r->method_name = make_slice(p->mark, at);
+    r->method = get_method(data, r->method_name);
+    p->state = PARSER_STATE_TARGET;
+    break;
+  case PARSER_STATE_TARGET:
+    if((result = find_end(p, data, len, " \r\n", ' ', &at))) {
+      return result;
+    }
+    if(at == p->mark) {
+      return fail(p, EINVAL);
+    }
+    r->target = make_slice(p->mark, at);
+    p->state = PARSER_STATE_VERSION;
+    break;
+  case PARSER_STATE_VERSION:
+    if((result = find_end(p, data, len, "\r\n", '\r', &at))) {
+      return result;
+    }
+    r->version = make_slice(p->mark, at);
+    p->state = PARSER_STATE_REQUEST_LINE_END;
+    break;
+  case PARSER_STATE_REQUEST_LINE_END:
+    if(data[p->pos] != '\n') {
+      return fail(p, EINVAL);
+    }
     ++p->pos;
-    // port is number between 0 and 65535
-    char buffer[6];
-    start = p->pos;
-    if(skip_until_pred(p, is_port_end)) {
+    if(finish_request_line(p, data, r)) {
       return -1;
     }
-    size = p->pos - start;
-    if(start > 5) {
-      return -1;
+    p->state = PARSER_STATE_HEADER_START;
+    break;
+  case PARSER_STATE_HEADER_START:
+    if(data[p->pos] == '\r') {
+      ++p->pos;
+      p->state = PARSER_STATE_HEAD_END;
+    } else if(r->header_count == REQUEST_MAX_HEADERS) {
+      return fail(p, E2BIG);
+    } else {
+      p->state = PARSER_STATE_HEADER_NAME;
     }
-    memcpy(buffer, p->data + start, size);
-    buffer[size] = '\0';
-    int port;
-    if(sscanf(buffer, "%d", &port) != 1) {
-      return -1;
+    break;
+  case PARSER_STATE_HEADER_NAME:
+    if((result = find_end(p, data, len, ":\r\n", ':', &at))) {
+      return result;
     }
-    if(port < 0 || port > 65535) {
-      return -1;
+    if(at == p->mark || scan_for_any(data + p->mark, at - p->mark, " \t") != NULL) {
+      return fail(p, EINVAL);
+    }
+    r->headers[r->header_count].name = make_slice(p->mark, at);
+    p->state = PARSER_STATE_HEADER_VALUE;
+    break;
+  case PARSER_STATE_HEADER_VALUE:
+    if((result = find_end(p, data, len, "\r\n", '\r', &at))) {
+      return result;
+    }
+    r->headers[r->header_count].value = make_trimmed_slice(data, p->mark, at);
+    p->state = PARSER_STATE_HEADER_LINE_END;
+    break;
+  case PARSER_STATE_HEADER_LINE_END:
+    if(data[p->pos] != '\n') {
+      return fail(p, EINVAL);
+    }
+    ++p->pos;
+    ++r->header_count;
+    p->state = PARSER_STATE_HEADER_START;
+    break;
+  case PARSER_STATE_HEAD_END:
+    if(data[p->pos] != '\n') {
+      return fail(p, EINVAL);
     }
-    url->port = (uint16_t)port;
-    return -1;
-  } else if(c == '/') {
     ++p->pos;
-    start = p->pos;
-    if(skip_until_char(p, ' ')) {
+    r->body_offset = p->pos;
+    if(finish_head(p, data, r)) {
       return -1;
     }
-    size = p->pos - start;
-    if(url->path_cap <= size) {
-      char * npath = (char *)realloc(url->path, size + 1);
-      if(npath == NULL) {
-	return -1;
-      }
-      url->path = npath;
-      url->path_cap = size + 1;
+    p->state = PARSER_STATE_BODY;
+    break;
+  case PARSER_STATE_BODY:
+    if(len - r->body_offset < r->content_length) {
+      p->pos = len;
+      return 1;
     }
-    memcpy(url->path, p->data + start, size);
-    url->path[size] = '\0';
-  } else {
-    assert(c == ' ');
-    ++p->pos;
+    p->pos = r->body_offset + r->content_length;
+    r->len = p->pos;
+    p->state = PARSER_STATE_COMPLETE;
+    break;
+  case PARSER_STATE_COMPLETE:
+  case PARSER_STATE_ERROR:
+    break;
   }
+  p->mark = p->pos;
+  return 0;
+}
 
-  if(skip_next_string(p, "HTTP/1.1\r\n")) {
-    return -1;
+void init_parser(struct parser * p) {
+  assert(p != NULL);
+  
+  reset_parser(p);
+}
+
+void reset_parser(struct parser * p) {
+  assert(p != NULL);
+
+  p->state = PARSER_STATE_METHOD;
+  p->pos = 0;
+  p->mark = 0;
+  p->error = 0;
+}
+
+int parse_request(struct parser * p, const char * data, size_t len, struct request * r) {
+  assert(p != NULL);
+  assert(r != NULL);
+
+  if(p->pos == 0 && p->state == PARSER_STATE_METHOD) {
+    init_request(r);
+  }
+  while(p->state != PARSER_STATE_COMPLETE) {
+    if(p->state == PARSER_STATE_ERROR) {
+      errno = p->error;
+      return -1;
+    }
+    size_t end = len;
+    if(p->state < PARSER_STATE_BODY) {
+      if(p->pos >= PARSER_MAX_HEAD_LEN) {
+	return fail(p, E2BIG);
+      }
+      // nothing past the maximum head length is looked at until the head is complete
+      if(end > PARSER_MAX_HEAD_LEN) {
+	end = PARSER_MAX_HEAD_LEN;
+      }
+      if(p->pos == end) {
+	return 1;
+      }
+    }
+    int result = parse_element(p, data, end, r);
+    // a head cut off at its maximum length fails on the next iteration
+    if(result < 0 || (result == 1 && end == len)) {
+      return result;
+    }
   }
   return 0;
 }
@@ -200,5 +483,5 @@ int parse_request(struct parser * p, enum http_method * method, struct url_buffe
 void dispose_parser(struct parser * p) {
   assert(p != NULL);
 
-  clear_parser(p);
+  reset_parser(p);
 }
@@ -1,29 +1,99 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-#include "protocol.h"
-#include "url.h"
+#include "request.h"
 
 #include <stdlib.h>
 
 /**
- * A parser
+ * Maximum length of the request line and headers, leaving room for cookies and authorization tokens of several KiB
  */
-struct parser {
+#define PARSER_MAX_HEAD_LEN 8192
+
+/**
+ * Maximum length of a request body
+ */
+#define PARSER_MAX_BODY_LEN 4096
+
+/**
+ * The states of the parser
+ */
+enum parser_state {
+  /**
+   * Parsing the method
+   */
+  PARSER_STATE_METHOD,
+  /**
+   * Parsing the request target
+   */
+  PARSER_STATE_TARGET,
+  /**
+   * Parsing the protocol version
+   */
+  PARSER_STATE_VERSION,
+  /**
+   * Expecting the line feed ending the request line
+   */
+  PARSER_STATE_REQUEST_LINE_END,
+  /**
+   * Expecting a header or the empty line ending the headers
+   */
+  PARSER_STATE_HEADER_START,
+  /**
+   * Parsing a header name
+   */
+  PARSER_STATE_HEADER_NAME,
+  /**
+   * Parsing a header value
+   */
+  PARSER_STATE_HEADER_VALUE,
   /**
-   * A pointer to the data
+   * Expecting the line feed ending a header line
    */
-  const char * data;
+  PARSER_STATE_HEADER_LINE_END,
+  /**
+   * Expecting the line feed ending the headers
+   */
+  PARSER_STATE_HEAD_END,
+  /**
+   * Waiting for the body
+   */
+  PARSER_STATE_BODY,
+  /**
+   * The request has been parsed
+   */
+  PARSER_STATE_COMPLETE,
+  /**
+   * The request is malformed
+   */
+  PARSER_STATE_ERROR
+};
 
+/**
+ * An incremental request parser
+ * Data may be fed in any number of chunks, parsing resumes where it stopped
+ * so every byte is looked at once however the request is fragmented
+ */
+struct parser {
   /**
-   * The length of the data
+   * The state
    */
-  size_t len;
+  enum parser_state state;
 
   /**
-   * The current position of the cursor
+   * The position of the next byte to parse, relative to the start of the request
    */
   size_t pos;
+
+  /**
+   * The start of the element being parsed, relative to the start of the request
+   */
+  size_t mark;
+
+  /**
+   * The error the request was rejected with
+   */
+  int error;
 };
 
 /**
@@ -32,19 +102,18 @@ struct parser {
 void init_parser(struct parser * p);
 
 /**
- * Resets the parser
- */
-void clear_parser(struct parser *  p);
-
-/**
- * Loads data into the parser
+ * Resets the parser to parse the next request
  */
-void load_into_parser(struct parser * p, const char * data, size_t len);
+void reset_parser(struct parser * p);
 
 /**
- * Parses a request
+ * Parses the data received so far for the request starting at data
+ * The request view is filled with slices relative to the start of the request
+ * Returns 0 if the request is complete, 1 if more data is needed and -1 if the request is malformed,
+ * setting errno to EINVAL if it is invalid, E2BIG if it is too large and ENOTSUP if it uses an unsupported feature
+ * Once the request is complete or malformed, the same result is returned until the parser is reset
  */
-int parse_request(struct parser * p, enum http_method * method, struct url_buffer * url);
+int parse_request(struct parser * p, const char * data, size_t len, struct request * r);
 
 /**
  * Disposes of a parser
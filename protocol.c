@@ -1,13 +1,24 @@
 #include "buffer.h"
+#include "metrics.h"
 #include "parser.h"
 #include "protocol.h"
+#include "slice.h"
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
 
 /**
- * Maximum request size
+ * Maximum number of bytes buffered at once, leaving room for pipelined requests
+ * Above the largest request, so a request over the parser limits is answered rather than cut off
  */
-#define PROTOCOL_MAX_REQUEST_LEN 1024
+#define PROTOCOL_MAX_RECEIVE_LEN (2 * (PARSER_MAX_HEAD_LEN + PARSER_MAX_BODY_LEN))
 
 /**
  * Bad request
@@ -15,39 +26,327 @@
 #define PROTOCOL_BAD_REQUEST 400
 
 /**
- * Line delimiter
+ * Buffer size for the status line and headers of a response
+ */
+#define PROTOCOL_RESPONSE_HEAD_LEN 128
+
+/**
+ * The room first tried for the metrics, enough unless there are many shards
+ */
+#define PROTOCOL_METRICS_LEN 16384
+
+/**
+ * The path the metrics are exposed at, or NULL if they are not
+ */
+static const char * metrics_path;
+
+/**
+ * The response to clients turned away because the server is overloaded, formatted once at startup
+ */
+static char overload_response[PROTOCOL_RESPONSE_HEAD_LEN];
+
+/**
+ * The length of the overload response
+ */
+static size_t overload_response_len;
+
+/**
+ * Returns the reason phrase for a status code
+ */
+static const char * get_reason_phrase(enum http_status_code status_code) {
+  switch(status_code) {
+  case HTTP_STATUS_CODE_OK:
+    return "OK";
+  case HTTP_STATUS_CODE_BAD_REQUEST:
+    return "Bad Request";
+  case HTTP_STATUS_CODE_PAYLOAD_TOO_LARGE:
+    return "Payload Too Large";
+  case HTTP_STATUS_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE:
+    return "Request Header Fields Too Large";
+  case HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR:
+    return "Internal Server Error";
+  case HTTP_STATUS_CODE_NOT_IMPLEMENTED:
+    return "Not Implemented";
+  case HTTP_STATUS_CODE_SERVICE_UNAVAILABLE:
+    return "Service Unavailable";
+  }
+  return "Unknown";
+}
+
+/**
+ * Returns the counter of the responses with a status code
+ */
+static enum metric_counter get_response_metric(enum http_status_code status_code) {
+  switch(status_code) {
+  case HTTP_STATUS_CODE_OK:
+    return METRIC_RESPONSES_OK;
+  case HTTP_STATUS_CODE_BAD_REQUEST:
+    return METRIC_RESPONSES_BAD_REQUEST;
+  case HTTP_STATUS_CODE_PAYLOAD_TOO_LARGE:
+    return METRIC_RESPONSES_PAYLOAD_TOO_LARGE;
+  case HTTP_STATUS_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE:
+    return METRIC_RESPONSES_REQUEST_HEADER_FIELDS_TOO_LARGE;
+  case HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR:
+    return METRIC_RESPONSES_INTERNAL_SERVER_ERROR;
+  case HTTP_STATUS_CODE_NOT_IMPLEMENTED:
+    return METRIC_RESPONSES_NOT_IMPLEMENTED;
+  case HTTP_STATUS_CODE_SERVICE_UNAVAILABLE:
+    return METRIC_RESPONSES_SERVICE_UNAVAILABLE;
+  }
+  return METRIC_RESPONSES_INTERNAL_SERVER_ERROR;
+}
+
+/**
+ * Returns the Connection header telling the client whether the connection is kept alive
+ * Persistent connections are the default for HTTP/1.1 only
+ */
+static const char * get_connection_header(const struct connection * c) {
+  if(!c->keep_alive) {
+    return "Connection: close\r\n";
+  }
+  return c->request.minor_version == 0 ? "Connection: keep-alive\r\n" : "";
+}
+
+/**
+ * Writes a response without a body to the output buffer
+ * The client is told when the connection will not be kept alive
+ */
+static int write_status_response(struct connection * c, enum http_status_code status_code) {
+  char head[PROTOCOL_RESPONSE_HEAD_LEN];
+  int len = snprintf(head, PROTOCOL_RESPONSE_HEAD_LEN,
+		     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n",
+		     (int)status_code,
+		     get_reason_phrase(status_code),
+		     get_connection_header(c));
+  if(len < 0 || len >= PROTOCOL_RESPONSE_HEAD_LEN) {
+    return -1;
+  }
+  c->status = (int)status_code;
+  add_to_metric(get_response_metric(status_code), 1);
+  return append_string(&c->output, head, (size_t)len);
+}
+
+/**
+ * Writes the metrics in the Prometheus text format to the output buffer
+ */
+static int write_metrics_response(struct connection * c) {
+  char * body = NULL;
+  size_t cap = PROTOCOL_METRICS_LEN;
+  size_t body_len;
+  while(true) {
+    char * grown = (char *)realloc(body, cap);
+    if(grown == NULL) {
+      free(body);
+      return write_status_response(c, HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR);
+    }
+    body = grown;
+    body_len = format_metrics(body, cap);
+    if(body_len < cap) {
+      break;
+    }
+    // values may have grown longer by the next try
+    cap = body_len + PROTOCOL_RESPONSE_HEAD_LEN;
+  }
+  char head[PROTOCOL_RESPONSE_HEAD_LEN];
+  int len = snprintf(head, PROTOCOL_RESPONSE_HEAD_LEN,
+		     "HTTP/1.1 %d %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n%s\r\n",
+		     (int)HTTP_STATUS_CODE_OK,
+		     get_reason_phrase(HTTP_STATUS_CODE_OK),
+		     body_len,
+		     get_connection_header(c));
+  int result = -1;
+  if(len >= 0 && len < PROTOCOL_RESPONSE_HEAD_LEN) {
+    c->status = (int)HTTP_STATUS_CODE_OK;
+    add_to_metric(METRIC_RESPONSES_OK, 1);
+    result = append_string(&c->output, head, (size_t)len) || append_string(&c->output, body, body_len) ? -1 : 0;
+  }
+  free(body);
+  return result;
+}
+
+/**
+ * Determines whether a request asks for the metrics, whatever its query string
  */
-#define PROTOCOL_LINE_DELIMITER "\r\n"
+static bool is_metrics_request(const struct connection * c, const char * data) {
+  if(metrics_path == NULL || c->request.method != HTTP_METHOD_GET) {
+    return false;
+  }
+  struct slice path = c->request.target;
+  const char * query = memchr(data + path.offset, '?', path.len);
+  if(query != NULL) {
+    path.len = query - (data + path.offset);
+  }
+  return is_slice_equal(data, path, metrics_path);
+}
 
 /**
  * Reject the request
+ * The connection is closed as the end of the request can not be trusted
  */
 static int reject(struct connection * c, enum http_status_code status_code) {
+  c->keep_alive = false;
+  write_status_response(c, status_code);
   return -1;
 }
 
-int handle_request(struct connection *c){
-  size_t remainder = PROTOCOL_MAX_REQUEST_LEN;
-  
-  if(read_until_string(&c->buffer, c->socket, PROTOCOL_LINE_DELIMITER, remainder)) {
-    switch(errno) {
-    case E2BIG:
-      return reject(c, HTTP_STATUS_CODE_BAD_REQUEST);
-    default:
-      return reject(c, HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR);
+/**
+ * Determines whether a comma separated header value contains the specified token, ignoring case
+ */
+static bool contains_token(const char * value, size_t len, const char * token) {
+  size_t token_len = strlen(token);
+  size_t start = 0;
+  while(start < len) {
+    size_t end = start;
+    while(end < len && value[end] != ',') {
+      ++end;
     }
+    size_t next = end + 1;
+    while(start < end && (value[start] == ' ' || value[start] == '\t')) {
+      ++start;
+    }
+    while(end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+      --end;
+    }
+    if(end - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+      return true;
+    }
+    start = next;
   }
-  struct parser parser;
-  init_parser(&parser);
+  return false;
+}
 
-  load_into_parser(&parser, c->buffer.data, c->buffer.len);
+/**
+ * Determines from the Connection headers whether the client wants the connection to be kept alive
+ */
+static bool wants_keep_alive(const struct connection * c, const char * data) {
+  const struct request * r = &c->request;
+  // HTTP/1.0 connections are only kept alive on request
+  const char * token = r->minor_version == 0 ? "keep-alive" : "close";
+  bool found = false;
+  for(size_t i = 0; i < r->header_count && !found; ++i) {
+    const struct header * h = r->headers + i;
+    found = is_slice_equal_ignoring_case(data, h->name, "Connection")
+      && contains_token(data + h->value.offset, h->value.len, token);
+  }
+  return r->minor_version == 0 ? found : !found;
+}
 
-  if(1) {
-    dispose_parser(&parser);
+/**
+ * Rejects a request the parser failed on
+ */
+static int reject_malformed(struct connection * c, int error) {
+  switch(error) {
+  case E2BIG:
+    // the body offset is only known once the head has been parsed
+    return reject(c, c->request.body_offset == 0 ? HTTP_STATUS_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE : HTTP_STATUS_CODE_PAYLOAD_TOO_LARGE);
+  case ENOTSUP:
+    return reject(c, HTTP_STATUS_CODE_NOT_IMPLEMENTED);
+  default:
     return reject(c, HTTP_STATUS_CODE_BAD_REQUEST);
   }
+}
+
+/**
+ * Parses the data received for the next request, which starts at the read ahead data
+ */
+static int parse_next_request(struct connection * c) {
+  return parse_request(&c->parser, c->buffer.data + c->buffer.len, c->buffer.ahead, &c->request);
+}
+
+/**
+ * Keeps a served request to be logged once its response is sent, if requests are timed
+ */
+static void keep_served_request(struct connection * c, size_t offset, size_t output_len, bool parsed, uint64_t start, uint64_t parse_end) {
+  if(start == 0 || c->served_len == CONNECTION_MAX_SERVED) {
+    return;
+  }
+  struct served_request * s = c->served + c->served_len++;
+  s->offset = offset;
+  if(parsed) {
+    s->method = c->request.method_name;
+    s->target = c->request.target;
+    s->version = c->request.version;
+  } else {
+    s->method = s->target = s->version = (struct slice){0, 0};
+  }
+  s->status = c->status;
+  s->len = c->output.len - output_len;
+  s->parse_time = parse_end - start;
+  s->handle_time = get_connection_time(c) - parse_end;
+}
+
+enum request_state get_request_state(struct connection * c) {
+  if(c->buffer.ahead != 0) {
+    mark_connection_received(c);
+  }
+  if(parse_next_request(c) == 1) {
+    return REQUEST_STATE_INCOMPLETE;
+  }
+  // malformed requests are complete as well, they are answered with an error
+  return REQUEST_STATE_COMPLETE;
+}
+
+enum request_state receive_request(struct connection * c) {
+  int result = receive_into_text_buffer(&c->buffer, c->socket, PROTOCOL_MAX_RECEIVE_LEN);
+  enum request_state state = get_request_state(c);
+  if(state == REQUEST_STATE_INCOMPLETE && result != 0) {
+    return REQUEST_STATE_CLOSED;
+  }
+  return state;
+}
 
-  dispose_parser(&parser);
+int handle_request(struct connection *c){
+  uint64_t start = get_connection_time(c);
+  // the request starts at the read ahead data and stays there until the responses are sent
+  size_t offset = c->buffer.len;
+  size_t output_len = c->output.len;
+  int result = parse_next_request(c);
+  uint64_t parse_end = get_connection_time(c);
+  if(result) {
+    // only complete requests are handled
+    add_to_metric(METRIC_PARSE_ERRORS, 1);
+    result = reject_malformed(c, result == 1 ? EINVAL : errno);
+    keep_served_request(c, offset, output_len, false, start, parse_end);
+    return result;
+  }
+  // the request stays in the buffer until it has been handled
+  const char * data = c->buffer.data + c->buffer.len;
+  if(!wants_keep_alive(c, data)) {
+    c->keep_alive = false;
+  }
+  if(c->request.method == HTTP_METHOD_OTHER) {
+    result = write_status_response(c, HTTP_STATUS_CODE_NOT_IMPLEMENTED);
+  } else if(is_metrics_request(c, data)) {
+    result = write_metrics_response(c);
+  } else {
+    result = write_status_response(c, HTTP_STATUS_CODE_OK);
+  }
+  // requests handled earlier in the same batch stay in the text, so nothing is moved
+  consume_read_ahead(&c->buffer, c->request.len);
+  reset_parser(&c->parser);
+  keep_served_request(c, offset, output_len, true, start, parse_end);
+  return result;
+}
 
+int init_overload_response(unsigned retry_after) {
+  int len = snprintf(overload_response, PROTOCOL_RESPONSE_HEAD_LEN,
+		     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nRetry-After: %u\r\nConnection: close\r\n\r\n",
+		     (int)HTTP_STATUS_CODE_SERVICE_UNAVAILABLE,
+		     get_reason_phrase(HTTP_STATUS_CODE_SERVICE_UNAVAILABLE),
+		     retry_after);
+  if(len < 0 || len >= PROTOCOL_RESPONSE_HEAD_LEN) {
+    return -1;
+  }
+  overload_response_len = (size_t)len;
   return 0;
 }
+
+void send_overload_response(int socket) {
+  // the response fits in the empty send buffer of a new socket, so it is sent without blocking or not at all
+  send(socket, overload_response, overload_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  add_to_metric(METRIC_RESPONSES_SERVICE_UNAVAILABLE, 1);
+}
+
+void init_metrics_endpoint(const char * path) {
+  metrics_path = path;
+}
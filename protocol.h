@@ -17,25 +17,84 @@ enum http_status_code {
    */
   HTTP_STATUS_CODE_BAD_REQUEST = 400,
 
+  /**
+   * Payload too large
+   */
+  HTTP_STATUS_CODE_PAYLOAD_TOO_LARGE = 413,
+
+  /**
+   * Request header fields too large
+   */
+  HTTP_STATUS_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+
   /**
    * Internal server error
    */
-  HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR = 500
+  HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR = 500,
+
+  /**
+   * Not implemented
+   */
+  HTTP_STATUS_CODE_NOT_IMPLEMENTED = 501,
+
+  /**
+   * Service unavailable
+   */
+  HTTP_STATUS_CODE_SERVICE_UNAVAILABLE = 503
 };
 
 /**
- * Supported HTTP methods
+ * The state of a request that is being received
  */
-enum http_method {
+enum request_state {
+  /**
+   * More data is needed
+   */
+  REQUEST_STATE_INCOMPLETE,
+  /**
+   * A complete request is buffered
+   */
+  REQUEST_STATE_COMPLETE,
   /**
-   * GET
+   * The connection was closed or the request can not be received
    */
-  HTTP_METHOD_GET
+  REQUEST_STATE_CLOSED
 };
 
 /**
- * Handles a request
+ * Parses the data received for the next request, resuming where parsing stopped,
+ * and determines whether the request is completely buffered
+ */
+enum request_state get_request_state(struct connection * c);
+
+/**
+ * Receives the data available on the (non blocking) connection socket
+ * and determines whether a complete request is buffered
+ */
+enum request_state receive_request(struct connection * c);
+
+/**
+ * Handles the next buffered request, the response is appended to the output buffer of the connection
+ * Pipelined requests are handled by calling this again while the next request is complete
+ * The keep alive flag of the connection is cleared if the connection has to be closed after the response
  */
 int handle_request(struct connection * c);
 
+/**
+ * Prepares the response sent to clients turned away because the server is overloaded,
+ * asking them to retry after the specified number of seconds
+ */
+int init_overload_response(unsigned retry_after);
+
+/**
+ * Sends the overload response on a newly accepted socket, without waiting for the request
+ * The socket is not closed
+ */
+void send_overload_response(int socket);
+
+/**
+ * Exposes the metrics to GET requests for a path, or to none if the path is NULL
+ */
+void init_metrics_endpoint(const char * path);
+
 #endif
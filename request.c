@@ -0,0 +1,31 @@
+#include "request.h"
+
+#include <assert.h>
+
+void init_request(struct request * r) {
+  assert(r != NULL);
+
+  r->method = HTTP_METHOD_OTHER;
+  r->method_name = make_empty_slice();
+  r->target = make_empty_slice();
+  r->version = make_empty_slice();
+  r->minor_version = 1;
+  init_url(&r->url);
+  r->header_count = 0;
+  r->body_offset = 0;
+  r->content_length = 0;
+  r->len = 0;
+}
+
+const struct header * find_header(const struct request * r, const char * data, const char * name) {
+  assert(r != NULL);
+  assert(data != NULL);
+  assert(name != NULL);
+
+  for(size_t i = 0; i < r->header_count; ++i) {
+    if(is_slice_equal_ignoring_case(data, r->headers[i].name, name)) {
+      return r->headers + i;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "slice.h"
+#include "url.h"
+
+#include <stdlib.h>
+
+/**
+ * The maximum number of headers in a request
+ */
+#define REQUEST_MAX_HEADERS 32
+
+/**
+ * Supported HTTP methods
+ */
+enum http_method {
+  /**
+   * GET
+   */
+  HTTP_METHOD_GET,
+
+  /**
+   * HEAD
+   */
+  HTTP_METHOD_HEAD,
+
+  /**
+   * POST
+   */
+  HTTP_METHOD_POST,
+
+  /**
+   * Any other method
+   */
+  HTTP_METHOD_OTHER
+};
+
+/**
+ * A request header
+ */
+struct header {
+  /**
+   * The name
+   */
+  struct slice name;
+
+  /**
+   * The value, without surrounding white space
+   */
+  struct slice value;
+};
+
+/**
+ * A view of a request in the buffer it was received in
+ * All parts are slices of that buffer relative to the start of the request, nothing is copied
+ */
+struct request {
+  /**
+   * The method
+   */
+  enum http_method method;
+
+  /**
+   * The method as sent
+   */
+  struct slice method_name;
+
+  /**
+   * The request target as sent
+   */
+  struct slice target;
+
+  /**
+   * The protocol version
+   */
+  struct slice version;
+
+  /**
+   * The minor version of HTTP/1
+   */
+  int minor_version;
+
+  /**
+   * The URL, from an absolute target or from an origin target and the Host header
+   */
+  struct url url;
+
+  /**
+   * The headers
+   */
+  struct header headers[REQUEST_MAX_HEADERS];
+
+  /**
+   * The number of headers
+   */
+  size_t header_count;
+
+  /**
+   * The offset of the first byte of the body
+   */
+  size_t body_offset;
+
+  /**
+   * The length of the body
+   */
+  size_t content_length;
+
+  /**
+   * The length of the complete request, including the body
+   */
+  size_t len;
+};
+
+/**
+ * Initializes a request
+ */
+void init_request(struct request * r);
+
+/**
+ * Returns the first header with the specified name, ignoring case, or NULL if there is none
+ */
+const struct header * find_header(const struct request * r, const char * data, const char * name);
+
+#endif
@@ -0,0 +1,143 @@
+#include "ring.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Copies data into a ring at a position, wrapping around the end
+ */
+static void copy_into_ring(struct ring * r, size_t pos, const void * data, size_t len) {
+  size_t start = pos & r->mask;
+  size_t first = r->mask + 1 - start;
+  if(first >= len) {
+    memcpy(r->data + start, data, len);
+  } else {
+    memcpy(r->data + start, data, first);
+    memcpy(r->data, (const char *)data + first, len - first);
+  }
+}
+
+/**
+ * Copies data out of a ring from a position, wrapping around the end
+ */
+static void copy_from_ring(const struct ring * r, size_t pos, void * data, size_t len) {
+  size_t start = pos & r->mask;
+  size_t first = r->mask + 1 - start;
+  if(first >= len) {
+    memcpy(data, r->data + start, len);
+  } else {
+    memcpy(data, r->data + start, first);
+    memcpy((char *)data + first, r->data, len - first);
+  }
+}
+
+/**
+ * Writes a record at the tail of a ring, there must be enough room
+ */
+static void write_ring_record(struct ring * r, size_t tail, const void * data, size_t len) {
+  uint32_t header = (uint32_t)len;
+  copy_into_ring(r, tail, &header, sizeof(uint32_t));
+  copy_into_ring(r, tail + sizeof(uint32_t), data, len);
+  // publishes the record
+  atomic_store_explicit(&r->tail, tail + sizeof(uint32_t) + len, memory_order_release);
+}
+
+int init_ring(struct ring * r, size_t capacity) {
+  assert(r != NULL);
+
+  size_t len = 1;
+  while(len < capacity) {
+    len *= 2;
+  }
+  // not logged, the logger itself is built on rings
+  r->data = (char *)malloc(len);
+  if(r->data == NULL) {
+    return -1;
+  }
+  r->mask = len - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return 0;
+}
+
+bool is_ring_empty(struct ring * r) {
+  assert(r != NULL);
+
+  return atomic_load_explicit(&r->head, memory_order_relaxed) == atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+size_t get_ring_len(struct ring * r) {
+  assert(r != NULL);
+
+  // the head is read first, so it is never past the tail
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  return atomic_load_explicit(&r->tail, memory_order_acquire) - head;
+}
+
+int push_ring_record(struct ring * r, const void * data, size_t len) {
+  assert(r != NULL);
+  assert(data != NULL);
+
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  // the consumer is done with the records before the head
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if(sizeof(uint32_t) + len > r->mask + 1 - (tail - head)) {
+    return -1;
+  }
+  write_ring_record(r, tail, data, len);
+  return 0;
+}
+
+int push_ring_record_overwriting(struct ring * r, const void * data, size_t len) {
+  assert(r != NULL);
+  assert(data != NULL);
+
+  if(sizeof(uint32_t) + len > r->mask + 1) {
+    return -1;
+  }
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  int dropped = 0;
+  while(sizeof(uint32_t) + len > r->mask + 1 - (tail - head)) {
+    // only the producer writes, so it can read the length of the oldest record while the consumer may take it
+    uint32_t oldest;
+    copy_from_ring(r, head, &oldest, sizeof(uint32_t));
+    if(atomic_compare_exchange_weak_explicit(&r->head, &head, head + sizeof(uint32_t) + oldest, memory_order_acq_rel, memory_order_acquire)) {
+      head += sizeof(uint32_t) + oldest;
+      ++dropped;
+    }
+  }
+  write_ring_record(r, tail, data, len);
+  return dropped;
+}
+
+int pop_ring_record(struct ring * r, void * buffer, size_t cap) {
+  assert(r != NULL);
+  assert(buffer != NULL);
+
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  while(true) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if(head == tail) {
+      return -1;
+    }
+    uint32_t len;
+    copy_from_ring(r, head, &len, sizeof(uint32_t));
+    if(len <= tail - head - sizeof(uint32_t)) {
+      copy_from_ring(r, head + sizeof(uint32_t), buffer, len < cap ? len : cap);
+    }
+    // like a sequence lock, the copy only counts if no producer overwrote the record meanwhile
+    if(atomic_compare_exchange_strong_explicit(&r->head, &head, head + sizeof(uint32_t) + len, memory_order_acq_rel, memory_order_relaxed)) {
+      return (int)len;
+    }
+  }
+}
+
+void dispose_ring(struct ring * r) {
+  assert(r != NULL);
+
+  free(r->data);
+}
@@ -0,0 +1,74 @@
+#ifndef RING_H
+#define RING_H
+
+#include "affinity.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A bounded lock free ring of variable length records for a single producer and a single consumer
+ * Every record is preceded by its length, records wrap around the end of the data
+ */
+struct ring {
+  /**
+   * The data
+   */
+  char * data;
+  /**
+   * The number of bytes minus one, the number of bytes being a power of two
+   */
+  size_t mask;
+  /**
+   * The position of the oldest record, advanced by the consumer and by a producer overwriting records
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+  /**
+   * The position the next record is written at, only advanced by the producer
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+};
+
+/**
+ * Initializes a ring, the capacity in bytes is rounded up to a power of two
+ */
+int init_ring(struct ring * r, size_t capacity);
+
+/**
+ * Returns whether a ring holds no records
+ */
+bool is_ring_empty(struct ring * r);
+
+/**
+ * Returns the number of bytes the records of a ring take up, their lengths included
+ */
+size_t get_ring_len(struct ring * r);
+
+/**
+ * Appends a record to a ring, fails if there is not enough room
+ * Must only be called by the producer
+ */
+int push_ring_record(struct ring * r, const void * data, size_t len);
+
+/**
+ * Appends a record to a ring, dropping the oldest records until there is enough room
+ * Returns the number of records dropped, or -1 if the record is larger than the ring
+ * Must only be called by the producer
+ */
+int push_ring_record_overwriting(struct ring * r, const void * data, size_t len);
+
+/**
+ * Removes the oldest record from a ring, copying at most cap bytes of it to the buffer
+ * Returns the length of the record, or -1 if the ring is empty
+ * Must only be called by the consumer
+ */
+int pop_ring_record(struct ring * r, void * buffer, size_t cap);
+
+/**
+ * Disposes of a ring
+ */
+void dispose_ring(struct ring * r);
+
+#endif
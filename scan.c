@@ -0,0 +1,278 @@
+#include "scan.h"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_HAVE_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define SCAN_HAVE_AVX2 1
+#endif
+#endif
+
+/**
+ * A scanner implementation
+ */
+struct scanner {
+  /**
+   * The name of the implementation
+   */
+  const char * name;
+  /**
+   * Finds a character
+   */
+  const char * (*scan_for_char)(const char *, size_t, char);
+  /**
+   * Finds any character of a set
+   */
+  const char * (*scan_for_any)(const char *, size_t, const char *, size_t);
+  /**
+   * Finds a string
+   */
+  const char * (*scan_for_string)(const char *, size_t, const char *, size_t);
+};
+
+/*
+ * Scalar implementation, also used for the tails of the vectorized ones
+ */
+
+static const char * scan_for_char_scalar(const char * data, size_t len, char c) {
+  for(size_t i = 0; i < len; ++i) {
+    if(data[i] == c) {
+      return data + i;
+    }
+  }
+  return NULL;
+}
+
+static const char * scan_for_any_scalar(const char * data, size_t len, const char * set, size_t set_len) {
+  for(size_t i = 0; i < len; ++i) {
+    for(size_t j = 0; j < set_len; ++j) {
+      if(data[i] == set[j]) {
+	return data + i;
+      }
+    }
+  }
+  return NULL;
+}
+
+static const char * scan_for_string_scalar(const char * data, size_t len, const char * delim, size_t delim_len) {
+  while(len >= delim_len) {
+    const char * c = scan_for_char_scalar(data, len - delim_len + 1, *delim);
+    if(c == NULL) {
+      return NULL;
+    }
+    if(memcmp(c + 1, delim + 1, delim_len - 1) == 0) {
+      return c;
+    }
+    len -= (size_t)(c - data) + 1;
+    data = c + 1;
+  }
+  return NULL;
+}
+
+#ifndef SCAN_HAVE_SSE2
+static const struct scanner scalar_scanner = {
+  "scalar",
+  scan_for_char_scalar,
+  scan_for_any_scalar,
+  scan_for_string_scalar
+};
+#endif
+
+#ifdef SCAN_HAVE_SSE2
+
+/*
+ * SSE2 implementation, 16 bytes per iteration
+ */
+
+static const char * scan_for_char_sse2(const char * data, size_t len, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  size_t i = 0;
+  for(; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if(mask != 0) {
+      return data + i + __builtin_ctz((unsigned)mask);
+    }
+  }
+  return scan_for_char_scalar(data + i, len - i, c);
+}
+
+static const char * scan_for_any_sse2(const char * data, size_t len, const char * set, size_t set_len) {
+  __m128i needles[SCAN_MAX_SET_LEN];
+  for(size_t j = 0; j < set_len; ++j) {
+    needles[j] = _mm_set1_epi8(set[j]);
+  }
+  size_t i = 0;
+  for(; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i eq = _mm_cmpeq_epi8(block, needles[0]);
+    for(size_t j = 1; j < set_len; ++j) {
+      eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, needles[j]));
+    }
+    int mask = _mm_movemask_epi8(eq);
+    if(mask != 0) {
+      return data + i + __builtin_ctz((unsigned)mask);
+    }
+  }
+  return scan_for_any_scalar(data + i, len - i, set, set_len);
+}
+
+/**
+ * Compares the first and the last character of the delimiter at every offset of a block,
+ * only candidates matching both are compared in full
+ */
+static const char * scan_for_string_sse2(const char * data, size_t len, const char * delim, size_t delim_len) {
+  const __m128i first = _mm_set1_epi8(delim[0]);
+  const __m128i last = _mm_set1_epi8(delim[delim_len - 1]);
+  size_t i = 0;
+  for(; i + delim_len - 1 + 16 <= len; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + delim_len - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+    while(mask != 0) {
+      size_t offset = i + (size_t)__builtin_ctz(mask);
+      if(delim_len <= 2 || memcmp(data + offset + 1, delim + 1, delim_len - 2) == 0) {
+	return data + offset;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return scan_for_string_scalar(data + i, len - i, delim, delim_len);
+}
+
+static const struct scanner sse2_scanner = {
+  "sse2",
+  scan_for_char_sse2,
+  scan_for_any_sse2,
+  scan_for_string_sse2
+};
+
+#endif
+
+#ifdef SCAN_HAVE_AVX2
+
+/*
+ * AVX2 implementation, 32 bytes per iteration, only selected if the CPU supports it
+ */
+
+__attribute__((target("avx2")))
+static const char * scan_for_char_avx2(const char * data, size_t len, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+  for(; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    if(mask != 0) {
+      return data + i + __builtin_ctz(mask);
+    }
+  }
+  return scan_for_char_sse2(data + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_for_any_avx2(const char * data, size_t len, const char * set, size_t set_len) {
+  __m256i needles[SCAN_MAX_SET_LEN];
+  for(size_t j = 0; j < set_len; ++j) {
+    needles[j] = _mm256_set1_epi8(set[j]);
+  }
+  size_t i = 0;
+  for(; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i eq = _mm256_cmpeq_epi8(block, needles[0]);
+    for(size_t j = 1; j < set_len; ++j) {
+      eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, needles[j]));
+    }
+    unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+    if(mask != 0) {
+      return data + i + __builtin_ctz(mask);
+    }
+  }
+  return scan_for_any_sse2(data + i, len - i, set, set_len);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_for_string_avx2(const char * data, size_t len, const char * delim, size_t delim_len) {
+  const __m256i first = _mm256_set1_epi8(delim[0]);
+  const __m256i last = _mm256_set1_epi8(delim[delim_len - 1]);
+  size_t i = 0;
+  for(; i + delim_len - 1 + 32 <= len; i += 32) {
+    __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + delim_len - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+    while(mask != 0) {
+      size_t offset = i + (size_t)__builtin_ctz(mask);
+      if(delim_len <= 2 || memcmp(data + offset + 1, delim + 1, delim_len - 2) == 0) {
+	return data + offset;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return scan_for_string_sse2(data + i, len - i, delim, delim_len);
+}
+
+static const struct scanner avx2_scanner = {
+  "avx2",
+  scan_for_char_avx2,
+  scan_for_any_avx2,
+  scan_for_string_avx2
+};
+
+#endif
+
+/**
+ * The baseline scanner, SSE2 is always available where the target supports it
+ */
+#ifdef SCAN_HAVE_SSE2
+#define SCAN_BASELINE_SCANNER sse2_scanner
+#else
+#define SCAN_BASELINE_SCANNER scalar_scanner
+#endif
+
+/**
+ * The selected scanner
+ */
+static const struct scanner * scanner = &SCAN_BASELINE_SCANNER;
+
+void init_scanner() {
+#ifdef SCAN_HAVE_AVX2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    scanner = &avx2_scanner;
+    return;
+  }
+#endif
+  scanner = &SCAN_BASELINE_SCANNER;
+}
+
+const char * get_scanner_name() {
+  return scanner->name;
+}
+
+const char * scan_for_char(const char * data, size_t len, char c) {
+  assert(data != NULL || len == 0);
+
+  return (*scanner->scan_for_char)(data, len, c);
+}
+
+const char * scan_for_any(const char * data, size_t len, const char * set) {
+  assert(data != NULL || len == 0);
+  assert(set != NULL);
+
+  size_t set_len = strlen(set);
+  assert(set_len > 0 && set_len <= SCAN_MAX_SET_LEN);
+  return (*scanner->scan_for_any)(data, len, set, set_len);
+}
+
+const char * scan_for_string(const char * data, size_t len, const char * delim, size_t delim_len) {
+  assert(data != NULL || len == 0);
+  assert(delim != NULL);
+  assert(delim_len > 0);
+
+  if(delim_len == 1) {
+    return (*scanner->scan_for_char)(data, len, *delim);
+  }
+  return (*scanner->scan_for_string)(data, len, delim, delim_len);
+}
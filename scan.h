@@ -0,0 +1,37 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdlib.h>
+
+/**
+ * The maximum number of characters in a set passed to scan_for_any
+ */
+#define SCAN_MAX_SET_LEN 4
+
+/**
+ * Selects the fastest scanner implementation supported by the CPU
+ */
+void init_scanner();
+
+/**
+ * Returns the name of the selected scanner implementation
+ */
+const char * get_scanner_name();
+
+/**
+ * Returns a pointer to the first occurrence of the character in the data, or NULL if there is none
+ */
+const char * scan_for_char(const char * data, size_t len, char c);
+
+/**
+ * Returns a pointer to the first occurrence of any character of the (null terminated) set
+ * in the data, or NULL if there is none
+ */
+const char * scan_for_any(const char * data, size_t len, const char * set);
+
+/**
+ * Returns a pointer to the first occurrence of the delimiter in the data, or NULL if there is none
+ */
+const char * scan_for_string(const char * data, size_t len, const char * delim, size_t delim_len);
+
+#endif
@@ -1,14 +1,27 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "access_log.h"
+#include "admission.h"
+#include "affinity.h"
 #include "connection.h"
+#include "event_loop.h"
 #include "logger.h"
+#include "metrics.h"
 #include "protocol.h"
 #include "server.h"
 #include "task.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
@@ -16,19 +29,94 @@
 #include <unistd.h>
 
 /**
- * The listener socket
+ * A shard of the server: a listener with its own event loop, connection table and worker threads
+ */
+struct server_shard {
+  /**
+   * The listener socket
+   */
+  int listen_socket;
+  /**
+   * The connections accepted by this shard
+   */
+  struct connection_table connections;
+  /**
+   * The task service running the requests of this shard
+   */
+  struct task_service task_service;
+  /**
+   * Decides which new connections the shard admits
+   */
+  struct admission_control admission;
+  /**
+   * The event loop
+   */
+  struct event_loop loop;
+  /**
+   * The workers the connections of the batch being dispatched are for, only used by the event loop
+   */
+  size_t dispatch_keys[EVENT_LOOP_MAX_PENDING];
+  /**
+   * The thread running the event loop
+   */
+  pthread_t thread;
+  /**
+   * The CPU the shard is pinned to, or -1 if it is not pinned
+   */
+  int cpu;
+  /**
+   * The NUMA node of the CPU, or -1 if the shard is not pinned
+   */
+  int node;
+  /**
+   * The CPUs the worker threads run on, empty if they are not pinned
+   */
+  struct cpu_mask worker_cpus;
+  /**
+   * The result of running the event loop
+   */
+  int result;
+};
+
+/**
+ * The access log, with a ring for the event loop of each shard
+ */
+static struct access_log access_log;
+
+/**
+ * Whether requests are logged to the access log
+ */
+static bool access_logged;
+
+/**
+ * Whether the metrics are exposed, the time spent serving connections is only measured then
  */
-static int listen_socket = -1;
+static bool metrics_exposed;
 
 /**
- * The task service
+ * The shards
  */
-static struct task_service task_service;
+static struct server_shard * shards;
+
+/**
+ * The number of shards
+ */
+static size_t shard_count;
+
+/**
+ * The maximum number of requests served on a connection
+ */
+static size_t max_requests;
+
+/**
+ * The number of nanoseconds a request may wait for a worker thread, 0 for no limit
+ */
+static uint64_t request_timeout;
 
 /**
  * Binds a socket to the specified port
  */
-static int bind_socket(int fd, int16_t port) {
+static int bind_socket(int fd, uint16_t port) {
   // buffer is too large to suppress warning for sprintf
   char port_buffer[16];
 
@@ -70,10 +158,81 @@ static int bind_socket(int fd, int16_t port) {
 }
 
 /**
- * Serves a client request
+ * Stops the event loops of all shards
+ */
+static void handle_stop_signal(int signal_number) {
+  (void)signal_number;
+  for(size_t i = 0; i < shard_count; ++i) {
+    stop_event_loop(&shards[i].loop);
+  }
+}
+
+/**
+ * Installs the handlers for the signals that stop the server
+ */
+static int install_signal_handlers() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(struct sigaction));
+  action.sa_handler = handle_stop_signal;
+  sigemptyset(&action.sa_mask);
+  if(sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL)) {
+    LOG_ERRNO("could not install signal handlers");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Restores the default handling of the signals that stop the server, before the shards are torn down
+ * A second signal then ends the process rather than reaching event loops that are being disposed of
+ */
+static void restore_signal_handlers() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(struct sigaction));
+  action.sa_handler = SIG_DFL;
+  sigemptyset(&action.sa_mask);
+  if(sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL)) {
+    LOG_ERRNO("could not restore signal handlers");
+  }
+}
+
+/**
+ * Selects the event loop implementation
+ */
+static const struct event_loop_type * get_event_loop_type(enum server_io io) {
+  switch(io) {
+  case SERVER_IO_EPOLL:
+    return &epoll_event_loop;
+  case SERVER_IO_URING:
+#ifdef HAVE_IO_URING
+    return &uring_event_loop;
+#else
+    LOG_ERROR("io_uring support was not enabled at configure time");
+    return NULL;
+#endif
+  }
+  return NULL;
+}
+
+/**
+ * Serves all complete requests buffered for a client, the responses are sent together
  */
 static void serve_client(struct connection * c) {
-  handle_request(c);
+  do {
+    // the connection is closed after its last allowed request
+    c->keep_alive = ++c->requests < max_requests;
+    handle_request(c);
+    // requests left once the served ones can no longer be kept are dispatched again after the responses are sent
+  } while(c->keep_alive && c->served_len < CONNECTION_MAX_SERVED && get_request_state(c) == REQUEST_STATE_COMPLETE);
+}
+
+/**
+ * Returns the current time in nanoseconds on the monotonic clock
+ */
+static uint64_t get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
 }
 
 /**
@@ -83,99 +242,475 @@ static void run_client_task(void * data) {
   assert(data != NULL);
 
   struct connection * c = (struct connection *)data;
+  c->times.started = get_connection_time(c);
+  uint64_t start = metrics_exposed ? get_time() : 0;
   serve_client(c);
+  if(metrics_exposed) {
+    record_metric(METRIC_SERVE_TIME, get_time() - start);
+  }
+  c->times.released = get_connection_time(c);
 }
 
+/**
+ * Hands the connection back to its event loop
+ * A request dropped before it was served leaves no response and keep alive unset, so the connection is closed
+ */
 static void cleanup_client_task(void * data) {
   assert(data != NULL);
 
   struct connection * c = (struct connection *)data;
-  close_connection(c);
+  release_connection(c);
 }
 
-int start_server(int16_t port, size_t max_connections) {
-  LOG_INFO("starting server...");
-  if(init_task_service(&task_service,max_connections)) {
+/**
+ * Dispatches a batch of connections with a complete request to the task service of their shard
+ */
+static size_t dispatch_connections(void * context, struct connection ** connections, size_t count) {
+  assert(count <= EVENT_LOOP_MAX_PENDING);
+
+  struct server_shard * shard = (struct server_shard *)context;
+  struct task * tasks[EVENT_LOOP_MAX_PENDING];
+  // the clock is read once for the batch
+  uint64_t now = count == 0 ? 0 : get_connection_time(connections[0]);
+  for(size_t i = 0; i < count; ++i) {
+    struct connection * c = connections[i];
+    c->times.dispatched = now;
+    init_task(&c->task, run_client_task, c, cleanup_client_task);
+    set_task_deadline(&c->task, TASK_PRIORITY_NORMAL, request_timeout);
+    tasks[i] = &c->task;
+    // the next requests of a connection go to the worker that has its buffers in cache
+    shard->dispatch_keys[i] = (size_t)(c - shard->connections.connections);
+  }
+  // only the stealing scheduler hands tasks to a particular worker
+  bool keyed = shard->task_service.scheduler == TASK_SCHEDULER_STEALING;
+  size_t dispatched = submit_tasks(&shard->task_service, tasks, keyed ? shard->dispatch_keys : NULL, count);
+  if(dispatched < count) {
+    LOG_ERROR("could not add %zu client task(s)", count - dispatched);
+  }
+  return dispatched;
+}
+
+/**
+ * Decides whether the event loop of a shard opens a new connection
+ */
+static bool admit_client(void * context, size_t in_flight) {
+  struct server_shard * shard = (struct server_shard *)context;
+  return check_admission(&shard->admission, in_flight);
+}
+
+/**
+ * Returns the time between two phases, 0 if either was not measured
+ */
+static uint64_t get_duration(uint64_t start, uint64_t end) {
+  return start == 0 || end < start ? 0 : end - start;
+}
+
+/**
+ * Records the requests served on a connection of a shard in the access log, once their responses have been sent
+ */
+static void log_served_requests(void * context, struct connection * c) {
+  struct server_shard * shard = (struct server_shard *)context;
+  size_t ring = (size_t)(shard - shards);
+  struct access_record r;
+  strcpy(r.client, get_connection_peer(c));
+  // all requests served together share the read, queue and write phases
+  r.read_time = get_duration(c->times.received, c->times.dispatched);
+  r.queue_time = get_duration(c->times.dispatched, c->times.started);
+  r.write_time = get_duration(c->times.released, c->times.sent);
+  for(size_t i = 0; i < c->served_len; ++i) {
+    const struct served_request * s = c->served + i;
+    const char * data = c->buffer.data + s->offset;
+    r.status = s->status;
+    r.bytes = s->len;
+    r.parse_time = s->parse_time;
+    r.handle_time = s->handle_time;
+    r.method_len = (uint16_t)(s->method.len < ACCESS_LOG_MAX_TOKEN_LEN ? s->method.len : ACCESS_LOG_MAX_TOKEN_LEN);
+    r.target_len = (uint16_t)(s->target.len < ACCESS_LOG_MAX_TARGET_LEN ? s->target.len : ACCESS_LOG_MAX_TARGET_LEN);
+    r.version_len = (uint16_t)(s->version.len < ACCESS_LOG_MAX_TOKEN_LEN ? s->version.len : ACCESS_LOG_MAX_TOKEN_LEN);
+    log_access(&access_log, ring, &r, data + s->method.offset, data + s->target.offset, data + s->version.offset);
+  }
+}
+
+/**
+ * Reads the number of requests of a shard waiting for a worker thread
+ */
+static uint64_t read_task_queue_length(void * context) {
+  struct server_shard * shard = (struct server_shard *)context;
+  return get_task_queue_length(&shard->task_service);
+}
+
+/**
+ * Reads the number of connections of a shard in use
+ */
+static uint64_t read_active_connections(void * context) {
+  struct server_shard * shard = (struct server_shard *)context;
+  return get_active_connection_count(&shard->connections);
+}
+
+/**
+ * Reads the number of bytes of log messages waiting to be written
+ */
+static uint64_t read_log_queue_len(void * context) {
+  (void)context;
+  return get_log_queue_len();
+}
+
+/**
+ * Reads the number of log messages dropped from full rings
+ */
+static uint64_t read_dropped_log_count(void * context) {
+  (void)context;
+  return get_dropped_log_count();
+}
+
+/**
+ * Registers the values of a shard exposed with the metrics, labeled with its index
+ */
+static void register_shard_metrics(struct server_shard * shard) {
+  char labels[METRICS_LABELS_LEN];
+  snprintf(labels, METRICS_LABELS_LEN, "shard=\"%zu\"", (size_t)(shard - shards));
+  register_metric_reader(METRIC_TYPE_GAUGE, "http_task_queue_length", "Requests waiting for a worker thread",
+			 labels, read_task_queue_length, shard);
+  register_metric_reader(METRIC_TYPE_GAUGE, "http_connections_active", "Connection slots in use",
+			 labels, read_active_connections, shard);
+}
+
+/**
+ * Creates a listener socket bound to the specified port
+ * Listeners of different shards share the port through SO_REUSEPORT
+ */
+static int create_listen_socket(uint16_t port, bool reuse_port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    LOG_ERRNO("could not create listen socket");
     return -1;
   }
-  if(init_connections(max_connections)) {
-    dispose_task_service(&task_service);
+  int reuse = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int))) {
+    LOG_ERRNO("could not set SO_REUSEADDR on listen socket");
+  }
+  if(reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int))) {
+    LOG_ERRNO("could not set SO_REUSEPORT on listen socket");
+    close(fd);
     return -1;
   }
-  
-  listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if(listen_socket == -1) {
-    LOG_ERRNO("could not create listen socket");
-    dispose_task_service(&task_service);
-    dispose_connections();
+  if(bind_socket(fd, port)) {
+    close(fd);
     return -1;
   }
+  if(listen(fd, SOMAXCONN)) {
+    LOG_ERRNO("could not listen on listen socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-  if(bind_socket(listen_socket, port)) {
-    close(listen_socket);
-    dispose_task_service(&task_service);
-    dispose_connections();
-    listen_socket = -1;
+/**
+ * Divides a total amount between the shards, giving every shard at least one
+ */
+static size_t get_shard_amount(size_t total) {
+  size_t amount = (total + shard_count - 1) / shard_count;
+  return amount == 0 ? 1 : amount;
+}
+
+/**
+ * Places a shard on a CPU and chooses the CPUs of its workers
+ * cpus holds the CPUs for the shards and loop_cpus those running event loops
+ */
+static void place_shard(struct server_shard * shard, const struct server_config * config, const struct cpu_mask * cpus, const struct cpu_mask * loop_cpus, int cpu) {
+  assert(shard != NULL);
+
+  shard->cpu = cpu;
+  shard->node = cpu == -1 ? -1 : get_cpu_node(cpu);
+  clear_cpu_mask(&shard->worker_cpus);
+  if(cpu == -1) {
+    return;
+  }
+  switch(config->worker_affinity) {
+  case SERVER_WORKER_AFFINITY_CPU:
+    add_to_cpu_mask(&shard->worker_cpus, cpu);
+    break;
+  case SERVER_WORKER_AFFINITY_NODE:
+    if(get_node_cpus(shard->node, &shard->worker_cpus)) {
+      add_to_cpu_mask(&shard->worker_cpus, cpu);
+      break;
+    }
+    struct cpu_mask free_cpus = shard->worker_cpus;
+    for(int i = 0; i < CPU_MASK_SIZE; ++i) {
+      if(!is_in_cpu_mask(cpus, i)) {
+	remove_from_cpu_mask(&shard->worker_cpus, i);
+	remove_from_cpu_mask(&free_cpus, i);
+      } else if(is_in_cpu_mask(loop_cpus, i)) {
+	remove_from_cpu_mask(&free_cpus, i);
+      }
+    }
+    // the event loops keep their CPUs to themselves unless that leaves the workers none
+    if(get_cpu_mask_count(&free_cpus) != 0) {
+      shard->worker_cpus = free_cpus;
+    } else if(get_cpu_mask_count(&shard->worker_cpus) == 0) {
+      add_to_cpu_mask(&shard->worker_cpus, cpu);
+    }
+    break;
+  case SERVER_WORKER_AFFINITY_NONE:
+    break;
+  }
+  char list[64];
+  format_cpu_list(&shard->worker_cpus, list, sizeof(list));
+  LOG_INFO("shard on CPU %d of NUMA node %d, workers on CPU(s) %s", cpu, shard->node,
+	   get_cpu_mask_count(&shard->worker_cpus) == 0 ? "any" : list);
+}
+
+/**
+ * Starts a shard
+ */
+static int start_shard(struct server_shard * shard, const struct server_config * config, const struct event_loop_type * type) {
+  assert(shard != NULL);
+
+  // a connection has at most one task waiting, so the queue never overflows
+  size_t max_connections = get_shard_amount(config->max_connections);
+  size_t max_workers = get_shard_amount(config->max_workers);
+  size_t min_workers = get_shard_amount(config->min_workers);
+  if(init_task_service(&shard->task_service, min_workers < max_workers ? min_workers : max_workers, max_workers, max_connections, config->scheduler)) {
+    return -1;
+  }
+  shard->task_service.cpus = shard->worker_cpus;
+  init_admission_control(&shard->admission, &shard->task_service,
+			 config->soft_limit == 0 ? 0 : get_shard_amount(config->soft_limit),
+			 config->hard_limit == 0 ? 0 : get_shard_amount(config->hard_limit));
+  // the connections are used by the event loop and workers of the node
+  if(init_connection_table(&shard->connections, max_connections, shard->node)) {
+    dispose_task_service(&shard->task_service);
+    return -1;
+  }
+  shard->connections.timed = access_logged;
+  shard->listen_socket = create_listen_socket(config->port, shard_count > 1);
+  if(shard->listen_socket == -1) {
+    dispose_connection_table(&shard->connections);
+    dispose_task_service(&shard->task_service);
+    return -1;
+  }
+  unsigned timeouts[CONNECTION_TIMER_COUNT];
+  timeouts[CONNECTION_TIMER_IDLE] = config->idle_timeout * 1000;
+  timeouts[CONNECTION_TIMER_HEADER] = config->header_timeout * 1000;
+  timeouts[CONNECTION_TIMER_BODY] = config->body_timeout * 1000;
+  timeouts[CONNECTION_TIMER_WRITE] = config->write_timeout * 1000;
+  if(init_event_loop(&shard->loop, type, shard->listen_socket, &shard->connections, dispatch_connections, admit_client,
+		     access_logged ? log_served_requests : NULL, shard, timeouts)) {
+    close(shard->listen_socket);
+    dispose_connection_table(&shard->connections);
+    dispose_task_service(&shard->task_service);
+    return -1;
+  }
+  if(start_task_service(&shard->task_service)) {
+    dispose_event_loop(&shard->loop);
+    close(shard->listen_socket);
+    dispose_connection_table(&shard->connections);
+    dispose_task_service(&shard->task_service);
     return -1;
   }
+  if(metrics_exposed) {
+    register_shard_metrics(shard);
+  }
+  return 0;
+}
 
-  if(listen(listen_socket, max_connections)) {
-    LOG_ERRNO("could not listen on listen socket");
-    close(listen_socket);
-    dispose_connections();
-    dispose_task_service(&task_service);
-    listen_socket = -1;
+/**
+ * Stops a shard
+ */
+static void stop_shard(struct server_shard * shard) {
+  assert(shard != NULL);
+
+  stop_task_service(&shard->task_service);
+  uint64_t expired = get_expired_task_count(&shard->task_service);
+  if(expired != 0) {
+    LOG_WARNING("dropped %llu request(s) that waited longer than the request timeout", (unsigned long long)expired);
+  }
+  if(shard->loop.shed != 0) {
+    LOG_WARNING("shed %zu connection(s) with a 503 response", shard->loop.shed);
+  }
+  dispose_task_service(&shard->task_service);
+  dispose_event_loop(&shard->loop);
+  close(shard->listen_socket);
+  dispose_connection_table(&shard->connections);
+}
+
+/**
+ * Runs the event loop of a shard
+ * A shard that fails stops the others, its listener would otherwise keep taking connections nobody accepts
+ */
+static void * run_shard(void * arg) {
+  struct server_shard * shard = (struct server_shard *)arg;
+  shard->result = run_event_loop(&shard->loop);
+  if(shard->result) {
+    LOG_ERROR("event loop of shard %zu failed, stopping the server", (size_t)(shard - shards));
+    handle_stop_signal(SIGTERM);
+  }
+  return NULL;
+}
+
+void init_server_config(struct server_config * config) {
+  assert(config != NULL);
+
+  config->port = 8090;
+  config->max_connections = 1024;
+  config->min_workers = 2;
+  config->max_workers = 10;
+  config->io = SERVER_IO_EPOLL;
+  config->scheduler = TASK_SCHEDULER_SHARED;
+  config->shards = 1;
+  clear_cpu_mask(&config->cpus);
+  config->logger_cpu = -1;
+  init_logger_config(&config->logger);
+  config->worker_affinity = SERVER_WORKER_AFFINITY_CPU;
+  config->max_requests = 100;
+  config->idle_timeout = 5;
+  config->header_timeout = 10;
+  config->body_timeout = 30;
+  config->write_timeout = 30;
+  config->request_timeout = 0;
+  config->soft_limit = 0;
+  config->hard_limit = 0;
+  config->retry_after = 1;
+  config->access_log = NULL;
+  config->access_log_format = ACCESS_LOG_FORMAT_COMMON;
+  config->metrics_path = NULL;
+}
+
+int start_server(const struct server_config * config) {
+  assert(config != NULL);
+
+  LOG_INFO("starting server...");
+  const struct event_loop_type * type = get_event_loop_type(config->io);
+  if(type == NULL) {
+    return -1;
+  }
+  max_requests = config->max_requests;
+  request_timeout = (uint64_t)config->request_timeout * 1000000;
+  if(init_overload_response(config->retry_after)) {
+    LOG_ERROR("could not format the overload response");
+    return -1;
+  }
+  metrics_exposed = config->metrics_path != NULL;
+  init_metrics_endpoint(config->metrics_path);
+  if(metrics_exposed) {
+    register_metric_reader(METRIC_TYPE_GAUGE, "log_queue_bytes", "Bytes of log messages waiting to be written",
+			   NULL, read_log_queue_len, NULL);
+    register_metric_reader(METRIC_TYPE_COUNTER, "log_dropped_messages_total", "Log messages dropped from full rings",
+			   NULL, read_dropped_log_count, NULL);
+  }
+  report_topology();
+  struct cpu_mask cpus;
+  if(get_allowed_cpus(&cpus)) {
+    return -1;
+  }
+  bool pinned = get_cpu_mask_count(&config->cpus) != 0;
+  for(int cpu = 0; pinned && cpu < CPU_MASK_SIZE; ++cpu) {
+    if(!is_in_cpu_mask(&config->cpus, cpu)) {
+      remove_from_cpu_mask(&cpus, cpu);
+    } else if(!is_in_cpu_mask(&cpus, cpu)) {
+      LOG_WARNING("CPU %d is not available, leaving it out", cpu);
+    }
+  }
+  if(config->logger_cpu != -1) {
+    remove_from_cpu_mask(&cpus, config->logger_cpu);
+  }
+  if(get_cpu_mask_count(&cpus) == 0) {
+    LOG_ERROR("no CPUs left to run the shards on");
+    return -1;
+  }
+  shard_count = config->shards == 0 ? get_cpu_mask_count(&cpus) : config->shards;
+  // a single shard is left to the scheduler unless CPUs are specified
+  pinned = pinned || shard_count > 1;
+  struct cpu_mask loop_cpus;
+  clear_cpu_mask(&loop_cpus);
+  for(size_t i = 0; pinned && i < shard_count; ++i) {
+    add_to_cpu_mask(&loop_cpus, get_cpu_in_mask(&cpus, i));
+  }
+  access_logged = config->access_log != NULL;
+  if(access_logged && init_access_log(&access_log, config->access_log, config->access_log_format, shard_count)) {
+    return -1;
+  }
+  // the task queues and connection tables are aligned to cache lines
+  shards = (struct server_shard *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct server_shard) * shard_count);
+  if(shards == NULL) {
+    LOG_ERRNO("could not allocate server shards");
+    if(access_logged) {
+      dispose_access_log(&access_log);
+    }
+    return -1;
+  }
+  for(size_t i = 0; i < shard_count; ++i) {
+    place_shard(shards + i, config, &cpus, &loop_cpus, pinned ? get_cpu_in_mask(&cpus, i) : -1);
+    if(start_shard(shards + i, config, type)) {
+      while(i-- > 0) {
+	stop_shard(shards + i);
+      }
+      free(shards);
+      shards = NULL;
+      shard_count = 0;
+      if(access_logged) {
+	dispose_access_log(&access_log);
+      }
+      return -1;
+    }
+  }
+  if(install_signal_handlers()) {
+    stop_server();
     return -1;
   }
   
-  LOG_INFO("server started");
+  LOG_INFO("server started using %s with %zu shard(s) and %s workers", type->name, shard_count,
+	   config->scheduler == TASK_SCHEDULER_STEALING ? "work stealing" : "shared queue");
   return 0;
 }
 
 int run_server() {
   LOG_DEBUG("accepting connections");
 
-  struct sockaddr client_address;
-  socklen_t client_address_len;
-  while(true) {
-    int result = accept(listen_socket, &client_address, &client_address_len);
-    if(result < 0) {
-      switch(errno) {
-      case EFAULT:
-      case EINVAL:
-      case EMFILE:
-      case ENFILE:
-      case ENOBUFS:
-      case ENOMEM:
-      case ENOTSOCK:
-      case EOPNOTSUPP:
-      case EPERM:
-	LOG_ERRNO("error while listening to socket");
-	return -1;
-      default:
-	break;
-      }
-    } else {
-      struct connection * c = open_connection(result);
-      if(c == NULL) {
-	// connection refused
-	close(result);
-      } else {
-	if(add_task(&task_service, run_client_task, c, cleanup_client_task)) {
-	  LOG_ERROR("could not add client task");
-	  close(result);
-	  return -1;
-	}
-      }
+  // the first shard runs on the calling thread
+  size_t started;
+  for(started = 1; started < shard_count; ++started) {
+    struct server_shard * shard = shards + started;
+    int result;
+    if((result = pthread_create(&shard->thread, NULL, run_shard, shard))) {
+      LOG_ERROR_CODE("could not create shard thread", result);
+      handle_stop_signal(SIGTERM);
+      break;
+    }
+    if(shard->cpu != -1) {
+      pin_thread_to_cpu(shard->thread, shard->cpu);
     }
-    
   }
+  if(shards[0].cpu != -1) {
+    pin_thread_to_cpu(pthread_self(), shards[0].cpu);
+  }
+  run_shard(shards);
+  // a shard that could not be started is a failure even though the others stopped cleanly
+  int result = started < shard_count ? -1 : shards[0].result;
+  for(size_t i = 1; i < started; ++i) {
+    pthread_join(shards[i].thread, NULL);
+    if(shards[i].result) {
+      result = -1;
+    }
+  }
+  return result;
 }
 
 void stop_server() {
   LOG_INFO("stopping server...");
-  close(listen_socket);
-  dispose_task_service(&task_service);
-  dispose_connections();
+  restore_signal_handlers();
+  // a handler still running on another thread finds no shards to stop
+  size_t count = shard_count;
+  shard_count = 0;
+  for(size_t i = 0; i < count; ++i) {
+    stop_shard(shards + i);
+  }
+  free(shards);
+  shards = NULL;
+  if(access_logged) {
+    // the records of the last requests are written first
+    dispose_access_log(&access_log);
+  }
   LOG_INFO("server stopped");
 }
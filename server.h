@@ -1,12 +1,164 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "access_log.h"
+#include "affinity.h"
+#include "logger.h"
+#include "task.h"
+
 #include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The I/O mechanisms the server can use
+ */
+enum server_io {
+  /**
+   * Non blocking sockets multiplexed by epoll
+   */
+  SERVER_IO_EPOLL,
+  /**
+   * Operations submitted to an io_uring instance
+   */
+  SERVER_IO_URING
+};
+
+/**
+ * The CPUs worker threads may run on
+ */
+enum server_worker_affinity {
+  /**
+   * The CPU of their shard's event loop
+   */
+  SERVER_WORKER_AFFINITY_CPU,
+  /**
+   * The CPUs of the NUMA node of their shard, apart from those running event loops if possible
+   */
+  SERVER_WORKER_AFFINITY_NODE,
+  /**
+   * Any CPU
+   */
+  SERVER_WORKER_AFFINITY_NONE
+};
+
+/**
+ * The server configuration
+ */
+struct server_config {
+  /**
+   * The port to listen at
+   */
+  uint16_t port;
+  /**
+   * The maximum number of open connections
+   */
+  size_t max_connections;
+  /**
+   * The number of worker threads kept running when idle, at most max_workers
+   */
+  size_t min_workers;
+  /**
+   * The number of worker threads the server may grow to under load
+   */
+  size_t max_workers;
+  /**
+   * The I/O mechanism
+   */
+  enum server_io io;
+  /**
+   * How requests are handed to the worker threads
+   */
+  enum task_scheduler scheduler;
+  /**
+   * The number of shards, each with its own SO_REUSEPORT listener, event loop,
+   * connection table and worker threads pinned to a CPU, 0 for one shard per CPU
+   * The connections and workers are divided between the shards
+   */
+  size_t shards;
+  /**
+   * The CPUs the shards run on, empty for all CPUs the process is allowed to run on
+   * Shards are pinned if there are several of them or if CPUs are specified
+   */
+  struct cpu_mask cpus;
+  /**
+   * The CPU dedicated to the logger, left out of the shard CPUs, or -1
+   */
+  int logger_cpu;
+  /**
+   * The logger configuration
+   */
+  struct logger_config logger;
+  /**
+   * The CPUs worker threads of a pinned shard run on
+   */
+  enum server_worker_affinity worker_affinity;
+  /**
+   * The maximum number of requests served on a kept alive connection
+   */
+  size_t max_requests;
+  /**
+   * The number of seconds a kept alive connection may wait for the next request, 0 for no limit
+   */
+  unsigned idle_timeout;
+  /**
+   * The number of seconds a client may take to send the request line and headers, 0 for no limit
+   */
+  unsigned header_timeout;
+  /**
+   * The number of seconds a client may take to send the body, 0 for no limit
+   */
+  unsigned body_timeout;
+  /**
+   * The number of seconds a client may take to receive the response, 0 for no limit
+   */
+  unsigned write_timeout;
+  /**
+   * The number of milliseconds a complete request may wait for a worker thread before it is dropped
+   * and its connection closed, 0 for no limit
+   */
+  unsigned request_timeout;
+  /**
+   * The number of requests in flight from which new connections are shed while requests keep waiting
+   * for a worker thread longer than they should, 0 for no limit
+   */
+  size_t soft_limit;
+  /**
+   * The number of requests in flight from which all new connections are shed, 0 for no limit
+   */
+  size_t hard_limit;
+  /**
+   * The number of seconds clients of shed connections are asked to wait before they retry
+   */
+  unsigned retry_after;
+  /**
+   * The path of the access log, - for the standard output, or NULL for none
+   */
+  const char * access_log;
+  /**
+   * The format of the access log
+   */
+  enum access_log_format access_log_format;
+  /**
+   * The path GET requests fetch the metrics at in the Prometheus text format, or NULL if they are not exposed
+   */
+  const char * metrics_path;
+};
+
+/**
+ * Initializes a server configuration with the default values
+ */
+void init_server_config(struct server_config * config);
 
 /**
  * Starts the server
  */
-int start_server(int16_t port, size_t max_connections);
+int start_server(const struct server_config * config);
+
+/**
+ * Runs the event loops until the server is stopped by SIGINT or SIGTERM
+ * Returns -1 if a shard could not be started or its event loop failed
+ */
+int run_server();
 
 /**
  * Stops the server
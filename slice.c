@@ -0,0 +1,26 @@
+#include "slice.h"
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+struct slice make_empty_slice() {
+  struct slice s;
+  s.offset = 0;
+  s.len = 0;
+  return s;
+}
+
+bool is_slice_equal(const char * data, struct slice s, const char * str) {
+  assert(data != NULL);
+  assert(str != NULL);
+
+  return strlen(str) == s.len && memcmp(data + s.offset, str, s.len) == 0;
+}
+
+bool is_slice_equal_ignoring_case(const char * data, struct slice s, const char * str) {
+  assert(data != NULL);
+  assert(str != NULL);
+
+  return strlen(str) == s.len && strncasecmp(data + s.offset, str, s.len) == 0;
+}
@@ -0,0 +1,37 @@
+#ifndef SLICE_H
+#define SLICE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * A range of bytes in a buffer, referred to by offset so it survives the buffer being moved
+ */
+struct slice {
+  /**
+   * The offset of the first byte
+   */
+  size_t offset;
+
+  /**
+   * The number of bytes
+   */
+  size_t len;
+};
+
+/**
+ * Returns an empty slice
+ */
+struct slice make_empty_slice();
+
+/**
+ * Determines whether the bytes of a slice equal the specified string
+ */
+bool is_slice_equal(const char * data, struct slice s, const char * str);
+
+/**
+ * Determines whether the bytes of a slice equal the specified string, ignoring case
+ */
+bool is_slice_equal_ignoring_case(const char * data, struct slice s, const char * str);
+
+#endif
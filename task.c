@@ -1,7 +1,15 @@
 #include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "affinity.h"
 #include "logger.h"
+#include "metrics.h"
 #include "task.h"
 
 #define TASK_ERROR_BUF_LEN 128
@@ -18,58 +26,133 @@ static struct task * create_task() {
   task->data = NULL;
   task->executor = NULL;
   task->destructor = NULL;
+  task->timeout = 0;
+  task->priority = TASK_PRIORITY_NORMAL;
+  task->pooled = true;
   return task;
 }
 
 /**
- * Destroys a task
+ * Destroys a task, only freeing it if it belongs to the pool
  */
 static void destroy_task(struct task * task) {
   assert(task != NULL);
   if(task->data != NULL && task->destructor != NULL) {
     (*task->destructor)(task->data);
   }
-  free(task);
+  if(task->pooled) {
+    free(task);
+  }
 }
 
 /**
- * Initializes a task queue
+ * Initializes a task queue, the capacity is rounded up to a power of two
  */
-static void init_task_queue(struct task_queue * q){
+static int init_task_queue(struct task_queue * q, size_t capacity){
   assert(q != NULL);
-  q->head = NULL;
-  q->tail = NULL;
+  size_t len = 1;
+  while(len < capacity) {
+    len *= 2;
+  }
+  q->slots = (struct task_slot *)malloc(sizeof(struct task_slot) * len);
+  if(q->slots == NULL) {
+    LOG_ERRNO("could not allocate task queue");
+    return -1;
+  }
+  for(size_t i = 0; i < len; ++i) {
+    atomic_init(&q->slots[i].sequence, i);
+    q->slots[i].task = NULL;
+  }
+  q->mask = len - 1;
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->head, 0);
+  return 0;
 }
 
 /**
- * Pushes a task onto a queue
+ * Pushes as many of the tasks as fit onto a queue, claiming their slots at once
+ * Returns the number of tasks pushed, from the start
  */
-static void push_onto_task_queue(struct task_queue * q, struct task * t) {
+static size_t push_many_onto_task_queue(struct task_queue * q, struct task ** tasks, size_t count) {
   assert(q != NULL);
-  assert(t != NULL);
-  if(q->tail == NULL) {
-    q->head = t;
-    q->tail = t;
-  } else {
-    q->tail->next = t;
-    q->tail = t;
+  assert(tasks != NULL);
+  if(count == 0) {
+    return 0;
   }
-  t->next = NULL;
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t len;
+  while(true) {
+    // a slot is free for this lap if its sequence equals its position
+    for(len = 0; len < count; ++len) {
+      size_t sequence = atomic_load_explicit(&q->slots[(pos + len) & q->mask].sequence, memory_order_acquire);
+      if(sequence != pos + len) {
+	break;
+      }
+    }
+    if(len != 0) {
+      if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + len, memory_order_relaxed, memory_order_relaxed)) {
+	break;
+      }
+    } else if((ptrdiff_t)(atomic_load_explicit(&q->slots[pos & q->mask].sequence, memory_order_acquire) - pos) < 0) {
+      // the slot still holds the task pushed one lap ago
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  for(size_t i = 0; i < len; ++i) {
+    struct task_slot * slot = q->slots + ((pos + i) & q->mask);
+    slot->task = tasks[i];
+    atomic_store_explicit(&slot->sequence, pos + i + 1, memory_order_release);
+  }
+  return len;
+}
+
+/**
+ * Pushes a task onto a queue, fails if the queue is full
+ */
+static int push_onto_task_queue(struct task_queue * q, struct task * t) {
+  assert(t != NULL);
+  return push_many_onto_task_queue(q, &t, 1) == 1 ? 0 : -1;
 }
 
 /**
- * Pops a task from a queue
+ * Pops a task from a queue, returns NULL if the queue is empty
  */
 static struct task * pop_from_task_queue(struct task_queue * q) {
   assert(q != NULL);
-  struct task * t = q->head;
-  if(t != NULL){
-    q->head = t->next;
-    if(q->head == NULL) {
-      q->tail = NULL;
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  struct task_slot * slot;
+  while(true) {
+    slot = q->slots + (pos & q->mask);
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if(sequence == pos + 1) {
+      // the slot holds a task, claim it
+      if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+	break;
+      }
+    } else if((ptrdiff_t)(sequence - (pos + 1)) < 0) {
+      // the slot has not been written yet
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
     }
   }
- return t;
+  struct task * t = slot->task;
+  // the slot can be written again one lap later
+  atomic_store_explicit(&slot->sequence, pos + q->mask + 1, memory_order_release);
+  return t;
+}
+
+/**
+ * Returns the number of tasks in a queue, read while other threads add and take tasks
+ */
+static size_t get_task_queue_size(struct task_queue * q) {
+  assert(q != NULL);
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  ptrdiff_t len = (ptrdiff_t)(atomic_load_explicit(&q->tail, memory_order_relaxed) - head);
+  // the positions are read one after the other, the head may have moved past the tail read
+  return len > 0 ? (size_t)len : 0;
 }
 
 /**
@@ -77,31 +160,193 @@ static struct task * pop_from_task_queue(struct task_queue * q) {
  */
 static void dispose_task_queue(struct task_queue * q) {
   assert(q != NULL);
-  struct task * t = q->head;
-  while(t != NULL) {
-    struct task * n = t->next;
+  struct task * t;
+  while((t = pop_from_task_queue(q)) != NULL) {
     destroy_task(t);
-    t = n;
   }
+  free(q->slots);
 }
 
+/**
+ * Initializes a task queue for every priority
+ */
+static int init_task_queues(struct task_queue * queues, size_t capacity) {
+  assert(queues != NULL);
+  for(size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+    if(init_task_queue(queues + i, capacity)) {
+      while(i-- > 0) {
+	dispose_task_queue(queues + i);
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
 
 /**
- * Get or creates a task that is ready to be used
+ * Disposes of the task queues of all priorities
  */
-static struct task * get_ready_task(struct task_service * t) {
+static void dispose_task_queues(struct task_queue * queues) {
+  assert(queues != NULL);
+  for(size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+    dispose_task_queue(queues + i);
+  }
+}
+
+/**
+ * Initializes a task deque, the capacity is rounded up to a power of two
+ */
+static int init_task_deque(struct task_deque * d, size_t capacity) {
+  assert(d != NULL);
+  size_t len = 1;
+  while(len < capacity) {
+    len *= 2;
+  }
+  d->tasks = (_Atomic(struct task *) *)malloc(sizeof(_Atomic(struct task *)) * len);
+  if(d->tasks == NULL) {
+    LOG_ERRNO("could not allocate task deque");
+    return -1;
+  }
+  for(size_t i = 0; i < len; ++i) {
+    atomic_init(d->tasks + i, NULL);
+  }
+  d->mask = len - 1;
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  return 0;
+}
+
+/**
+ * Returns whether a task deque is empty, only exact when called by the owner
+ */
+static bool is_task_deque_empty(struct task_deque * d) {
+  assert(d != NULL);
+  size_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  size_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+  return (ptrdiff_t)(bottom - top) <= 0;
+}
+
+/**
+ * Pushes a task at the bottom of a deque, fails if the deque is full
+ * Must only be called by the owner
+ */
+static int push_onto_task_deque(struct task_deque * d, struct task * t) {
+  assert(d != NULL);
   assert(t != NULL);
-  int result;
-  if((result = pthread_mutex_lock(&t->ready_mutex))){
-    LOG_ERROR_CODE("could not lock ready mutex", result);
+  size_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  size_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+  if(bottom - top > d->mask) {
+    return -1;
+  }
+  atomic_store_explicit(d->tasks + (bottom & d->mask), t, memory_order_relaxed);
+  // publishes the task before the new bottom
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+  return 0;
+}
+
+/**
+ * Takes the task at the bottom of a deque, returns NULL if the deque is empty
+ * Must only be called by the owner
+ */
+static struct task * take_from_task_deque(struct task_deque * d) {
+  assert(d != NULL);
+  size_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, bottom, memory_order_relaxed);
+  // orders the reservation of the bottom task before reading the top, as thieves do in reverse
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+  if((ptrdiff_t)(bottom - top) < 0) {
+    atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
     return NULL;
   }
-  struct task * task = pop_from_task_queue(&t->ready);
-  if((result = pthread_mutex_unlock(&t->ready_mutex))) {
-    LOG_ERROR_CODE("could not unlock ready mutex", result);
-    destroy_task(task);
+  struct task * t = atomic_load_explicit(d->tasks + (bottom & d->mask), memory_order_relaxed);
+  if(bottom == top) {
+    // the last task, race the thieves for it
+    if(!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      t = NULL;
+    }
+    atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return t;
+}
+
+/**
+ * Steals the task at the top of a deque, returns NULL if the deque is empty or another thread took the task first
+ */
+static struct task * steal_from_task_deque(struct task_deque * d) {
+  assert(d != NULL);
+  size_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if((ptrdiff_t)(bottom - top) <= 0) {
     return NULL;
   }
+  struct task * t = atomic_load_explicit(d->tasks + (top & d->mask), memory_order_relaxed);
+  if(!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return t;
+}
+
+/**
+ * Disposes of a task deque
+ */
+static void dispose_task_deque(struct task_deque * d) {
+  assert(d != NULL);
+  struct task * t;
+  while((t = take_from_task_deque(d)) != NULL) {
+    destroy_task(t);
+  }
+  free(d->tasks);
+}
+
+/**
+ * The worker running on the calling thread, if it is a worker thread
+ */
+static _Thread_local struct task_worker * current_worker;
+
+/**
+ * Initializes a worker, allocating its queues if the scheduler needs them
+ */
+static int init_task_worker(struct task_worker * w, struct task_service * t, size_t index, size_t queue_capacity) {
+  assert(w != NULL);
+  assert(t != NULL);
+  w->service = t;
+  w->index = index;
+  w->deque_priority = TASK_PRIORITY_NORMAL;
+  atomic_init(&w->state, TASK_WORKER_STOPPED);
+  init_eventcount(&w->event);
+  if(t->scheduler != TASK_SCHEDULER_STEALING) {
+    return 0;
+  }
+  if(init_task_queues(w->inbox, queue_capacity)) {
+    return -1;
+  }
+  if(init_task_deque(&w->deque, queue_capacity)) {
+    dispose_task_queues(w->inbox);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Disposes of a worker
+ */
+static void dispose_task_worker(struct task_worker * w) {
+  assert(w != NULL);
+  if(w->service->scheduler == TASK_SCHEDULER_STEALING) {
+    dispose_task_deque(&w->deque);
+    dispose_task_queues(w->inbox);
+  }
+}
+
+/**
+ * Get or creates a task that is ready to be used
+ */
+static struct task * get_ready_task(struct task_service * t) {
+  assert(t != NULL);
+  struct task * task = pop_from_task_queue(&t->ready);
   if(task == NULL) {
     task = create_task();
   }
@@ -114,15 +359,14 @@ static struct task * get_ready_task(struct task_service * t) {
 static void recycle_task(struct task_service * t, struct task * task) {
   assert(t != NULL);
   assert(task != NULL);
-  int result;
-  if((result = pthread_mutex_lock(&t->ready_mutex))) {
-    LOG_ERROR_CODE("could not unlock ready mutex", result);
+  // the task has run, its data must not be destroyed again
+  task->data = NULL;
+  task->executor = NULL;
+  task->destructor = NULL;
+  task->timeout = 0;
+  task->priority = TASK_PRIORITY_NORMAL;
+  if(push_onto_task_queue(&t->ready, task)) {
     destroy_task(task);
-    return;
-  }
-  push_onto_task_queue(&t->ready, task);
-  if((result = pthread_mutex_unlock(&t->ready_mutex))) {
-    LOG_ERROR_CODE("could not unlock ready mutex", result);
   }
 } 
 
@@ -139,98 +383,433 @@ static void run_task(struct task_service * t, struct task * task) {
 }
 
 /**
- * Runs the task server worker threads
+ * Drops a task that waited longer than its timeout, only running its destructor
  */
-static void * run_task_worker(void * arg) {
-  int result;
-  struct task_service * t = (struct task_service *)arg;
-  if((result = pthread_mutex_lock(&t->waiting_mutex))) {
-    LOG_ERROR_CODE("could not lock waiting mutex", result);
-      return NULL;
+static void expire_task(struct task_service * t, struct task * task) {
+  assert(t != NULL);
+  assert(task != NULL);
+  atomic_fetch_add_explicit(&t->expired, 1, memory_order_relaxed);
+  if(task->destructor != NULL) {
+    (*task->destructor)(task->data);
   }
+}
+
+/**
+ * Records the time a task waited if it is the shortest since the minimum was last taken
+ */
+static void record_task_wait(struct task_service * t, uint64_t wait) {
+  assert(t != NULL);
+  uint64_t min = atomic_load_explicit(&t->min_wait, memory_order_relaxed);
+  while(wait < min) {
+    if(atomic_compare_exchange_weak_explicit(&t->min_wait, &min, wait, memory_order_relaxed, memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+/**
+ * Returns the current time in nanoseconds on the monotonic clock
+ */
+static uint64_t get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Pops the task of the highest priority from a set of queues, returns NULL if they are all empty
+ */
+static struct task * pop_from_task_queues(struct task_queue * queues) {
+  assert(queues != NULL);
+  struct task * task = NULL;
+  for(size_t i = 0; i < TASK_PRIORITY_COUNT && task == NULL; ++i) {
+    task = pop_from_task_queue(queues + i);
+  }
+  return task;
+}
+
+/**
+ * Finds a task for a worker, taking the tasks of a higher priority first
+ * With the stealing scheduler, the worker takes its newest task first,
+ * other workers steal the oldest tasks and those not yet moved to the deque
+ */
+static struct task * find_task(struct task_worker * w) {
+  assert(w != NULL);
+  struct task_service * t = w->service;
+  if(t->scheduler == TASK_SCHEDULER_SHARED) {
+    return pop_from_task_queues(t->waiting);
+  }
+  struct task * task;
+  // tasks of a higher priority than those in the deque overtake them
+  for(size_t i = 0; i < (size_t)w->deque_priority; ++i) {
+    if((task = pop_from_task_queue(w->inbox + i)) != NULL) {
+      return task;
+    }
+  }
+  for(size_t i = 0; i < TASK_PRIORITY_COUNT && is_task_deque_empty(&w->deque); ++i) {
+    // moves the inbox of the highest priority with tasks over in batches,
+    // so newer tasks only overtake older ones within a batch
+    // the deque is as large as the inbox and only shrinks meanwhile, so a batch always fits
+    for(size_t j = 0; j <= w->deque.mask && (task = pop_from_task_queue(w->inbox + i)) != NULL; ++j) {
+      push_onto_task_deque(&w->deque, task);
+      w->deque_priority = (enum task_priority)i;
+    }
+  }
+  if((task = take_from_task_deque(&w->deque)) != NULL) {
+    return task;
+  }
+  // workers that are not running may still have tasks in their inboxes
+  for(size_t i = 1; i < t->cap; ++i) {
+    struct task_worker * victim = t->workers + (w->index + i) % t->cap;
+    if((task = steal_from_task_deque(&victim->deque)) != NULL) {
+      return task;
+    }
+    if((task = pop_from_task_queues(victim->inbox)) != NULL) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Wakes up at most count waiting workers of the stealing scheduler so they steal tasks,
+ * trying the workers from the specified index on
+ * Returns how many of them could not be woken up because the other workers are busy
+ */
+static size_t wake_up_thieves(struct task_service * t, size_t index, size_t count) {
+  assert(t != NULL);
+  for(size_t i = 0; i < t->cap && count > 0; ++i) {
+    if(notify_eventcount(&t->workers[(index + i) % t->cap].event, 1)) {
+      --count;
+    }
+  }
+  return count;
+}
+
+/**
+ * Lets a worker thread exit if there are more than the minimum number of threads
+ */
+static bool retire_task_worker(struct task_worker * w) {
+  assert(w != NULL);
+  struct task_service * t = w->service;
+  size_t len = atomic_load(&t->len);
+  do {
+    if(len <= t->min) {
+      return false;
+    }
+  } while(!atomic_compare_exchange_weak(&t->len, &len, len - 1));
+  return true;
+}
+
+/**
+ * Takes the next task of a worker, sleeping while there is none
+ * Returns NULL once the service stops or when the thread exits after waiting for the idle timeout
+ */
+static struct task * take_task(struct task_worker * w) {
+  assert(w != NULL);
+  struct task_service * t = w->service;
+  struct eventcount * e = t->scheduler == TASK_SCHEDULER_STEALING ? &w->event : &t->waiting_event;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += t->idle_timeout;
+  const struct timespec * timeout = &deadline;
   while(true) {
-    if(t->running) {
-      if((result = pthread_mutex_unlock(&t->waiting_mutex))) {
-	LOG_ERROR_CODE("could not unlock waiting mutex", result);
-      }
+    struct task * task = find_task(w);
+    if(task != NULL) {
+      return task;
+    }
+    uint32_t key = prepare_eventcount_wait(e);
+    // a task added or a stop requested after preparing wakes this thread up
+    if(!atomic_load(&t->running)) {
+      cancel_eventcount_wait(e);
       return NULL;
     }
-    struct task * task = pop_from_task_queue(&t->waiting);
-    if(task == NULL) {
-      if((result = pthread_cond_wait(&t->waiting_cond, &t->waiting_mutex))) {
-	LOG_ERROR_CODE("could not wait on waiting condition variable", result);
-	pthread_mutex_unlock(&t->waiting_mutex);
+    task = find_task(w);
+    if(task != NULL) {
+      cancel_eventcount_wait(e);
+      return task;
+    }
+    // a worker with nothing to do means the pool is large enough
+    if(atomic_load_explicit(&t->saturated_since, memory_order_relaxed) != 0) {
+      atomic_store_explicit(&t->saturated_since, 0, memory_order_relaxed);
+    }
+    if(!wait_eventcount(e, key, timeout)) {
+      if(retire_task_worker(w)) {
 	return NULL;
       }
+      // the minimum number of threads wait without a deadline
+      timeout = NULL;
+    }
+  }
+}
+
+static void * run_task_worker(void * arg);
+
+/**
+ * Starts a thread for a worker that is not running, the pool mutex must be locked
+ */
+static int start_task_worker(struct task_service * t) {
+  assert(t != NULL);
+  struct task_worker * w = NULL;
+  for(size_t i = 0; i < t->cap && w == NULL; ++i) {
+    if(atomic_load(&t->workers[i].state) != TASK_WORKER_RUNNING) {
+      w = t->workers + i;
+    }
+  }
+  if(w == NULL) {
+    return -1;
+  }
+  if(atomic_load(&w->state) == TASK_WORKER_EXITED) {
+    pthread_join(w->thread, NULL);
+  }
+  atomic_store(&w->state, TASK_WORKER_RUNNING);
+  int result = pthread_create(&w->thread, NULL, run_task_worker, w);
+  if(result != 0) {
+    LOG_ERROR_CODE("could not create worker thread", result);
+    atomic_store(&w->state, TASK_WORKER_STOPPED);
+    return -1;
+  }
+  atomic_fetch_add(&t->len, 1);
+  if(get_cpu_mask_count(&t->cpus) != 0) {
+    pin_thread_to_cpus(w->thread, &t->cpus);
+  }
+  return 0;
+}
+
+/**
+ * Starts another worker thread unless the maximum is reached
+ * Gives up if another thread is starting or joining threads meanwhile
+ */
+static void grow_task_service(struct task_service * t) {
+  assert(t != NULL);
+  if(atomic_load(&t->len) >= t->cap || pthread_mutex_trylock(&t->pool_mutex)) {
+    return;
+  }
+  if(atomic_load(&t->running) && atomic_load(&t->len) < t->cap && start_task_worker(t) == 0) {
+    LOG_DEBUG("started worker thread %zu of %zu", atomic_load(&t->len), t->cap);
+  }
+  pthread_mutex_unlock(&t->pool_mutex);
+}
+
+/**
+ * Records that tasks were added while no worker was idle to take them
+ * Starts another worker thread once that has gone on for longer than a task may wait,
+ * as the busy workers may not take a task for a long time to notice the wait themselves
+ */
+static void note_task_service_saturation(struct task_service * t, uint64_t now) {
+  assert(t != NULL);
+  uint64_t since = atomic_load_explicit(&t->saturated_since, memory_order_relaxed);
+  if(since == 0) {
+    atomic_compare_exchange_strong_explicit(&t->saturated_since, &since, now, memory_order_relaxed, memory_order_relaxed);
+  } else if(now - since > t->max_queue_wait) {
+    // the new worker gets as long as a task may wait before yet another one is started
+    atomic_store_explicit(&t->saturated_since, now, memory_order_relaxed);
+    grow_task_service(t);
+  }
+}
+
+/**
+ * Runs the task server worker threads
+ */
+static void * run_task_worker(void * arg) {
+  struct task_worker * w = (struct task_worker *)arg;
+  struct task_service * t = w->service;
+  current_worker = w;
+  struct task * task;
+  while((task = take_task(w)) != NULL) {
+    uint64_t wait = get_time() - task->enqueued;
+    if(wait > t->max_queue_wait) {
+      grow_task_service(t);
+    }
+    record_task_wait(t, wait);
+    record_metric(METRIC_TASK_WAIT, wait);
+    // an embedded task may be submitted again as soon as its destructor ran
+    bool pooled = task->pooled;
+    if(task->timeout != 0 && wait > task->timeout) {
+      // nobody waits for the result any more, the time is better spent on tasks that are still wanted
+      expire_task(t, task);
     } else {
-      if((result = pthread_mutex_unlock(&t->waiting_mutex))) {
-	LOG_ERROR_CODE("could not unlock waiting mutex", result);
-	return NULL;
-      }
       run_task(t, task);
+    }
+    if(pooled) {
       recycle_task(t, task);
-      if((result = pthread_mutex_lock(&t->waiting_mutex))) {
-	LOG_ERROR_CODE("could not lock waiting mutex", result);
-	return NULL;
-      }    
     }
   }
+  atomic_store(&w->state, TASK_WORKER_EXITED);
+  if(atomic_load(&t->running)) {
+    LOG_DEBUG("worker thread exits after waiting for %ld seconds", (long)t->idle_timeout);
+    // a notification may have been meant for this thread while it timed out
+    if(t->scheduler == TASK_SCHEDULER_STEALING) {
+      wake_up_thieves(t, w->index + 1, 1);
+    } else {
+      notify_eventcount(&t->waiting_event, 1);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Pushes tasks onto the queues of the shared scheduler for their priorities,
+ * claiming the slots of consecutive tasks of the same priority at once
+ * Returns the number of tasks pushed, from the start
+ */
+static size_t push_onto_waiting_queues(struct task_service * t, struct task ** tasks, size_t count) {
+  assert(t != NULL);
+  size_t pushed = 0;
+  while(pushed < count) {
+    enum task_priority priority = tasks[pushed]->priority;
+    size_t len = 1;
+    while(pushed + len < count && tasks[pushed + len]->priority == priority) {
+      ++len;
+    }
+    size_t result = push_many_onto_task_queue(t->waiting + priority, tasks + pushed, len);
+    pushed += result;
+    if(result < len) {
+      break;
+    }
+  }
+  return pushed;
+}
+
+/**
+ * Hands a task to a worker of the stealing scheduler without waking it up
+ * A worker adding a task of the priority of its deque for itself pushes it onto the deque, other tasks go to the inbox
+ */
+static int push_onto_task_worker(struct task_worker * w, struct task * task) {
+  assert(w != NULL);
+  assert(task != NULL);
+  if(w == current_worker && task->priority == w->deque_priority && !push_onto_task_deque(&w->deque, task)) {
+    return 0;
+  }
+  return push_onto_task_queue(w->inbox + task->priority, task);
+}
+
+/**
+ * Returns the worker of the stealing scheduler a key is for, spreading the keys over the running workers
+ * A key whose worker is not running, because it exited after its key was mapped, goes to the next one that is
+ */
+static struct task_worker * get_keyed_task_worker(struct task_service * t, size_t key) {
+  assert(t != NULL);
+  size_t len = atomic_load_explicit(&t->len, memory_order_relaxed);
+  size_t index = key % (len != 0 ? len : t->cap);
+  for(size_t i = 0; i < t->cap; ++i) {
+    struct task_worker * w = t->workers + (index + i) % t->cap;
+    if(atomic_load_explicit(&w->state, memory_order_relaxed) == TASK_WORKER_RUNNING) {
+      return w;
+    }
+  }
+  // no worker is running, the task waits in the inbox until one starts or the service is disposed of
+  return t->workers + index;
+}
+
+/**
+ * Returns the worker of the stealing scheduler to hand a task to, keys may be NULL
+ */
+static struct task_worker * get_task_worker(struct task_service * t, const size_t * keys, size_t index) {
+  assert(t != NULL);
+  if(keys != NULL) {
+    return get_keyed_task_worker(t, keys[index]);
+  }
+  // a worker keeps what it adds, other threads spread the tasks
+  struct task_worker * w = current_worker;
+  if(w == NULL || w->service != t) {
+    w = get_keyed_task_worker(t, atomic_fetch_add_explicit(&t->next_worker, 1, memory_order_relaxed));
+  }
+  return w;
+}
+
+/**
+ * Hands tasks to the workers of the stealing scheduler, waking up the workers they are for
+ * and as many others to steal the tasks of the workers that are busy
+ * Sets saturated if no worker was idle to take some of the tasks
+ * Returns the number of tasks handed over, from the start
+ */
+static size_t push_onto_task_workers(struct task_service * t, struct task ** tasks, const size_t * keys, size_t count, bool * saturated) {
+  assert(t != NULL);
+  size_t pushed;
+  size_t unattended = 0;
+  for(pushed = 0; pushed < count; ++pushed) {
+    struct task_worker * w = get_task_worker(t, keys, pushed);
+    if(push_onto_task_worker(w, tasks[pushed])) {
+      break;
+    }
+    if(w == current_worker || !notify_eventcount(&w->event, 1)) {
+      ++unattended;
+    }
+  }
+  *saturated = wake_up_thieves(t, current_worker == NULL ? 0 : current_worker->index + 1, unattended) != 0;
+  return pushed;
 }
 
 /*
  * The public API
  */
 
-int init_task_service(struct task_service * t, size_t max_pool_size) {
+int init_task_service(struct task_service * t, size_t min_pool_size, size_t max_pool_size, size_t queue_capacity, enum task_scheduler scheduler) {
   assert(t != NULL);
-  if(max_pool_size == 0) {
-    LOG_ERROR("max_pool_size must be > 0");
+  if(min_pool_size == 0 || min_pool_size > max_pool_size) {
+    LOG_ERROR("min_pool_size must be > 0 and <= max_pool_size");
     return -1;
   }
-  int result;
-  if((result = pthread_mutex_init(&t->waiting_mutex, NULL))) {
-    LOG_ERROR_CODE("could not initialize waiting mutex", result);
+  t->scheduler = scheduler;
+  if(init_task_queues(t->waiting, scheduler == TASK_SCHEDULER_SHARED ? queue_capacity : 1)) {
+    return -1;
+  }
+  if(init_task_queue(&t->ready, queue_capacity)) {
+    dispose_task_queues(t->waiting);
     return -1;
   }
-  if((result = pthread_cond_init(&t->waiting_cond, NULL))) {
-    LOG_ERROR_CODE("could not initialize waiting condition variable", result);
-    pthread_mutex_destroy(&t->waiting_mutex);
+  int result;
+  if((result = pthread_mutex_init(&t->pool_mutex, NULL))) {
+    LOG_ERROR_CODE("could not initialize pool mutex", result);
+    dispose_task_queue(&t->ready);
+    dispose_task_queues(t->waiting);
     return -1;
   }
-  if((result = pthread_mutex_init(&t->ready_mutex, NULL))) {
-    LOG_ERROR_CODE("could not initialize ready mutex: %s", result);
-    pthread_cond_destroy(&t->waiting_cond);
-    pthread_mutex_destroy(&t->waiting_mutex);
+  t->workers = (struct task_worker *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct task_worker) * max_pool_size);
+  if(t->workers == NULL) {
+    LOG_ERRNO("could not allocate workers");
+    pthread_mutex_destroy(&t->pool_mutex);
+    dispose_task_queue(&t->ready);
+    dispose_task_queues(t->waiting);
     return -1;
   }
-  t->workers = NULL;
-  t->len = 0;
+  for(size_t i = 0; i < max_pool_size; ++i) {
+    if(init_task_worker(t->workers + i, t, i, queue_capacity)) {
+      while(i-- > 0) {
+	dispose_task_worker(t->workers + i);
+      }
+      free(t->workers);
+      pthread_mutex_destroy(&t->pool_mutex);
+      dispose_task_queue(&t->ready);
+      dispose_task_queues(t->waiting);
+      return -1;
+    }
+  }
+  init_eventcount(&t->waiting_event);
+  atomic_init(&t->len, 0);
+  t->min = min_pool_size;
   t->cap = max_pool_size;
-  t->running = false;
-  init_task_queue(&t->waiting);
-  init_task_queue(&t->ready);
+  t->max_queue_wait = TASK_DEFAULT_MAX_QUEUE_WAIT;
+  t->idle_timeout = TASK_DEFAULT_IDLE_TIMEOUT;
+  clear_cpu_mask(&t->cpus);
+  atomic_init(&t->next_worker, 0);
+  atomic_init(&t->running, false);
+  atomic_init(&t->expired, 0);
+  atomic_init(&t->min_wait, UINT64_MAX);
+  atomic_init(&t->saturated_since, 0);
   return 0;
 }
 
 int start_task_service(struct task_service * t) {
   assert(t != NULL);
-  pthread_t * workers = (pthread_t *)malloc(sizeof(pthread_t) * t->cap);
-  if(workers == NULL) {
-    LOG_ERROR("worker thread buffer allocation failed");
-    return -1;
-  }
-  t->workers = workers;
-  t->len = 0;
-  t->running = true;
+  atomic_store(&t->running, true);
   int result = 0;
-  for(size_t i = 0; i < t->cap; ++i) {
-    result = pthread_create(t->workers + i, NULL, run_task_worker, t);
-    if(result != 0) {
-      LOG_ERROR_CODE("could not create worker thread", result);
-      break;
-    }
-    ++t->len;
+  pthread_mutex_lock(&t->pool_mutex);
+  for(size_t i = 0; i < t->min && result == 0; ++i) {
+    result = start_task_worker(t);
   }
+  pthread_mutex_unlock(&t->pool_mutex);
   if(result != 0) {
     //something went wrong
     stop_task_service(t);
@@ -239,6 +818,23 @@ int start_task_service(struct task_service * t) {
   return 0;
 }
 
+void init_task(struct task * task, void (*executor)(void *), void * data, void (*destructor)(void *)) {
+  assert(task != NULL);
+  task->data = data;
+  task->destructor = destructor;
+  task->executor = executor;
+  task->enqueued = 0;
+  task->timeout = 0;
+  task->priority = TASK_PRIORITY_NORMAL;
+  task->pooled = false;
+}
+
+void set_task_deadline(struct task * task, enum task_priority priority, uint64_t timeout) {
+  assert(task != NULL);
+  task->priority = priority;
+  task->timeout = timeout;
+}
+
 int add_task(struct task_service * t, void (*executor)(void *), void * data, void (*destructor)(void *)) {
   assert(t != NULL);
   struct task * task = get_ready_task(t);
@@ -248,62 +844,114 @@ int add_task(struct task_service * t, void (*executor)(void *), void * data, voi
   task->executor = executor;
   task->data = data;
   task->destructor = destructor;
-  int result;
-  if((result = pthread_mutex_lock(&t->waiting_mutex))) {
-    LOG_ERROR_CODE("could not lock waiting mutex", result);
-    destroy_task(task);
+  if(submit_task(t, task)) {
+    // the caller keeps ownership of the data
+    task->data = NULL;
+    recycle_task(t, task);
     return -1;
   }
-  push_onto_task_queue(&t->waiting, task);
-  if((result = pthread_mutex_unlock(&t->waiting_mutex))) {
-  LOG_ERROR_CODE("could not unlock waiting mutex", result);
-    return -1;
+  return 0;
+}
+
+int submit_task(struct task_service * t, struct task * task) {
+  return submit_tasks(t, &task, NULL, 1) == 1 ? 0 : -1;
+}
+
+int submit_keyed_task(struct task_service * t, size_t key, struct task * task) {
+  return submit_tasks(t, &task, &key, 1) == 1 ? 0 : -1;
+}
+
+size_t submit_tasks(struct task_service * t, struct task ** tasks, const size_t * keys, size_t count) {
+  assert(t != NULL);
+  assert(tasks != NULL);
+  uint64_t now = get_time();
+  for(size_t i = 0; i < count; ++i) {
+    assert(tasks[i]->executor != NULL);
+    assert(tasks[i]->priority < TASK_PRIORITY_COUNT);
+    tasks[i]->enqueued = now;
   }
-  if((result = pthread_cond_signal(&t->waiting_cond))) {
-    LOG_ERROR_CODE("could not signal waiting condition variable", result);
-    return -1;
+  size_t pushed;
+  bool saturated = false;
+  if(t->scheduler == TASK_SCHEDULER_SHARED) {
+    pushed = push_onto_waiting_queues(t, tasks, count);
+    if(pushed != 0) {
+      // every task needs at most one worker
+      saturated = !notify_eventcount(&t->waiting_event, pushed < INT_MAX ? (int)pushed : INT_MAX);
+    }
+  } else {
+    pushed = push_onto_task_workers(t, tasks, keys, count, &saturated);
   }
-  return 0;
+  if(saturated) {
+    note_task_service_saturation(t, now);
+  }
+  if(pushed < count) {
+    LOG_ERROR("task queue is full");
+  }
+  return pushed;
 }
 
-void stop_task_service(struct task_service * t) {
+uint64_t get_expired_task_count(struct task_service * t) {
   assert(t != NULL);
-  int result;
-  if((result = pthread_mutex_lock(&t->waiting_mutex))) {
-    LOG_ERROR_CODE("could not lock waiting mutex", result);
-    return;
+  return atomic_load_explicit(&t->expired, memory_order_relaxed);
+}
+
+size_t get_task_queue_length(struct task_service * t) {
+  assert(t != NULL);
+  size_t len = 0;
+  if(t->scheduler == TASK_SCHEDULER_SHARED) {
+    for(size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+      len += get_task_queue_size(t->waiting + i);
+    }
+    return len;
   }
-  t->running = false;
-  if((result = pthread_cond_broadcast(&t->waiting_cond))) {
-    LOG_ERROR_CODE("could not broadcast to waiting condition variable", result);
-    pthread_mutex_unlock(&t->waiting_mutex);
-    return;
+  for(size_t i = 0; i < t->cap; ++i) {
+    struct task_worker * w = t->workers + i;
+    for(size_t j = 0; j < TASK_PRIORITY_COUNT; ++j) {
+      len += get_task_queue_size(w->inbox + j);
+    }
+    size_t top = atomic_load_explicit(&w->deque.top, memory_order_relaxed);
+    ptrdiff_t deque_len = (ptrdiff_t)(atomic_load_explicit(&w->deque.bottom, memory_order_relaxed) - top);
+    // the owner lowers the bottom for a moment while it takes a task
+    len += deque_len > 0 ? (size_t)deque_len : 0;
   }
-  if((result = pthread_mutex_unlock(&t->waiting_mutex))) {
-    LOG_ERROR_CODE("could not unlock waiting mutex", result);
-    return;
+  return len;
+}
+
+uint64_t take_min_task_wait(struct task_service * t) {
+  assert(t != NULL);
+  return atomic_exchange_explicit(&t->min_wait, UINT64_MAX, memory_order_relaxed);
+}
+
+void stop_task_service(struct task_service * t) {
+  assert(t != NULL);
+  atomic_store(&t->running, false);
+  notify_eventcount(&t->waiting_event, INT_MAX);
+  for(size_t i = 0; i < t->cap; ++i) {
+    notify_eventcount(&t->workers[i].event, INT_MAX);
   }
-  for(size_t i = 0; i < t->len; ++i) {
-    pthread_join(t->workers[i], NULL);
+  // threads starting other threads give up while the mutex is locked
+  pthread_mutex_lock(&t->pool_mutex);
+  for(size_t i = 0; i < t->cap; ++i) {
+    struct task_worker * w = t->workers + i;
+    if(atomic_load(&w->state) != TASK_WORKER_STOPPED) {
+      pthread_join(w->thread, NULL);
+      atomic_store(&w->state, TASK_WORKER_STOPPED);
+    }
   }
-  free(t->workers);
-  t->workers = NULL;
-  t->len = 0;
-  t->cap = 0;
+  atomic_store(&t->len, 0);
+  pthread_mutex_unlock(&t->pool_mutex);
 }
 
 void dispose_task_service(struct task_service * t) {
   assert(t != NULL);
-  dispose_task_queue(&t->ready);
-  dispose_task_queue(&t->waiting);
-  int result;
-  if((result = pthread_cond_destroy(&t->waiting_cond))) {
-    LOG_ERROR_CODE("could not destroy waiting condition variable", result);
-  }
-  if((result = pthread_mutex_destroy(&t->waiting_mutex))) {
-    LOG_ERROR_CODE("could not destroy waiting mutex", result);
+  for(size_t i = 0; i < t->cap; ++i) {
+    dispose_task_worker(t->workers + i);
   }
-  if((result = pthread_mutex_destroy(&t->ready_mutex))) {
-    LOG_ERROR_CODE("could not destroy ready mutex", result);
+  free(t->workers);
+  int result;
+  if((result = pthread_mutex_destroy(&t->pool_mutex))) {
+    LOG_ERROR_CODE("could not destroy pool mutex", result);
   }
+  dispose_task_queue(&t->ready);
+  dispose_task_queues(t->waiting);
 }
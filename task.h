@@ -1,13 +1,54 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include "affinity.h"
+#include "eventcount.h"
+
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <pthread.h>
+#include <time.h>
+
+/**
+ * The default time in nanoseconds a task may wait in the queue before another worker thread is started
+ */
+#define TASK_DEFAULT_MAX_QUEUE_WAIT 2000000
+
+/**
+ * The default number of seconds a worker thread above the minimum may wait for tasks before it exits
+ */
+#define TASK_DEFAULT_IDLE_TIMEOUT 30
+
+/**
+ * The number of task priorities
+ */
+#define TASK_PRIORITY_COUNT 3
+
+/**
+ * The priorities of tasks, workers take tasks of a higher priority first
+ */
+enum task_priority {
+  /**
+   * Tasks overtaking all others
+   */
+  TASK_PRIORITY_HIGH,
+  /**
+   * The priority of tasks unless specified otherwise
+   */
+  TASK_PRIORITY_NORMAL,
+  /**
+   * Tasks only done when there is nothing else to do
+   */
+  TASK_PRIORITY_LOW
+};
 
 /**
  * A task definition
+ * Tasks are either taken from the pool of a task service by add_task
+ * or embedded in an object of the caller, initialized by init_task and added by submit_task
  */
 struct task {
   /**
@@ -23,83 +64,305 @@ struct task {
    * The executor function
    */
   void (*executor)(void *);
+
+  /**
+   * When the task was added, in nanoseconds on the monotonic clock
+   */
+  uint64_t enqueued;
+
+  /**
+   * The time in nanoseconds the task may wait before it is dropped without running, 0 for no limit
+   */
+  uint64_t timeout;
+
+  /**
+   * The priority of the task
+   */
+  enum task_priority priority;
+
+  /**
+   * Whether the task belongs to the pool of the task service rather than being embedded in an object of the caller
+   */
+  bool pooled;
+};
+
+/**
+ * A slot in a task queue
+ */
+struct task_slot {
   /**
-   * The next task in the list
+   * The position in the queue the slot can be written at, or that position plus one once it has been written
    */
-  struct task * next;
+  _Atomic size_t sequence;
+  /**
+   * The task
+   */
+  struct task * task;
 };
 
 /**
- * A queue of tasks
+ * A bounded lock free queue of tasks for multiple producers and multiple consumers
  */
 struct task_queue {
   /**
-   * The first task in the queue
+   * The slots
+   */
+  struct task_slot * slots;
+  /**
+   * The number of slots minus one, the number of slots being a power of two
+   */
+  size_t mask;
+  /**
+   * The position the next task is added at
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+  /**
+   * The position the next task is taken from
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+};
+
+/**
+ * A bounded Chase-Lev deque of tasks, its owner pushes and takes tasks at the bottom
+ * while other threads steal them from the top
+ */
+struct task_deque {
+  /**
+   * The tasks
+   */
+  _Atomic(struct task *) * tasks;
+  /**
+   * The number of tasks minus one, the number of tasks being a power of two
+   */
+  size_t mask;
+  /**
+   * The position of the next task to steal
    */
-  struct task * head;
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t top;
   /**
-   * The last task in the queue
+   * The position the owner pushes the next task at
    */
-  struct task * tail;
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t bottom;
 };
 
 /**
- * A task service implemented as a fixed thread pool
+ * The ways a task service hands tasks to its workers
+ */
+enum task_scheduler {
+  /**
+   * All workers take tasks from one shared queue
+   */
+  TASK_SCHEDULER_SHARED,
+  /**
+   * Every worker takes tasks from its own deque and steals from the others when it runs out
+   */
+  TASK_SCHEDULER_STEALING
+};
+
+struct task_service;
+
+/**
+ * The states of a worker
+ */
+enum task_worker_state {
+  /**
+   * No thread is running for the worker
+   */
+  TASK_WORKER_STOPPED,
+  /**
+   * The thread is running
+   */
+  TASK_WORKER_RUNNING,
+  /**
+   * The thread exited and must be joined
+   */
+  TASK_WORKER_EXITED
+};
+
+/**
+ * A worker thread of a task service
+ */
+struct task_worker {
+  /**
+   * The thread
+   */
+  pthread_t thread;
+  /**
+   * The state of the thread
+   */
+  _Atomic enum task_worker_state state;
+  /**
+   * The service the worker belongs to
+   */
+  struct task_service * service;
+  /**
+   * The index of the worker in the service
+   */
+  size_t index;
+  /**
+   * Tasks added for this worker by other threads, one queue per priority, moved to the deque by the worker
+   * Only used by the stealing scheduler
+   */
+  struct task_queue inbox[TASK_PRIORITY_COUNT];
+  /**
+   * The tasks of this worker
+   * Only used by the stealing scheduler
+   */
+  struct task_deque deque;
+  /**
+   * The priority of the tasks moved to the deque, only accessed by the worker
+   */
+  enum task_priority deque_priority;
+  /**
+   * The event the worker waits on while it has nothing to do, with the stealing scheduler
+   */
+  struct eventcount event;
+};
+
+/**
+ * A task service implemented as a thread pool growing from a minimum to a maximum number of threads
+ * Threads are added while tasks wait too long, or are added with no idle thread for too long,
+ * and exit again once idle for long enough
  */
 struct task_service {
   /**
    * The available worker threads
    */
-  pthread_t * workers;
+  struct task_worker * workers;
   /**
-   * The number of active threads
+   * The number of running threads
    */
-  size_t len;
+  _Atomic size_t len;
+  /**
+   * The minimum number of threads
+   */
+  size_t min;
   /**
    * The maximum number of threads
    */
   size_t cap;
   /**
-   * Whether the service is running
+   * The time in nanoseconds a task may wait in the queue before another thread is started
+   */
+  uint64_t max_queue_wait;
+  /**
+   * The number of seconds a thread above the minimum may wait for tasks before it exits
    */
-  bool running;
+  time_t idle_timeout;
   /**
-   * Tasks waiting to be done
+   * Serializes starting and joining threads
    */
-  struct task_queue waiting;
+  pthread_mutex_t pool_mutex;
   /**
-   * A mutex for the waiting queue
+   * The CPUs the worker threads run on, empty if they are not pinned
    */
-  pthread_mutex_t waiting_mutex;
+  struct cpu_mask cpus;
   /**
-   * A condition variable for waiting queue
+   * How tasks are handed to the workers
    */
-  pthread_cond_t waiting_cond;
+  enum task_scheduler scheduler;
+  /**
+   * The worker the next task without a key is added for, used by the stealing scheduler
+   */
+  _Atomic size_t next_worker;
+  /**
+   * Whether the service is running
+   */
+  atomic_bool running;
+  /**
+   * Tasks waiting to be done, one queue per priority, used by the shared scheduler
+   */
+  struct task_queue waiting[TASK_PRIORITY_COUNT];
+  /**
+   * The event idle workers wait on until tasks are added, used by the shared scheduler
+   */
+  struct eventcount waiting_event;
   /**
    * A queue to reuse tasks that are done
    */
   struct task_queue ready;
   /**
-   * A mutex for the ready queue
+   * The number of tasks dropped because they waited longer than their timeout
+   */
+  _Atomic uint64_t expired;
+  /**
+   * The shortest time in nanoseconds a task waited since it was last taken, UINT64_MAX if no task was done
+   */
+  _Atomic uint64_t min_wait;
+  /**
+   * When tasks were first added with no idle worker to take them, in nanoseconds on the monotonic clock,
+   * 0 since a worker was last idle
    */
-  pthread_mutex_t ready_mutex;
+  _Atomic uint64_t saturated_since;
 };
 
 /**
  * Initializes the task service
+ * At most queue_capacity tasks can be waiting at the same time
  */
-int init_task_service(struct task_service * t, size_t max_pool_size);
+int init_task_service(struct task_service * t, size_t min_pool_size, size_t max_pool_size, size_t queue_capacity, enum task_scheduler scheduler);
 
 /**
- * Starts the task service
+ * Starts the task service with the minimum number of threads
  */
 int start_task_service(struct task_service * t);
 
 /**
  * Creates a new task and adds it to the task server's queue
+ * Fails if the queue is full
  */
 int add_task(struct task_service * t, void (*executor)(void *), void * data, void (*destructor)(void *));
 
+/**
+ * Initializes a task embedded in an object of the caller, with normal priority and no timeout
+ */
+void init_task(struct task * task, void (*executor)(void *), void * data, void (*destructor)(void *));
+
+/**
+ * Sets the priority of a task and the time in nanoseconds it may wait, 0 for no limit
+ * A task still waiting once its timeout passed is dropped, only its destructor runs
+ */
+void set_task_deadline(struct task * task, enum task_priority priority, uint64_t timeout);
+
+/**
+ * Adds a task embedded in an object of the caller to the task server's queue, without allocating
+ * The task must not be submitted again before its destructor ran
+ * Fails if the queue is full, the caller keeps ownership of the task then
+ */
+int submit_task(struct task_service * t, struct task * task);
+
+/**
+ * Adds a task embedded in an object of the caller like submit_task
+ * With the stealing scheduler, tasks submitted with the same key are run by the same worker
+ * while the number of running workers stays the same, unless it is busy and another worker steals them
+ */
+int submit_keyed_task(struct task_service * t, size_t key, struct task * task);
+
+/**
+ * Adds a batch of tasks embedded in objects of the caller, claiming their queue slots at once
+ * and waking up no more workers than there are tasks
+ * With the stealing scheduler, every task is run by the worker its key is for, keys may be NULL
+ * Returns the number of tasks added, from the start, the caller keeps ownership of the others
+ */
+size_t submit_tasks(struct task_service * t, struct task ** tasks, const size_t * keys, size_t count);
+
+/**
+ * Returns the number of tasks dropped because they waited longer than their timeout
+ */
+uint64_t get_expired_task_count(struct task_service * t);
+
+/**
+ * Returns the number of tasks waiting for a worker, only a snapshot while tasks are added and taken
+ */
+size_t get_task_queue_length(struct task_service * t);
+
+/**
+ * Returns the shortest time in nanoseconds a task waited in the queue since the last call,
+ * UINT64_MAX if no task was taken meanwhile
+ * A minimum that stays high means the queue never drained, rather than that there was a burst
+ */
+uint64_t take_min_task_wait(struct task_service * t);
+
 /**
  * Closes the task service
  */
@@ -0,0 +1,86 @@
+#include "timer.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+void init_timer(struct timer * t) {
+  assert(t != NULL);
+
+  t->expiry = 0;
+  t->prev = NULL;
+  t->next = NULL;
+}
+
+bool is_timer_running(const struct timer * t) {
+  assert(t != NULL);
+
+  return t->next != NULL;
+}
+
+void init_timer_wheel(struct timer_wheel * w, uint64_t now) {
+  assert(w != NULL);
+
+  for(size_t i = 0; i < TIMER_WHEEL_SIZE; ++i) {
+    w->slots[i].prev = w->slots + i;
+    w->slots[i].next = w->slots + i;
+  }
+  w->now = now;
+  w->len = 0;
+}
+
+void start_timer(struct timer_wheel * w, struct timer * t, uint64_t expiry) {
+  assert(w != NULL);
+  assert(t != NULL);
+
+  stop_timer(w, t);
+  // the slots of past ticks are only visited again a revolution later
+  if(expiry <= w->now) {
+    expiry = w->now + 1;
+  }
+  struct timer * slot = w->slots + (expiry & (TIMER_WHEEL_SIZE - 1));
+  t->expiry = expiry;
+  t->prev = slot->prev;
+  t->next = slot;
+  slot->prev->next = t;
+  slot->prev = t;
+  ++w->len;
+}
+
+void stop_timer(struct timer_wheel * w, struct timer * t) {
+  assert(w != NULL);
+  assert(t != NULL);
+
+  if(!is_timer_running(t)) {
+    return;
+  }
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = NULL;
+  t->next = NULL;
+  --w->len;
+}
+
+struct timer * pop_expired_timer(struct timer_wheel * w, uint64_t now) {
+  assert(w != NULL);
+
+  // after a long pause every slot is visited once, any timer that expired meanwhile is found on the way
+  if(now > w->now + TIMER_WHEEL_SIZE) {
+    w->now = now - TIMER_WHEEL_SIZE;
+  }
+  while(w->now < now) {
+    if(w->len == 0) {
+      w->now = now;
+      break;
+    }
+    struct timer * slot = w->slots + ((w->now + 1) & (TIMER_WHEEL_SIZE - 1));
+    for(struct timer * t = slot->next; t != slot; t = t->next) {
+      if(t->expiry <= now) {
+	stop_timer(w, t);
+	return t;
+      }
+    }
+    ++w->now;
+  }
+  return NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The number of slots of a timer wheel, a power of two
+ */
+#define TIMER_WHEEL_SIZE 256
+
+/**
+ * A timer, embedded in the object it times
+ */
+struct timer {
+  /**
+   * The tick at which the timer expires
+   */
+  uint64_t expiry;
+  /**
+   * The previous timer in the slot, NULL while the timer is not running
+   */
+  struct timer * prev;
+  /**
+   * The next timer in the slot, NULL while the timer is not running
+   */
+  struct timer * next;
+};
+
+/**
+ * A hashed timer wheel, timers are kept in the slot of their expiry tick modulo the number of slots
+ * so starting and stopping a timer takes constant time, whatever the number of timers
+ * Timers expiring more than a revolution ahead stay in their slot until their tick comes round
+ */
+struct timer_wheel {
+  /**
+   * The slots, each the head of a circular list of timers
+   */
+  struct timer slots[TIMER_WHEEL_SIZE];
+  /**
+   * The last tick whose timers have all been expired
+   */
+  uint64_t now;
+  /**
+   * The number of running timers
+   */
+  size_t len;
+};
+
+/**
+ * Initializes a timer that is not running
+ */
+void init_timer(struct timer * t);
+
+/**
+ * Returns whether a timer is running
+ */
+bool is_timer_running(const struct timer * t);
+
+/**
+ * Initializes an empty timer wheel at the specified tick
+ */
+void init_timer_wheel(struct timer_wheel * w, uint64_t now);
+
+/**
+ * Starts a timer expiring at the specified tick, or at the next tick if that has passed
+ * A running timer is restarted
+ */
+void start_timer(struct timer_wheel * w, struct timer * t, uint64_t expiry);
+
+/**
+ * Stops a timer, if it is running
+ */
+void stop_timer(struct timer_wheel * w, struct timer * t);
+
+/**
+ * Stops and returns a timer that expired at or before the specified tick, or NULL if there is none
+ * The wheel advances to the tick as it runs out of expired timers
+ */
+struct timer * pop_expired_timer(struct timer_wheel * w, uint64_t now);
+
+#endif
@@ -0,0 +1,219 @@
+#include "logger.h"
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Sets up a ring
+ */
+static int uring_setup(unsigned entries, struct io_uring_params * params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * Submits entries and waits for completions
+ */
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Registers resources with a ring
+ */
+static int uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int init_uring(struct uring * r, unsigned entries) {
+  assert(r != NULL);
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(struct io_uring_params));
+  r->fd = uring_setup(entries, &params);
+  if(r->fd < 0) {
+    LOG_ERRNO("could not set up io_uring");
+    return -1;
+  }
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    LOG_ERROR("io_uring of this kernel is too old");
+    close(r->fd);
+    return -1;
+  }
+
+  r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(r->cq_ring_size > r->sq_ring_size) {
+    r->sq_ring_size = r->cq_ring_size;
+  }
+  r->cq_ring_size = r->sq_ring_size;
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_ring == MAP_FAILED) {
+    LOG_ERRNO("could not map io_uring rings");
+    close(r->fd);
+    return -1;
+  }
+  r->cq_ring = r->sq_ring;
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED) {
+    LOG_ERRNO("could not map io_uring submission queue entries");
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    return -1;
+  }
+
+  char * sq = (char *)r->sq_ring;
+  r->sq_head = (unsigned *)(sq + params.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  r->sq_array = (unsigned *)(sq + params.sq_off.array);
+  r->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  r->sq_entries = params.sq_entries;
+  r->pending = 0;
+
+  char * cq = (char *)r->cq_ring;
+  r->cq_head = (unsigned *)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+struct io_uring_sqe * get_uring_sqe(struct uring * r) {
+  assert(r != NULL);
+
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail + r->pending;
+  if(tail - head == r->sq_entries) {
+    return NULL;
+  }
+  unsigned index = tail & r->sq_mask;
+  struct io_uring_sqe * sqe = r->sqes + index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array[index] = index;
+  ++r->pending;
+  return sqe;
+}
+
+unsigned get_uring_sq_space(struct uring * r) {
+  assert(r != NULL);
+
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  return r->sq_entries - (*r->sq_tail + r->pending - head);
+}
+
+int submit_uring(struct uring * r, unsigned wait_nr) {
+  assert(r != NULL);
+
+  if(r->pending != 0) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->pending, __ATOMIC_RELEASE);
+    r->pending = 0;
+  }
+  // entries left over by an interrupted call are submitted as well
+  unsigned to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if(to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+  if(uring_enter(r->fd, to_submit, wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+struct io_uring_cqe * peek_uring_cqe(struct uring * r) {
+  assert(r != NULL);
+
+  unsigned head = *r->cq_head;
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return r->cqes + (head & r->cq_mask);
+}
+
+void advance_uring_cq(struct uring * r) {
+  assert(r != NULL);
+
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int init_uring_buffer_ring(struct uring * r, struct uring_buffer_ring * b, uint16_t group, unsigned entries, size_t buffer_size) {
+  assert(r != NULL);
+  assert(b != NULL);
+  assert(entries != 0 && (entries & (entries - 1)) == 0);
+
+  b->ring_size = entries * sizeof(struct io_uring_buf);
+  b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if(b->ring == MAP_FAILED) {
+    LOG_ERRNO("could not map provided buffer ring");
+    return -1;
+  }
+  b->buffers = malloc(entries * buffer_size);
+  if(b->buffers == NULL) {
+    LOG_ERRNO("could not allocate provided buffers");
+    munmap(b->ring, b->ring_size);
+    return -1;
+  }
+  b->buffer_size = buffer_size;
+  b->entries = entries;
+  b->tail = 0;
+  b->group = group;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  if(uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    LOG_ERRNO("could not register provided buffer ring");
+    free(b->buffers);
+    munmap(b->ring, b->ring_size);
+    return -1;
+  }
+  for(unsigned i = 0; i < entries; ++i) {
+    recycle_uring_buffer(b, (uint16_t)i);
+  }
+  return 0;
+}
+
+char * get_uring_buffer(struct uring_buffer_ring * b, uint16_t id) {
+  assert(b != NULL);
+  assert(id < b->entries);
+
+  return b->buffers + (size_t)id * b->buffer_size;
+}
+
+void recycle_uring_buffer(struct uring_buffer_ring * b, uint16_t id) {
+  assert(b != NULL);
+
+  struct io_uring_buf * buf = b->ring->bufs + (b->tail & (b->entries - 1));
+  buf->addr = (uint64_t)(uintptr_t)get_uring_buffer(b, id);
+  buf->len = (uint32_t)b->buffer_size;
+  buf->bid = id;
+  ++b->tail;
+  __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+void dispose_uring_buffer_ring(struct uring * r, struct uring_buffer_ring * b) {
+  assert(r != NULL);
+  assert(b != NULL);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+  reg.bgid = b->group;
+  uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  free(b->buffers);
+  munmap(b->ring, b->ring_size);
+}
+
+void dispose_uring(struct uring * r) {
+  assert(r != NULL);
+
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->fd);
+}
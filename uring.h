@@ -0,0 +1,173 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <linux/io_uring.h>
+
+/**
+ * A minimal io_uring instance driven through the raw system calls
+ */
+struct uring {
+  /**
+   * The ring file descriptor
+   */
+  int fd;
+  /**
+   * The mapped submission queue ring
+   */
+  void * sq_ring;
+  /**
+   * The size of the mapped submission queue ring
+   */
+  size_t sq_ring_size;
+  /**
+   * The mapped completion queue ring, may be the same mapping as the submission queue ring
+   */
+  void * cq_ring;
+  /**
+   * The size of the mapped completion queue ring
+   */
+  size_t cq_ring_size;
+  /**
+   * The mapped submission queue entries
+   */
+  struct io_uring_sqe * sqes;
+  /**
+   * The size of the mapped submission queue entries
+   */
+  size_t sqes_size;
+  /**
+   * The submission queue head, advanced by the kernel
+   */
+  unsigned * sq_head;
+  /**
+   * The submission queue tail
+   */
+  unsigned * sq_tail;
+  /**
+   * The submission queue index array
+   */
+  unsigned * sq_array;
+  /**
+   * The submission queue index mask
+   */
+  unsigned sq_mask;
+  /**
+   * The number of submission queue entries
+   */
+  unsigned sq_entries;
+  /**
+   * The number of entries prepared but not yet submitted
+   */
+  unsigned pending;
+  /**
+   * The completion queue head
+   */
+  unsigned * cq_head;
+  /**
+   * The completion queue tail, advanced by the kernel
+   */
+  unsigned * cq_tail;
+  /**
+   * The completion queue index mask
+   */
+  unsigned cq_mask;
+  /**
+   * The completion queue entries
+   */
+  struct io_uring_cqe * cqes;
+};
+
+/**
+ * A ring of buffers provided to the kernel to receive data into
+ */
+struct uring_buffer_ring {
+  /**
+   * The shared ring
+   */
+  struct io_uring_buf_ring * ring;
+  /**
+   * The size of the mapped ring
+   */
+  size_t ring_size;
+  /**
+   * The buffer memory
+   */
+  char * buffers;
+  /**
+   * The size of a single buffer
+   */
+  size_t buffer_size;
+  /**
+   * The number of buffers, a power of two
+   */
+  unsigned entries;
+  /**
+   * The local copy of the ring tail
+   */
+  uint16_t tail;
+  /**
+   * The buffer group id
+   */
+  uint16_t group;
+};
+
+/**
+ * Initializes an io_uring instance with the specified number of submission queue entries
+ */
+int init_uring(struct uring * r, unsigned entries);
+
+/**
+ * Returns a cleared submission queue entry or NULL if the queue is full
+ */
+struct io_uring_sqe * get_uring_sqe(struct uring * r);
+
+/**
+ * Returns the number of submission queue entries that can still be prepared
+ */
+unsigned get_uring_sq_space(struct uring * r);
+
+/**
+ * Submits all prepared entries and waits for at least the specified number of completions
+ */
+int submit_uring(struct uring * r, unsigned wait_nr);
+
+/**
+ * Returns the next completion queue entry or NULL if there is none
+ */
+struct io_uring_cqe * peek_uring_cqe(struct uring * r);
+
+/**
+ * Marks the completion queue entry returned by peek_uring_cqe as consumed
+ */
+void advance_uring_cq(struct uring * r);
+
+/**
+ * Registers a ring of provided buffers with the specified group id
+ * The number of entries must be a power of two
+ */
+int init_uring_buffer_ring(struct uring * r, struct uring_buffer_ring * b, uint16_t group, unsigned entries, size_t buffer_size);
+
+/**
+ * Returns a pointer to the data of a provided buffer
+ */
+char * get_uring_buffer(struct uring_buffer_ring * b, uint16_t id);
+
+/**
+ * Gives a provided buffer back to the kernel
+ */
+void recycle_uring_buffer(struct uring_buffer_ring * b, uint16_t id);
+
+/**
+ * Unregisters and disposes of a ring of provided buffers
+ */
+void dispose_uring_buffer_ring(struct uring * r, struct uring_buffer_ring * b);
+
+/**
+ * Disposes of an io_uring instance
+ */
+void dispose_uring(struct uring * r);
+
+#endif
@@ -0,0 +1,569 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "connection.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "protocol.h"
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * The number of submission queue entries
+ */
+#define URING_LOOP_ENTRIES 256
+
+/**
+ * The number of provided receive buffers, a power of two
+ */
+#define URING_LOOP_BUFFER_COUNT 256
+
+/**
+ * The size of a provided receive buffer
+ */
+#define URING_LOOP_BUFFER_SIZE 4096
+
+/**
+ * The provided buffer group used for receiving
+ */
+#define URING_LOOP_BUFFER_GROUP 0
+
+/**
+ * The mask for the operation stored in the low bits of the user data
+ */
+#define URING_LOOP_OP_MASK 7
+
+/**
+ * The operations submitted to the ring
+ */
+enum uring_op {
+  /**
+   * Multishot accept on the listener socket
+   */
+  URING_OP_ACCEPT,
+  /**
+   * Read of the wake up event
+   */
+  URING_OP_WAKE,
+  /**
+   * Receive into a provided buffer
+   */
+  URING_OP_RECV,
+  /**
+   * Send of the response
+   */
+  URING_OP_SEND,
+  /**
+   * Close of a connection socket
+   */
+  URING_OP_CLOSE,
+  /**
+   * Timeout of a tick for expiring connection timers
+   */
+  URING_OP_TIMEOUT,
+  /**
+   * Timeout linked to the send of a response the connection is closed after
+   */
+  URING_OP_LINK_TIMEOUT
+};
+
+/**
+ * The state of an io_uring event loop
+ */
+struct uring_loop {
+  /**
+   * The ring
+   */
+  struct uring ring;
+
+  /**
+   * The provided receive buffers
+   */
+  struct uring_buffer_ring buffers;
+
+  /**
+   * An event file descriptor used to wake up the event loop
+   */
+  int wake_fd;
+
+  /**
+   * The value read from the wake up event
+   */
+  uint64_t wake_value;
+
+  /**
+   * The length of a tick
+   */
+  struct __kernel_timespec tick;
+
+  /**
+   * Whether a timeout for the next tick is queued
+   */
+  bool ticking;
+
+  /**
+   * The write timeout, zero for no limit
+   */
+  struct __kernel_timespec write_timeout;
+};
+
+/**
+ * Returns a submission queue entry for an operation on a connection
+ * Submits the queued entries first if the submission queue is full
+ */
+static struct io_uring_sqe * get_sqe(struct uring_loop * u, enum uring_op op, struct connection * c) {
+  struct io_uring_sqe * sqe = get_uring_sqe(&u->ring);
+  if(sqe == NULL) {
+    submit_uring(&u->ring, 0);
+    sqe = get_uring_sqe(&u->ring);
+    if(sqe == NULL) {
+      return NULL;
+    }
+  }
+  sqe->user_data = (uint64_t)(uintptr_t)c | (uint64_t)op;
+  return sqe;
+}
+
+/**
+ * Queues a multishot accept on the listener socket
+ */
+static void prepare_accept(struct event_loop * l) {
+  struct io_uring_sqe * sqe = get_sqe((struct uring_loop *)l->data, URING_OP_ACCEPT, NULL);
+  if(sqe != NULL) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+}
+
+/**
+ * Queues a read of the wake up event
+ */
+static void prepare_wake(struct uring_loop * u) {
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_WAKE, NULL);
+  if(sqe != NULL) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = u->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->wake_value;
+    sqe->len = sizeof(uint64_t);
+  }
+}
+
+/**
+ * Queues a timeout for the next tick, after which expired connections are shut down
+ */
+static void prepare_timeout(struct uring_loop * u) {
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_TIMEOUT, NULL);
+  if(sqe != NULL) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&u->tick;
+    sqe->len = 1;
+    u->ticking = true;
+  }
+}
+
+/**
+ * Queues a close of the connection socket, the connection is released when it completes
+ */
+static void prepare_close(struct uring_loop * u, struct connection * c) {
+  // the socket number may be reused as soon as it is closed, so the timer must not shut it down any more
+  stop_connection_timer(c->loop, c);
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_CLOSE, c);
+  if(sqe == NULL) {
+    close_connection(c);
+    return;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = c->socket;
+}
+
+/**
+ * Queues a receive into a buffer selected by the kernel from the provided buffer ring
+ */
+static void prepare_recv(struct uring_loop * u, struct connection * c) {
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_RECV, c);
+  if(sqe == NULL) {
+    stop_connection_timer(c->loop, c);
+    close_connection(c);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->socket;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_LOOP_BUFFER_GROUP;
+}
+
+/**
+ * Queues a timeout bounding the linked operation before it by the write timeout
+ * The operation is cancelled when the timeout expires first, and so is the rest of the link
+ */
+static void prepare_link_timeout(struct uring_loop * u, struct connection * c) {
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_LINK_TIMEOUT, c);
+  if(sqe != NULL) {
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&u->write_timeout;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_LINK;
+  }
+}
+
+/**
+ * Queues the send of the remaining response data
+ * Unless the connection is kept alive, the send is linked to a timeout bounding it
+ * and to the close of the connection
+ */
+static void prepare_send(struct uring_loop * u, struct connection * c) {
+  bool bounded = u->write_timeout.tv_sec != 0 || u->write_timeout.tv_nsec != 0;
+  // a link must not be split between two submissions
+  if(!c->keep_alive && get_uring_sq_space(&u->ring) < (bounded ? 3 : 2)) {
+    submit_uring(&u->ring, 0);
+  }
+  struct io_uring_sqe * sqe = get_sqe(u, URING_OP_SEND, c);
+  if(sqe == NULL) {
+    stop_connection_timer(c->loop, c);
+    close_connection(c);
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->socket;
+  sqe->addr = (uint64_t)(uintptr_t)(c->output.data + c->sent);
+  sqe->len = (uint32_t)(c->output.len - c->sent);
+  // the kernel sends until all data is sent or the send fails, so the link only goes on after a complete response
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  if(!c->keep_alive) {
+    sqe->flags = IOSQE_IO_LINK;
+    if(bounded) {
+      prepare_link_timeout(u, c);
+    }
+    prepare_close(u, c);
+  }
+}
+
+/**
+ * Closes a connection that could not be dispatched
+ */
+static void reject_connection(struct event_loop * l, struct connection * c) {
+  prepare_close((struct uring_loop *)l->data, c);
+}
+
+/**
+ * Dispatches a connection with a complete request or waits for more data
+ */
+static void continue_request(struct event_loop * l, struct connection * c, enum request_state state, bool closed) {
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  switch(state) {
+  case REQUEST_STATE_COMPLETE:
+    stop_connection_timer(l, c);
+    // dispatched with the other connections that completed in this round
+    if(add_pending_connection(l, c)) {
+      dispatch_pending_connections(l, reject_connection);
+    }
+    break;
+  case REQUEST_STATE_INCOMPLETE:
+    if(closed) {
+      prepare_close(u, c);
+    } else {
+      update_request_timer(l, c);
+      prepare_recv(u, c);
+    }
+    break;
+  case REQUEST_STATE_CLOSED:
+    prepare_close(u, c);
+    break;
+  }
+}
+
+/**
+ * Handles a new connection
+ */
+static void complete_accept(struct event_loop * l, int result, unsigned flags) {
+  if(result >= 0) {
+    struct connection * c = admit_connection(l, result);
+    if(c != NULL) {
+      prepare_recv((struct uring_loop *)l->data, c);
+    }
+  } else if(result != -ECANCELED) {
+    errno = -result;
+    LOG_ERRNO("could not accept connection");
+  }
+  if(!(flags & IORING_CQE_F_MORE) && !l->stopping) {
+    prepare_accept(l);
+  }
+}
+
+/**
+ * Handles received data, dispatching the connection once a complete request is buffered
+ */
+static void complete_recv(struct event_loop * l, struct connection * c, int result, unsigned flags) {
+  assert(c != NULL);
+
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  if(flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+    if(result > 0 && append_read_ahead(&c->buffer, get_uring_buffer(&u->buffers, id), (size_t)result)) {
+      result = -ENOMEM;
+    }
+    recycle_uring_buffer(&u->buffers, id);
+  }
+  if(result == -ENOBUFS) {
+    // all buffers are in use, they are returned as soon as their data has been copied
+    prepare_recv(u, c);
+    return;
+  }
+  if(result < 0) {
+    prepare_close(u, c);
+    return;
+  }
+  continue_request(l, c, get_request_state(c), result == 0);
+}
+
+/**
+ * Handles a sent response
+ */
+static void complete_send(struct event_loop * l, struct connection * c, int result) {
+  assert(c != NULL);
+
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  if(result < 0) {
+    c->times.sent = get_connection_time(c);
+    complete_served_requests(l, c);
+    // a linked close has been cancelled, also when the linked timeout expired
+    prepare_close(u, c);
+    return;
+  }
+  c->sent += (size_t)result;
+  if(c->sent < c->output.len) {
+    // a short send breaks the link, a linked close has been cancelled as well
+    prepare_send(u, c);
+    return;
+  }
+  c->times.sent = get_connection_time(c);
+  complete_served_requests(l, c);
+  // otherwise the linked close is under way
+  if(c->keep_alive) {
+    continue_request(l, c, resume_connection(l, c), false);
+  }
+}
+
+/**
+ * Handles a closed connection socket
+ */
+static void complete_close(struct connection * c, int result) {
+  assert(c != NULL);
+
+  if(result != -ECANCELED) {
+    c->socket = -1;
+    close_connection(c);
+  }
+}
+
+/**
+ * Sends the responses of all connections released by the worker threads
+ */
+static void complete_wake(struct event_loop * l) {
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  struct connection * ordered = take_released_connections(l);
+  while(ordered != NULL) {
+    struct connection * c = ordered;
+    ordered = c->next;
+    c->next = NULL;
+    if(c->output.len == 0) {
+      prepare_close(u, c);
+    } else {
+      // the send of a response the connection is closed after is bounded by its linked timeout instead
+      if(c->keep_alive) {
+	start_connection_timer(l, c, CONNECTION_TIMER_WRITE);
+      }
+      prepare_send(u, c);
+    }
+  }
+  if(!l->stopping) {
+    prepare_wake(u);
+  }
+}
+
+/**
+ * Shuts down the connections whose timer expired
+ * Their pending receive completes with end of file or their send fails, upon which they are closed
+ */
+static void complete_timeout(struct event_loop * l) {
+  ((struct uring_loop *)l->data)->ticking = false;
+  struct connection * c;
+  while((c = pop_expired_connection(l)) != NULL) {
+    shutdown(c->socket, SHUT_RDWR);
+  }
+}
+
+/**
+ * Handles a completion queue entry
+ */
+static void complete(struct event_loop * l, uint64_t user_data, int result, unsigned flags) {
+  struct connection * c = (struct connection *)(uintptr_t)(user_data & ~(uint64_t)URING_LOOP_OP_MASK);
+  switch((enum uring_op)(user_data & URING_LOOP_OP_MASK)) {
+  case URING_OP_ACCEPT:
+    complete_accept(l, result, flags);
+    break;
+  case URING_OP_WAKE:
+    complete_wake(l);
+    break;
+  case URING_OP_RECV:
+    complete_recv(l, c, result, flags);
+    break;
+  case URING_OP_SEND:
+    complete_send(l, c, result);
+    break;
+  case URING_OP_CLOSE:
+    complete_close(c, result);
+    break;
+  case URING_OP_TIMEOUT:
+    complete_timeout(l);
+    break;
+  case URING_OP_LINK_TIMEOUT:
+    // the send it bounds completes with the outcome
+    break;
+  }
+}
+
+/**
+ * Sets up the ring, the provided buffers and the wake up event
+ */
+static int init_uring_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  // the ring waits for the listener itself, a non blocking socket would fail with EAGAIN
+  int flags = fcntl(l->listen_socket, F_GETFL);
+  if(flags == -1 || fcntl(l->listen_socket, F_SETFL, flags & ~O_NONBLOCK)) {
+    LOG_ERRNO("could not make listen socket blocking");
+    return -1;
+  }
+  struct uring_loop * u = (struct uring_loop *)malloc(sizeof(struct uring_loop));
+  if(u == NULL) {
+    LOG_ERRNO("could not allocate io_uring event loop");
+    return -1;
+  }
+  if(init_uring(&u->ring, URING_LOOP_ENTRIES)) {
+    free(u);
+    return -1;
+  }
+  if(init_uring_buffer_ring(&u->ring, &u->buffers, URING_LOOP_BUFFER_GROUP, URING_LOOP_BUFFER_COUNT, URING_LOOP_BUFFER_SIZE)) {
+    dispose_uring(&u->ring);
+    free(u);
+    return -1;
+  }
+  u->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if(u->wake_fd == -1) {
+    LOG_ERRNO("could not create wake up event");
+    dispose_uring_buffer_ring(&u->ring, &u->buffers);
+    dispose_uring(&u->ring);
+    free(u);
+    return -1;
+  }
+  u->tick.tv_sec = EVENT_LOOP_TICK / 1000;
+  u->tick.tv_nsec = (EVENT_LOOP_TICK % 1000) * 1000000;
+  u->ticking = false;
+  u->write_timeout.tv_sec = l->timeouts[CONNECTION_TIMER_WRITE] / 1000;
+  u->write_timeout.tv_nsec = (l->timeouts[CONNECTION_TIMER_WRITE] % 1000) * 1000000;
+  l->data = u;
+  return 0;
+}
+
+/**
+ * Runs the event loop
+ */
+static int run_uring_loop(struct event_loop * l) {
+  assert(l != NULL);
+
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  prepare_accept(l);
+  prepare_wake(u);
+  while(!l->stopping) {
+    // the ring only wakes up every tick while timers are running
+    if(!u->ticking && l->timers.len != 0) {
+      prepare_timeout(u);
+    }
+    if(submit_uring(&u->ring, 1) && errno != EINTR) {
+      LOG_ERRNO("error while waiting for completions");
+      return -1;
+    }
+    update_event_loop_clock(l);
+    struct io_uring_cqe * cqe;
+    while((cqe = peek_uring_cqe(&u->ring)) != NULL) {
+      uint64_t user_data = cqe->user_data;
+      int result = cqe->res;
+      unsigned flags = cqe->flags;
+      advance_uring_cq(&u->ring);
+      complete(l, user_data, result, flags);
+    }
+    dispatch_pending_connections(l, reject_connection);
+  }
+  return 0;
+}
+
+/**
+ * Hands a connection back to the event loop thread, which sends the response
+ */
+static void release_uring_connection(struct event_loop * l, struct connection * c) {
+  assert(c != NULL);
+
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  // the event loop takes all released connections at once, only the first one needs to wake it up
+  if(push_released_connection(l, c)) {
+    uint64_t value = 1;
+    if(write(u->wake_fd, &value, sizeof(uint64_t)) < 0) {
+      LOG_ERRNO("could not wake up event loop");
+    }
+  }
+}
+
+/**
+ * Wakes up the event loop
+ */
+static void wake_uring_loop(struct event_loop * l) {
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  uint64_t value = 1;
+  // nothing sensible can be done if this fails inside a signal handler
+  ssize_t result = write(u->wake_fd, &value, sizeof(uint64_t));
+  (void)result;
+}
+
+/**
+ * Disposes of the ring, closing the connections that were released but not yet sent
+ */
+static void dispose_uring_loop(struct event_loop * l) {
+  struct uring_loop * u = (struct uring_loop *)l->data;
+  struct connection * c = take_released_connections(l);
+  while(c != NULL) {
+    struct connection * next = c->next;
+    c->next = NULL;
+    close_connection(c);
+    c = next;
+  }
+  dispose_uring_buffer_ring(&u->ring, &u->buffers);
+  dispose_uring(&u->ring);
+  close(u->wake_fd);
+  free(u);
+  l->data = NULL;
+}
+
+const struct event_loop_type uring_event_loop = {
+  "io_uring",
+  init_uring_loop,
+  run_uring_loop,
+  release_uring_connection,
+  wake_uring_loop,
+  dispose_uring_loop
+};
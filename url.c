@@ -2,19 +2,11 @@
 
 #include <assert.h>
 
-void init_url_buffer(struct url_buffer * url) {
+void init_url(struct url * url) {
   assert(url != NULL);
 
-  url->host = NULL;
-  url->host_cap = 0;
+  url->host = make_empty_slice();
   url->port = 80;
-  url->path = NULL;
-  url->path_cap = 0;
-}
-
-void dispose_url_buffer(struct url_buffer * url) {
-  assert(url != NULL);
-
-  free(url->host);
-  free(url->path);
+  url->path = make_empty_slice();
+  url->query = make_empty_slice();
 }
@@ -1,23 +1,20 @@
 #ifndef URL_H
 #define URL_H
 
+#include "slice.h"
+
 #include <stdlib.h>
 #include <stdint.h>
 
 /**
- * An URL buffer
+ * The parts of an URL, as slices of the request they were parsed from
  */
-struct url_buffer {
+struct url {
   
   /**
    * The host
    */
-  char * host;
-
-  /**
-   * The capacity of the host string buffer
-   */
-  size_t host_cap;
+  struct slice host;
 
   /**
    * The port
@@ -25,24 +22,19 @@ struct url_buffer {
   uint16_t port;
   
   /**
-   * The path
+   * The path, including the leading slash
    */
-  char * path;
+  struct slice path;
 
   /**
-   * The capacity of the path string buffer
+   * The query, excluding the question mark
    */
-  size_t path_cap;
+  struct slice query;
 };
 
 /**
- * Initializes an URL buffer
- */
-void init_url_buffer(struct url_buffer * url);
-
-/**
- * Disposes of an URL buffer
+ * Initializes an URL
  */
-void dispose_url_buffer(struct url_buffer * url);
+void init_url(struct url * url);
 
 #endif